@@ -0,0 +1,289 @@
+// Aes.cpp : AES-128 encryption and AES-CMAC (RFC 4493), with AES-NI when the CPU has it.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#include "stdafx.h"
+
+#include <string.h>
+
+#include "Aes.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define AES_NI
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AES_NI_TARGET
+#else
+#define AES_NI_TARGET __attribute__((target("aes,sse2")))
+#endif
+#endif
+
+static const uint8_t SBOX[256] = {
+	0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+	0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+	0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+	0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+	0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+	0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+	0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+	0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+	0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+	0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+	0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+	0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+	0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+	0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+	0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+	0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16
+};
+
+static uint8_t xtime(uint8_t x) {
+	return (uint8_t) ((x << 1) ^ ((x & 0x80) ? 0x1B : 0));
+}
+
+void aes128_init(Aes128* aes, const uint8_t key[16]) {
+	uint8_t* w = aes->round_keys;
+	memcpy(w, key, 16);
+	uint8_t rcon = 1;
+	for (int i = 16; i < 176; i += 4) {
+		uint8_t t[4] = { w[i - 4], w[i - 3], w[i - 2], w[i - 1] };
+		if (i % 16 == 0) {
+			uint8_t first = t[0];
+			t[0] = SBOX[t[1]] ^ rcon;
+			t[1] = SBOX[t[2]];
+			t[2] = SBOX[t[3]];
+			t[3] = SBOX[first];
+			rcon = xtime(rcon);
+		}
+		for (int j = 0; j < 4; j++)
+			w[i + j] = w[i - 16 + j] ^ t[j];
+	}
+}
+
+// The state is column major, as the bytes come: s[4 * column + row].
+static void encrypt_software(const Aes128* aes, const uint8_t in[16], uint8_t out[16]) {
+	uint8_t s[16], t[16];
+	for (int i = 0; i < 16; i++)
+		s[i] = in[i] ^ aes->round_keys[i];
+	for (int round = 1; round <= 10; round++) {
+		// SubBytes and ShiftRows: row r moves r columns to the left.
+		for (int c = 0; c < 4; c++)
+			for (int r = 0; r < 4; r++)
+				t[4 * c + r] = SBOX[s[4 * ((c + r) % 4) + r]];
+		if (round < 10) {
+			for (int c = 0; c < 4; c++) {
+				uint8_t* p = t + 4 * c;
+				uint8_t all = p[0] ^ p[1] ^ p[2] ^ p[3];
+				uint8_t first = p[0];
+				p[0] ^= all ^ xtime(p[0] ^ p[1]);
+				p[1] ^= all ^ xtime(p[1] ^ p[2]);
+				p[2] ^= all ^ xtime(p[2] ^ p[3]);
+				p[3] ^= all ^ xtime(p[3] ^ first);
+			}
+		}
+		const uint8_t* k = aes->round_keys + 16 * round;
+		for (int i = 0; i < 16; i++)
+			s[i] = t[i] ^ k[i];
+	}
+	memcpy(out, s, 16);
+}
+
+#ifdef AES_NI
+
+static bool has_aes_ni() {
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 25)) != 0;
+#else
+	return __builtin_cpu_supports("aes") != 0;
+#endif
+}
+
+// Four blocks at a time keep the AES unit busy, one aesenc has a latency of several cycles.
+AES_NI_TARGET static void encrypt_hardware(const Aes128* aes, const uint8_t* in, uint8_t* out, size_t count) {
+	__m128i k[11];
+	for (int i = 0; i < 11; i++)
+		k[i] = _mm_loadu_si128((const __m128i*) (aes->round_keys + 16 * i));
+	size_t n = 0;
+	for (; n + 4 <= count; n += 4) {
+		const __m128i* src = (const __m128i*) (in + 16 * n);
+		__m128i b0 = _mm_xor_si128(_mm_loadu_si128(src), k[0]);
+		__m128i b1 = _mm_xor_si128(_mm_loadu_si128(src + 1), k[0]);
+		__m128i b2 = _mm_xor_si128(_mm_loadu_si128(src + 2), k[0]);
+		__m128i b3 = _mm_xor_si128(_mm_loadu_si128(src + 3), k[0]);
+		for (int r = 1; r < 10; r++) {
+			b0 = _mm_aesenc_si128(b0, k[r]);
+			b1 = _mm_aesenc_si128(b1, k[r]);
+			b2 = _mm_aesenc_si128(b2, k[r]);
+			b3 = _mm_aesenc_si128(b3, k[r]);
+		}
+		__m128i* dest = (__m128i*) (out + 16 * n);
+		_mm_storeu_si128(dest, _mm_aesenclast_si128(b0, k[10]));
+		_mm_storeu_si128(dest + 1, _mm_aesenclast_si128(b1, k[10]));
+		_mm_storeu_si128(dest + 2, _mm_aesenclast_si128(b2, k[10]));
+		_mm_storeu_si128(dest + 3, _mm_aesenclast_si128(b3, k[10]));
+	}
+	for (; n < count; n++) {
+		__m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (in + 16 * n)), k[0]);
+		for (int r = 1; r < 10; r++)
+			b = _mm_aesenc_si128(b, k[r]);
+		_mm_storeu_si128((__m128i*) (out + 16 * n), _mm_aesenclast_si128(b, k[10]));
+	}
+}
+
+static const bool HARDWARE = has_aes_ni();
+
+#else
+
+static const bool HARDWARE = false;
+
+#endif
+
+bool aes128_hardware() {
+	return HARDWARE;
+}
+
+// The self-test runs both implementations, everything else the one HARDWARE picks.
+static void encrypt_blocks(bool hardware, const Aes128* aes, const uint8_t* in, uint8_t* out, size_t count) {
+#ifdef AES_NI
+	if (hardware) {
+		encrypt_hardware(aes, in, out, count);
+		return;
+	}
+#else
+	(void) hardware;
+#endif
+	for (size_t n = 0; n < count; n++)
+		encrypt_software(aes, in + 16 * n, out + 16 * n);
+}
+
+void aes128_encrypt_blocks(const Aes128* aes, const uint8_t* in, uint8_t* out, size_t count) {
+	encrypt_blocks(HARDWARE, aes, in, out, count);
+}
+
+void aes128_encrypt(const Aes128* aes, const uint8_t in[16], uint8_t out[16]) {
+	encrypt_blocks(HARDWARE, aes, in, out, 1);
+}
+
+// Multiplication by x in GF(2^128), the CMAC subkey step.
+static void double_block(const uint8_t in[16], uint8_t out[16]) {
+	uint8_t carry = in[0] >> 7;
+	for (int i = 0; i < 15; i++)
+		out[i] = (uint8_t) ((in[i] << 1) | (in[i + 1] >> 7));
+	out[15] = (uint8_t) ((in[15] << 1) ^ (carry ? 0x87 : 0));
+}
+
+static void cmac_init(bool hardware, AesCmac* cmac, const uint8_t key[16]) {
+	aes128_init(&cmac->aes, key);
+	uint8_t l[16];
+	memset(l, 0, sizeof(l));
+	encrypt_blocks(hardware, &cmac->aes, l, l, 1);
+	double_block(l, cmac->k1);
+	double_block(cmac->k1, cmac->k2);
+}
+
+// A complete last block is masked with K1, a partial one is padded with 80 00.. and masked with K2.
+static void last_block(const AesCmac* cmac, const uint8_t* data, size_t length, uint8_t block[16]) {
+	const uint8_t* mask = (length == 16) ? cmac->k1 : cmac->k2;
+	for (size_t i = 0; i < 16; i++)
+		block[i] = ((i < length) ? data[i] : ((i == length) ? 0x80 : 0)) ^ mask[i];
+}
+
+void aes_cmac_final_block(const AesCmac* cmac, const uint8_t* message, size_t length, uint8_t block[16]) {
+	last_block(cmac, message, length, block);
+}
+
+static void compute_cmac(bool hardware, const AesCmac* cmac, const uint8_t* message, size_t length, uint8_t mac[16]) {
+	uint8_t x[16], block[16];
+	memset(x, 0, sizeof(x));
+	size_t blocks = (length == 0) ? 1 : (length + 15) / 16;
+	for (size_t n = 0; n + 1 < blocks; n++) {
+		for (int i = 0; i < 16; i++)
+			x[i] ^= message[16 * n + i];
+		encrypt_blocks(hardware, &cmac->aes, x, x, 1);
+	}
+	last_block(cmac, message + 16 * (blocks - 1), length - 16 * (blocks - 1), block);
+	for (int i = 0; i < 16; i++)
+		x[i] ^= block[i];
+	encrypt_blocks(hardware, &cmac->aes, x, mac, 1);
+}
+
+void aes_cmac_init(AesCmac* cmac, const uint8_t key[16]) {
+	cmac_init(HARDWARE, cmac, key);
+}
+
+void aes_cmac(const AesCmac* cmac, const uint8_t* message, size_t length, uint8_t mac[16]) {
+	compute_cmac(HARDWARE, cmac, message, length, mac);
+}
+
+// FIPS-197 appendix C.1, and the key and messages of the RFC 4493 examples (section 4).
+static const uint8_t FIPS_KEY[16] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F
+};
+static const uint8_t FIPS_PLAIN[16] = {
+	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF
+};
+static const uint8_t FIPS_CIPHER[16] = {
+	0x69, 0xC4, 0xE0, 0xD8, 0x6A, 0x7B, 0x04, 0x30, 0xD8, 0xCD, 0xB7, 0x80, 0x70, 0xB4, 0xC5, 0x5A
+};
+static const uint8_t RFC_KEY[16] = {
+	0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE, 0xD2, 0xA6, 0xAB, 0xF7, 0x15, 0x88, 0x09, 0xCF, 0x4F, 0x3C
+};
+static const uint8_t RFC_K1[16] = {
+	0xFB, 0xEE, 0xD6, 0x18, 0x35, 0x71, 0x33, 0x66, 0x7C, 0x85, 0xE0, 0x8F, 0x72, 0x36, 0xA8, 0xDE
+};
+static const uint8_t RFC_K2[16] = {
+	0xF7, 0xDD, 0xAC, 0x30, 0x6A, 0xE2, 0x66, 0xCC, 0xF9, 0x0B, 0xC1, 0x1E, 0xE4, 0x6D, 0x51, 0x3B
+};
+static const uint8_t RFC_MESSAGE[64] = {
+	0x6B, 0xC1, 0xBE, 0xE2, 0x2E, 0x40, 0x9F, 0x96, 0xE9, 0x3D, 0x7E, 0x11, 0x73, 0x93, 0x17, 0x2A,
+	0xAE, 0x2D, 0x8A, 0x57, 0x1E, 0x03, 0xAC, 0x9C, 0x9E, 0xB7, 0x6F, 0xAC, 0x45, 0xAF, 0x8E, 0x51,
+	0x30, 0xC8, 0x1C, 0x46, 0xA3, 0x5C, 0xE4, 0x11, 0xE5, 0xFB, 0xC1, 0x19, 0x1A, 0x0A, 0x52, 0xEF,
+	0xF6, 0x9F, 0x24, 0x45, 0xDF, 0x4F, 0x9B, 0x17, 0xAD, 0x2B, 0x41, 0x7B, 0xE6, 0x6C, 0x37, 0x10
+};
+static const struct {
+	size_t length;
+	uint8_t mac[16];
+} RFC_EXAMPLES[4] = {
+	{ 0, { 0xBB, 0x1D, 0x69, 0x29, 0xE9, 0x59, 0x37, 0x28, 0x7F, 0xA3, 0x7D, 0x12, 0x9B, 0x75, 0x67, 0x46 } },
+	{ 16, { 0x07, 0x0A, 0x16, 0xB4, 0x6B, 0x4D, 0x41, 0x44, 0xF7, 0x9B, 0xDD, 0x9D, 0xD0, 0x4A, 0x28, 0x7C } },
+	{ 40, { 0xDF, 0xA6, 0x67, 0x47, 0xDE, 0x9A, 0xE6, 0x30, 0x30, 0xCA, 0x32, 0x61, 0x14, 0x97, 0xC8, 0x27 } },
+	{ 64, { 0x51, 0xF0, 0xBE, 0xBF, 0x7E, 0x3B, 0x9D, 0x92, 0xFC, 0x49, 0x74, 0x17, 0x79, 0x36, 0x3C, 0xFE } }
+};
+
+static const char* self_test(bool hardware) {
+	Aes128 aes;
+	aes128_init(&aes, FIPS_KEY);
+	uint8_t in[16 * 5], out[16 * 5];
+	// Five blocks take both the four-wide loop and the single block tail of the AES-NI code.
+	for (int n = 0; n < 5; n++)
+		memcpy(in + 16 * n, FIPS_PLAIN, 16);
+	encrypt_blocks(hardware, &aes, in, out, 5);
+	for (int n = 0; n < 5; n++)
+		if (memcmp(out + 16 * n, FIPS_CIPHER, 16) != 0)
+			return "FIPS-197 C.1";
+	AesCmac key;
+	cmac_init(hardware, &key, RFC_KEY);
+	if ((memcmp(key.k1, RFC_K1, 16) != 0) || (memcmp(key.k2, RFC_K2, 16) != 0))
+		return "RFC 4493 subkeys";
+	uint8_t mac[16];
+	for (int i = 0; i < 4; i++) {
+		compute_cmac(hardware, &key, RFC_MESSAGE, RFC_EXAMPLES[i].length, mac);
+		if (memcmp(mac, RFC_EXAMPLES[i].mac, 16) != 0)
+			return "RFC 4493 example";
+	}
+	return NULL;
+}
+
+bool aes_self_test(const char** failed) {
+	*failed = self_test(false);
+	if (*failed)
+		return false;
+	if (HARDWARE)
+		*failed = self_test(true);
+	return !*failed;
+}
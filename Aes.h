@@ -0,0 +1,43 @@
+// Aes.h : AES-128 encryption and AES-CMAC (RFC 4493), with AES-NI when the CPU has it.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#ifndef _MICMD_AES_H_
+#define _MICMD_AES_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Expanded key, 11 round keys in FIPS-197 byte order. Only encryption is needed for CMAC.
+typedef struct {
+	uint8_t round_keys[176];
+} Aes128;
+
+void aes128_init(Aes128* aes, const uint8_t key[16]);
+void aes128_encrypt(const Aes128* aes, const uint8_t in[16], uint8_t out[16]);
+// ECB over count independent blocks, in and out may be the same. With AES-NI several blocks
+// are in flight at once, which is much faster than one call per block.
+void aes128_encrypt_blocks(const Aes128* aes, const uint8_t* in, uint8_t* out, size_t count);
+// True when the AES-NI instructions are used.
+bool aes128_hardware();
+
+// CMAC key with its two subkeys, derived once per key.
+typedef struct {
+	Aes128 aes;
+	uint8_t k1[16];
+	uint8_t k2[16];
+} AesCmac;
+
+void aes_cmac_init(AesCmac* cmac, const uint8_t key[16]);
+void aes_cmac(const AesCmac* cmac, const uint8_t* message, size_t length, uint8_t mac[16]);
+// The last block of a CMAC over a message of at most 16 bytes: encrypting it gives the MAC.
+// Lets callers batch many short messages through aes128_encrypt_blocks().
+void aes_cmac_final_block(const AesCmac* cmac, const uint8_t* message, size_t length, uint8_t block[16]);
+
+// Checks the software code and, when used, the AES-NI code against the FIPS-197 and RFC 4493
+// test vectors. On failure *failed names the vector that did not match.
+bool aes_self_test(const char** failed);
+
+#endif // _MICMD_AES_H_
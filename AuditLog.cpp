@@ -0,0 +1,285 @@
+// AuditLog.cpp : Asynchronous log of every tag command, JSON lines or binary records.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#include "stdafx.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <chrono>
+
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "AuditLog.h"
+
+using namespace std;
+
+const size_t AUDIT_BATCH = 256;		// events formatted into one write
+const int AUDIT_IDLE_MS = 5;		// writer sleep when the queue is empty
+
+bool audit_log_parse(const char* spec, AuditLogOptions* options) {
+	string s(spec);
+	options->format = AUDIT_JSON;
+	options->sync_ms = 1000;
+	options->queue_size = 65536;
+	// A drive letter is part of the path.
+	string::size_type from = ((s.length() > 2) && isalpha((unsigned char) s[0]) && (s[1] == ':')) ? 2 : 0;
+	string::size_type p1 = s.find(':', from);
+	string::size_type p2 = (p1 == string::npos) ? string::npos : s.find(':', p1 + 1);
+	options->path = s.substr(0, p1);
+	if (options->path.empty())
+		return false;
+	if (p1 != string::npos) {
+		string format = s.substr(p1 + 1, p2 - p1 - 1);
+		if (format == "binary")
+			options->format = AUDIT_BINARY;
+		else if (format != "json")
+			return false;
+	}
+	if (p2 != string::npos) {
+		string sync = s.substr(p2 + 1);
+		char* end;
+		if (sync == "never")
+			options->sync_ms = -1;
+		else if (sync == "batch")
+			options->sync_ms = 0;
+		else if (((options->sync_ms = strtol(sync.c_str(), &end, 10)) <= 0) || *end)
+			return false;
+	}
+	return true;
+}
+
+static bool sync_file(FILE* f) {
+#ifdef WIN32
+	return _commit(_fileno(f)) == 0;
+#else
+	return fsync(fileno(f)) == 0;
+#endif
+}
+
+static const char* event_name(mi_event_type type) {
+	switch (type) {
+	case MI_EVENT_AUTH: return "auth";
+	case MI_EVENT_READ: return "read";
+	case MI_EVENT_WRITE: return "write";
+	case MI_EVENT_VALUE: return "value";
+	}
+	return "?";
+}
+
+static const char* value_op_name(mi_value_op op) {
+	switch (op) {
+	case MI_INCREMENT: return "inc";
+	case MI_DECREMENT: return "dec";
+	case MI_RESTORE: return "restore";
+	case MI_TRANSFER: return "transfer";
+	}
+	return "?";
+}
+
+static void append_time(string* out, uint64_t time_us) {
+	time_t seconds = (time_t) (time_us / 1000000);
+	struct tm utc;
+#ifdef WIN32
+	gmtime_s(&utc, &seconds);
+#else
+	gmtime_r(&seconds, &utc);
+#endif
+	char text[40];
+	size_t n = strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &utc);
+	snprintf(text + n, sizeof(text) - n, ".%06uZ", (unsigned) (time_us % 1000000));
+	*out += text;
+}
+
+static void append_json(string* out, const AuditRecord& r) {
+	const mi_event& e = r.event;
+	char text[160];
+	*out += "{\"time\":\"";
+	append_time(out, r.time_us);
+	*out += "\",\"uid\":\"";
+	for (size_t i = 0; i < e.uid_length; i++) {
+		snprintf(text, sizeof(text), "%02X", e.uid[i]);
+		*out += text;
+	}
+	snprintf(text, sizeof(text), "\",\"event\":\"%s\",\"sector\":%u,\"block\":%u", event_name(e.type), e.sector, e.block);
+	*out += text;
+	if (e.type == MI_EVENT_AUTH)
+		*out += (e.key_type == MI_KEY_B) ? ",\"key\":\"B\"" : ",\"key\":\"A\"";
+	if (e.type == MI_EVENT_VALUE) {
+		snprintf(text, sizeof(text), ",\"op\":\"%s\",\"operand\":%d", value_op_name(e.value_op), e.operand);
+		*out += text;
+	}
+	snprintf(text, sizeof(text), ",\"status\":\"%s\"}\n", mi_status_text(e.status));
+	*out += text;
+}
+
+static void append_binary(string* out, uint64_t time_us, uint8_t event, uint8_t detail, uint8_t status,
+	const mi_event* e, int32_t operand) {
+	uint8_t record[AUDIT_RECORD_SIZE];
+	memset(record, 0, sizeof(record));
+	for (int i = 0; i < 8; i++)
+		record[i] = (uint8_t) (time_us >> (8 * i));
+	record[8] = event;
+	record[9] = detail;
+	record[10] = status;
+	if (e) {
+		record[11] = (uint8_t) e->uid_length;
+		memcpy(record + 12, e->uid, e->uid_length);
+		record[22] = e->sector;
+		record[23] = e->block;
+	}
+	for (int i = 0; i < 4; i++)
+		record[24 + i] = (uint8_t) ((uint32_t) operand >> (8 * i));
+	out->append((const char*) record, sizeof(record));
+}
+
+static void append_record(const AuditLog* log, string* out, const AuditRecord& r) {
+	const mi_event& e = r.event;
+	if (log->options.format == AUDIT_JSON)
+		append_json(out, r);
+	else
+		append_binary(out, r.time_us, (uint8_t) e.type,
+			(e.type == MI_EVENT_VALUE) ? (uint8_t) e.value_op : (uint8_t) e.key_type, (uint8_t) e.status, &e, e.operand);
+}
+
+static void append_dropped(const AuditLog* log, string* out, uint64_t time_us, uint64_t count) {
+	if (log->options.format == AUDIT_JSON) {
+		char text[64];
+		*out += "{\"time\":\"";
+		append_time(out, time_us);
+		snprintf(text, sizeof(text), "\",\"event\":\"dropped\",\"count\":%llu}\n", (unsigned long long) count);
+		*out += text;
+	}
+	else
+		append_binary(out, time_us, AUDIT_DROPPED, 0, 0, NULL, (int32_t) ((count > 0x7FFFFFFF) ? 0x7FFFFFFF : count));
+}
+
+static uint64_t now_us() {
+	return chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// The writer is the only consumer: a slot is ready when its sequence is one past its position.
+static bool pop(AuditLog* log, AuditRecord* r) {
+	AuditSlot& slot = log->slots[log->tail & log->mask];
+	if (slot.sequence.load(memory_order_acquire) != log->tail + 1)
+		return false;
+	*r = slot.record;
+	slot.sequence.store(log->tail + log->mask + 1, memory_order_release);
+	log->tail++;
+	return true;
+}
+
+void audit_log_event(const mi_event* event, void* context) {
+	AuditLog* log = (AuditLog*) context;
+	uint64_t time_us = now_us();
+	uint64_t pos = log->head.load(memory_order_relaxed);
+	AuditSlot* slot;
+	for (;;) {
+		slot = &log->slots[pos & log->mask];
+		int64_t diff = (int64_t) (slot->sequence.load(memory_order_acquire) - pos);
+		if (diff == 0) {
+			if (log->head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0) {
+			// The writer is a whole queue behind, the RF path does not wait for it.
+			log->dropped.fetch_add(1, memory_order_relaxed);
+			return;
+		}
+		else
+			pos = log->head.load(memory_order_relaxed);
+	}
+	slot->record.time_us = time_us;
+	slot->record.event = *event;
+	slot->sequence.store(pos + 1, memory_order_release);
+}
+
+static void write_batches(AuditLog* log) {
+	string batch;
+	bool unsynced = false;
+	chrono::steady_clock::time_point last_sync = chrono::steady_clock::now();
+	for (;;) {
+		// Everything queued before stop was set is visible to the pops that follow.
+		bool stopping = log->stop.load(memory_order_acquire);
+		size_t count = 0;
+		AuditRecord r;
+		batch.clear();
+		while ((count < AUDIT_BATCH) && pop(log, &r)) {
+			append_record(log, &batch, r);
+			count++;
+		}
+		uint64_t dropped = log->dropped.load(memory_order_relaxed);
+		if (dropped != log->dropped_logged) {
+			append_dropped(log, &batch, now_us(), dropped - log->dropped_logged);
+			log->dropped_logged = dropped;
+		}
+		if (!batch.empty()) {
+			if ((fwrite(batch.data(), 1, batch.size(), log->file) != batch.size()) || (fflush(log->file) != 0))
+				log->failed = true;
+			log->written += count;
+			unsynced = true;
+		}
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		if (unsynced && (log->options.sync_ms >= 0)
+			&& (stopping || (now - last_sync >= chrono::milliseconds(log->options.sync_ms)))) {
+			if (!sync_file(log->file))
+				log->failed = true;
+			unsynced = false;
+			last_sync = now;
+		}
+		if (count == AUDIT_BATCH)
+			continue;
+		if (stopping)
+			break;
+		this_thread::sleep_for(chrono::milliseconds(AUDIT_IDLE_MS));
+	}
+}
+
+AuditLog* audit_log_open(const AuditLogOptions& options) {
+	FILE* file = fopen(options.path.c_str(), (options.format == AUDIT_BINARY) ? "ab" : "a");
+	if (!file)
+		return NULL;
+	fseek(file, 0, SEEK_END);
+	if ((options.format == AUDIT_BINARY) && (ftell(file) == 0) && (fwrite(AUDIT_LOG_MAGIC, 1, 4, file) != 4)) {
+		fclose(file);
+		return NULL;
+	}
+	AuditLog* log = new AuditLog;
+	log->options = options;
+	log->file = file;
+	size_t size = 1;
+	while (size < options.queue_size)
+		size <<= 1;
+	vector<AuditSlot>(size).swap(log->slots);
+	for (size_t i = 0; i < size; i++)
+		log->slots[i].sequence.store(i, memory_order_relaxed);
+	log->mask = size - 1;
+	log->head.store(0, memory_order_relaxed);
+	log->dropped.store(0, memory_order_relaxed);
+	log->tail = 0;
+	log->written = 0;
+	log->dropped_logged = 0;
+	log->failed = false;
+	log->stop.store(false, memory_order_relaxed);
+	log->writer = thread(write_batches, log);
+	return log;
+}
+
+bool audit_log_close(AuditLog* log) {
+	if (!log)
+		return true;
+	log->stop.store(true, memory_order_release);
+	log->writer.join();
+	bool ok = !log->failed && (fclose(log->file) == 0);
+	delete log;
+	return ok;
+}
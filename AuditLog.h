@@ -0,0 +1,81 @@
+// AuditLog.h : Asynchronous log of every tag command, JSON lines or binary records.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#ifndef _MICMD_AUDIT_LOG_H_
+#define _MICMD_AUDIT_LOG_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MiSession.h"
+
+// JSON lines, one object per event:
+//   {"time":"2026-10-19T10:40:00.123456Z","uid":"01020304","event":"read","sector":1,"block":4,"status":"ok"}
+// auth adds "key":"A", value operations "op":"dec" and "operand":5. Lost events are logged as
+//   {"time":...,"event":"dropped","count":12}
+// Binary, all numbers little endian: "MCA1", then 28 byte records of uint64 time [us since
+// 1970 UTC], uint8 event (mi_event_type, 255 = dropped), uint8 key type or value op,
+// uint8 status (mi_status), uint8 uid length, uid[10], uint8 sector, uint8 block,
+// int32 operand (the count for dropped records).
+
+#define AUDIT_LOG_MAGIC "MCA1"
+#define AUDIT_RECORD_SIZE 28
+#define AUDIT_DROPPED 255
+
+typedef enum {
+	AUDIT_JSON,
+	AUDIT_BINARY
+} AuditLogFormat;
+
+typedef struct {
+	std::string path;
+	AuditLogFormat format;
+	int sync_ms;		// fsync: -1 never, 0 after every batch, otherwise at most this far apart
+	size_t queue_size;	// events waiting for the writer before new ones are dropped
+} AuditLogOptions;
+
+typedef struct {
+	uint64_t time_us;
+	mi_event event;
+} AuditRecord;
+
+// Each slot's sequence number says whose turn it is: producers claim slots with a CAS on head,
+// the writer is the only consumer.
+typedef struct {
+	std::atomic<uint64_t> sequence;
+	AuditRecord record;
+} AuditSlot;
+
+typedef struct {
+	AuditLogOptions options;
+	FILE* file;
+	std::vector<AuditSlot> slots;
+	uint64_t mask;
+	std::atomic<uint64_t> head;		// next slot to claim, all producers
+	std::atomic<uint64_t> dropped;		// events lost with the queue full
+	uint8_t padding[64];			// keeps the writer's side off the producers' cache line
+	uint64_t tail;				// writer only
+	uint64_t written;
+	uint64_t dropped_logged;
+	bool failed;					// a write or fsync failed
+	std::atomic<bool> stop;
+	std::thread writer;
+} AuditLog;
+
+// Parses "file[:json|binary[:sync]]", sync being "never", "batch" or a number of ms.
+bool audit_log_parse(const char* spec, AuditLogOptions* options);
+// Opens (appends to) the log and starts its writer thread, NULL if the file cannot be opened.
+AuditLog* audit_log_open(const AuditLogOptions& options);
+// An mi_event_handler, context is the AuditLog. Never blocks: the event is queued or dropped.
+void audit_log_event(const mi_event* event, void* context);
+// Writes what is queued, syncs and closes. Returns false if anything could not be written.
+bool audit_log_close(AuditLog* log);
+
+#endif // _MICMD_AUDIT_LOG_H_
@@ -0,0 +1,47 @@
+// CaptureRing.cpp : Lock-free single producer / single consumer ring of captured frames.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#include "stdafx.h"
+
+#include "CaptureRing.h"
+
+using namespace std;
+
+void ring_init(CaptureRing* r, size_t capacity) {
+	size_t size = 1;
+	while (size < capacity)
+		size <<= 1;
+	r->slots.resize(size);
+	r->mask = size - 1;
+	r->head.store(0, memory_order_relaxed);
+	r->tail.store(0, memory_order_relaxed);
+	r->high_water = 0;
+}
+
+TraceFrame* ring_reserve(CaptureRing* r) {
+	uint64_t head = r->head.load(memory_order_relaxed);
+	// Acquire: the consumer has finished copying out every slot it released.
+	if (head - r->tail.load(memory_order_acquire) > r->mask)
+		return NULL;
+	return &r->slots[head & r->mask];
+}
+
+void ring_publish(CaptureRing* r) {
+	uint64_t head = r->head.load(memory_order_relaxed) + 1;
+	r->head.store(head, memory_order_release);
+	uint64_t waiting = head - r->tail.load(memory_order_relaxed);
+	if (waiting > r->high_water)
+		r->high_water = waiting;
+}
+
+bool ring_pop(CaptureRing* r, TraceFrame* f) {
+	uint64_t tail = r->tail.load(memory_order_relaxed);
+	if (tail == r->head.load(memory_order_acquire))
+		return false;
+	*f = r->slots[tail & r->mask];
+	r->tail.store(tail + 1, memory_order_release);
+	return true;
+}
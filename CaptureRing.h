@@ -0,0 +1,39 @@
+// CaptureRing.h : Lock-free single producer / single consumer ring of captured frames.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#ifndef _MICMD_CAPTURE_RING_H_
+#define _MICMD_CAPTURE_RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+#include "Trace.h"
+
+// The capture thread receives straight into a reserved slot and publishes it, the writer thread
+// pops frames in order. Neither side ever waits for the other: a full ring drops the frame
+// instead. Each index is written by one side only and sits on its own cache line.
+typedef struct {
+	std::vector<TraceFrame> slots;	// capacity is a power of two
+	uint64_t mask;
+	alignas(64) std::atomic<uint64_t> head;	// frames published, written by the producer
+	uint64_t high_water;			// most frames ever waiting, producer only
+	alignas(64) std::atomic<uint64_t> tail;	// frames popped, written by the consumer
+} CaptureRing;
+
+// capacity is rounded up to a power of two.
+void ring_init(CaptureRing* r, size_t capacity);
+
+// Producer: a free slot to receive into, NULL when the ring is full.
+TraceFrame* ring_reserve(CaptureRing* r);
+// Producer: makes the reserved slot visible to the consumer.
+void ring_publish(CaptureRing* r);
+
+// Consumer: copies the oldest frame out, false when the ring is empty.
+bool ring_pop(CaptureRing* r, TraceFrame* f);
+
+#endif // _MICMD_CAPTURE_RING_H_
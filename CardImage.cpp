@@ -0,0 +1,158 @@
+// CardImage.cpp : MIFARE Classic memory layout, trailer and value block decoding, dump files.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#include "stdafx.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "CardImage.h"
+
+bool is_first_block(uint32_t uiBlock)
+{
+	// Test if we are in the small or big sectors
+	if (uiBlock < 128) return ((uiBlock)%4 == 0); else return ((uiBlock)%16 == 0);
+}
+
+bool is_trailer_block(uint32_t uiBlock)
+{
+	// Test if we are in the small or big sectors
+	if (uiBlock < 128) return ((uiBlock+1)%4 == 0); else return ((uiBlock+1)%16 == 0);
+}
+
+uint32_t get_trailer_block(uint32_t uiFirstBlock)
+{
+	// Test if we are in the small or big sectors
+	if (uiFirstBlock<128) return uiFirstBlock+3; else return uiFirstBlock+15;
+}
+
+uint32_t get_first_block(uint32_t uiSector)
+{
+	// Sectors 32-39 (4K only) have 16 blocks, the others 4 blocks
+	if (uiSector < 32) return uiSector*4; else return 128 + (uiSector-32)*16;
+}
+
+uint32_t get_sector(uint32_t uiBlock)
+{
+	if (uiBlock < 128) return uiBlock/4; else return 32 + (uiBlock-128)/16;
+}
+
+uint32_t get_sector_count(size_t card_size)
+{
+	return (card_size == MIFARE_4K_SIZE) ? 40 : 16;
+}
+
+bool decode_access_conditions(const uint8_t* trailer, AccessCondition acs[4]) {
+	const uint8_t* AC = trailer + 6;
+	uint8_t mask = 0x01;
+	bool valid = true;
+	for (int i = 0; i <= 3; i++) {
+		acs[i].c1 = ((AC[1] & (mask << (i+4))) > 0);
+		acs[i].c2 = ((AC[2] & (mask << (i))) > 0);
+		acs[i].c3 = ((AC[2] & (mask << (i+4))) > 0);
+		// Byte 6 holds ~C2 (high nibble) and ~C1 (low nibble), byte 7 low nibble ~C3.
+		valid = valid && (((AC[0] & (mask << i)) > 0) != acs[i].c1)
+			&& (((AC[0] & (mask << (i+4))) > 0) != acs[i].c2)
+			&& (((AC[1] & (mask << i)) > 0) != acs[i].c3);
+	}
+	return valid;
+}
+
+uint8_t access_bits(const AccessCondition& ac) {
+	return (ac.c1 ? 4 : 0) | (ac.c2 ? 2 : 0) | (ac.c3 ? 1 : 0);
+}
+
+uint32_t get_access_group(uint32_t uiBlock) {
+	if (uiBlock < 128)
+		return uiBlock % 4;
+	uint32_t offset = (uiBlock - 128) % 16;
+	return (offset == 15) ? 3 : offset / 5;
+}
+
+bool is_value_access(const AccessCondition& ac) {
+	// 110: read/decrement A|B, write/increment B; 001: read/decrement A|B only.
+	uint8_t bits = access_bits(ac);
+	return (bits == 6) || (bits == 1);
+}
+
+// Stored little endian on the card, as the value operand of increment/decrement.
+static int32_t le_value(const uint8_t* b) {
+	return (int32_t) (b[0] | b[1] << 8 | b[2] << 16 | (uint32_t) b[3] << 24);
+}
+
+bool decode_value_block(const uint8_t* block, int32_t* value, uint8_t* address) {
+	uint32_t v0, v1, v2;
+	memcpy(&v0, block, 4);
+	memcpy(&v1, block + 4, 4);
+	memcpy(&v2, block + 8, 4);
+	if ((v0 != v2) || (v0 != ~v1))
+		return false;
+	if ((block[12] != block[14]) || (block[13] != block[15]) || (block[12] != (uint8_t) ~block[13]))
+		return false;
+	*value = le_value(block);
+	*address = block[12];
+	return true;
+}
+
+ValueBlockStatus check_value_block(const uint8_t* block, uint8_t block_number, int32_t* value) {
+	uint32_t v0, v1, v2;
+	memcpy(&v0, block, 4);
+	memcpy(&v1, block + 4, 4);
+	memcpy(&v2, block + 8, 4);
+	bool outer = (v0 == v2);
+	bool first = (v0 == ~v1);
+	bool last = (v2 == ~v1);
+	*value = 0;
+	if (!outer && !first && !last)
+		return VALUE_CORRUPT;
+	*value = le_value((last && !outer) ? block + 8 : block);
+	if (!(outer && first))
+		return VALUE_TORN;
+	if ((block[12] != block[14]) || (block[13] != block[15]) || (block[12] != (uint8_t) ~block[13]))
+		return VALUE_BAD_ADDRESS;
+	if (block[12] != block_number)
+		return VALUE_FOREIGN_ADDRESS;
+	return VALUE_OK;
+}
+
+const char* value_block_status_name(ValueBlockStatus status) {
+	switch (status) {
+	case VALUE_OK: return "ok";
+	case VALUE_FOREIGN_ADDRESS: return "foreign-address";
+	case VALUE_BAD_ADDRESS: return "bad-address";
+	case VALUE_TORN: return "torn";
+	case VALUE_CORRUPT: return "corrupt";
+	}
+	return "?";
+}
+
+bool audit_value_blocks(const uint8_t* sector_data, uint32_t sector, std::vector<ValueBlockFinding>* findings) {
+	uint32_t first = get_first_block(sector);
+	uint32_t trailer = get_trailer_block(first);
+	AccessCondition acs[4];
+	if (!decode_access_conditions(sector_data + (trailer - first) * MIFARE_BLOCK_SIZE, acs))
+		return false;
+	// Block 0 is the manufacturer block, whatever its access bits say.
+	for (uint32_t block = (first == 0) ? 1 : first; block < trailer; block++) {
+		if (!is_value_access(acs[get_access_group(block)]))
+			continue;
+		ValueBlockFinding finding;
+		finding.block = (uint8_t) block;
+		finding.status = check_value_block(sector_data + (block - first) * MIFARE_BLOCK_SIZE, (uint8_t) block, &finding.value);
+		findings->push_back(finding);
+	}
+	return true;
+}
+
+bool load_card_image(const char* filename, CardImage* image) {
+	FILE* f = fopen(filename, "rb");
+	if (!f)
+		return false;
+	image->size = fread(image->data, 1, MIFARE_4K_SIZE, f);
+	bool longer = (fgetc(f) != EOF);
+	fclose(f);
+	return !longer && ((image->size == MIFARE_1K_SIZE) || (image->size == MIFARE_4K_SIZE));
+}
@@ -0,0 +1,74 @@
+// CardImage.h : MIFARE Classic memory layout, trailer and value block decoding, dump files.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#ifndef _MICMD_CARD_IMAGE_H_
+#define _MICMD_CARD_IMAGE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define MIFARE_1K_SIZE 1024
+#define MIFARE_4K_SIZE 4096
+#define MIFARE_BLOCK_SIZE 16
+
+// A raw card dump, 1K or 4K, blocks in order (the format written by nfc-mfclassic).
+typedef struct {
+	uint8_t data[MIFARE_4K_SIZE];
+	size_t size;
+} CardImage;
+
+typedef struct {
+	bool c1,c2,c3;
+
+} AccessCondition;
+
+bool is_first_block(uint32_t uiBlock);
+bool is_trailer_block(uint32_t uiBlock);
+uint32_t get_trailer_block(uint32_t uiFirstBlock);
+uint32_t get_first_block(uint32_t uiSector);
+uint32_t get_sector(uint32_t uiBlock);
+uint32_t get_sector_count(size_t card_size);
+
+// Fills acs[0..3] (acs[3] is the trailer) from the access bytes 6-9 of a trailer block.
+// Returns false when the inverted copies of the bits do not match, the tag would then
+// consider the sector blocked.
+bool decode_access_conditions(const uint8_t* trailer, AccessCondition acs[4]);
+// C1 C2 C3 as a 3 bit number, the row index used in the datasheet's AC tables.
+uint8_t access_bits(const AccessCondition& ac);
+// The AC group (0-3) of a block inside its sector, large 4K sectors use groups of 5 blocks.
+uint32_t get_access_group(uint32_t uiBlock);
+// Data block access conditions that make a block a value block (increment/decrement allowed).
+bool is_value_access(const AccessCondition& ac);
+
+// Checks the value block format: value, ~value, value, addr, ~addr, addr, ~addr.
+bool decode_value_block(const uint8_t* block, int32_t* value, uint8_t* address);
+
+typedef enum {
+	VALUE_OK,
+	VALUE_FOREIGN_ADDRESS,	// well-formed, but the address byte names another block
+	VALUE_BAD_ADDRESS,	// value is consistent, the address bytes are not
+	VALUE_TORN,		// only two of the three value copies agree, an interrupted write
+	VALUE_CORRUPT		// no two value copies agree
+} ValueBlockStatus;
+
+typedef struct {
+	uint8_t block;
+	ValueBlockStatus status;
+	int32_t value;		// the value the agreeing copies hold, 0 if corrupt
+} ValueBlockFinding;
+
+ValueBlockStatus check_value_block(const uint8_t* block, uint8_t block_number, int32_t* value);
+const char* value_block_status_name(ValueBlockStatus status);
+
+// Checks every block the sector trailer declares as value block. sector_data holds all
+// blocks of the sector including the trailer. Returns false if the access bits are invalid.
+bool audit_value_blocks(const uint8_t* sector_data, uint32_t sector, std::vector<ValueBlockFinding>* findings);
+
+// Loads a 1K or 4K dump, anything of another size is rejected.
+bool load_card_image(const char* filename, CardImage* image);
+
+#endif // _MICMD_CARD_IMAGE_H_
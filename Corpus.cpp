@@ -0,0 +1,630 @@
+// Corpus.cpp : Fleet-wide statistics over directories of card dumps.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#include "stdafx.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "CardImage.h"
+#include "Corpus.h"
+#include "Crypto1.h"
+#include "SectorStore.h"
+
+using namespace std;
+
+static const char* DATA_ACCESS_NAMES[8] = {
+	"000 transport, read/write/value by A|B",
+	"001 value, read/decrement by A|B",
+	"010 read-only by A|B",
+	"011 read/write by B only",
+	"100 read by A|B, write by B",
+	"101 read-only by B",
+	"110 value, read/decrement A|B, write/increment B",
+	"111 dead block"
+};
+
+static const char* TRAILER_ACCESS_NAMES[8] = {
+	"000 keys written by A",
+	"001 transport configuration",
+	"010 keys and AC frozen, readable by A",
+	"011 keys and AC written by B",
+	"100 keys written by B, AC frozen",
+	"101 AC written by B, keys frozen",
+	"110 keys and AC frozen",
+	"111 keys and AC frozen"
+};
+
+typedef struct {
+	string file;
+	uint32_t sector;
+	const char* what;
+} Anomaly;
+
+// Listed by file, then by sector number.
+static bool anomaly_before(const Anomaly& a, const Anomaly& b) {
+	int c = a.file.compare(b.file);
+	if (c != 0)
+		return c < 0;
+	return (a.sector != b.sector) ? (a.sector < b.sector) : (strcmp(a.what, b.what) < 0);
+}
+
+typedef struct {
+	uint64_t images, images_1k, images_4k, skipped;
+	uint64_t sectors;
+	unordered_map<uint64_t, uint64_t> key_a, key_b;	// key -> sectors using it
+	unordered_map<uint32_t, uint64_t> access_bytes;	// trailer bytes 6-9 -> sectors
+	uint64_t data_access[8], trailer_access[8];
+	uint64_t value_blocks, malformed_value_blocks, misaddressed_value_blocks;
+	int64_t value_min, value_max, value_sum;
+	uint64_t invalid_access, same_keys, same_keys_cards, anomalies;
+	vector<Anomaly> anomaly_list;	// the first max_anomalies in list order, and some more
+} CorpusStats;
+
+static void stats_init(CorpusStats* s) {
+	s->images = s->images_1k = s->images_4k = s->skipped = s->sectors = 0;
+	memset(s->data_access, 0, sizeof(s->data_access));
+	memset(s->trailer_access, 0, sizeof(s->trailer_access));
+	s->value_blocks = s->malformed_value_blocks = s->misaddressed_value_blocks = 0;
+	s->value_min = INT32_MAX;
+	s->value_max = INT32_MIN;
+	s->value_sum = 0;
+	s->invalid_access = s->same_keys = s->same_keys_cards = s->anomalies = 0;
+}
+
+// Keeps only the first max anomalies in list order, which ones those are is only known
+// once every worker is done.
+static void keep_first(vector<Anomaly>* list, size_t max) {
+	if (list->size() <= max)
+		return;
+	nth_element(list->begin(), list->begin() + max, list->end(), anomaly_before);
+	list->resize(max);
+}
+
+static void anomaly(CorpusStats* s, const CorpusOptions& options, const string& file, uint32_t sector, const char* what) {
+	s->anomalies++;
+	if (options.max_anomalies == 0)
+		return;
+	Anomaly a;
+	a.file = file;
+	a.sector = sector;
+	a.what = what;
+	s->anomaly_list.push_back(a);
+	// Trimmed in batches, not on every anomaly.
+	if (s->anomaly_list.size() >= 2 * options.max_anomalies)
+		keep_first(&s->anomaly_list, options.max_anomalies);
+}
+
+static void analyse_image(const CardImage& image, const string& file, const CorpusOptions& options, CorpusStats* s) {
+	s->images++;
+	if (image.size == MIFARE_4K_SIZE)
+		s->images_4k++;
+	else
+		s->images_1k++;
+
+	uint32_t same_keys = 0;
+	for (uint32_t sector = 0; sector < get_sector_count(image.size); sector++) {
+		uint32_t first = get_first_block(sector);
+		uint32_t trailer = get_trailer_block(first);
+		const uint8_t* t = image.data + trailer * MIFARE_BLOCK_SIZE;
+		uint32_t bytes;
+		memcpy(&bytes, t + 6, 4);
+		s->sectors++;
+		s->key_a[key_from_bytes(t)]++;
+		s->key_b[key_from_bytes(t + 10)]++;
+		s->access_bytes[bytes]++;
+		if (memcmp(t, t + 10, 6) == 0)
+			same_keys++;
+
+		AccessCondition acs[4];
+		if (!decode_access_conditions(t, acs)) {
+			s->invalid_access++;
+			anomaly(s, options, file, sector, "inverted AC bits do not match (sector blocked)");
+			continue;
+		}
+		s->trailer_access[access_bits(acs[3])]++;
+		for (uint32_t block = first; block < trailer; block++) {
+			const AccessCondition& ac = acs[get_access_group(block)];
+			s->data_access[access_bits(ac)]++;
+			if (!is_value_access(ac) || (block == 0))
+				continue;
+			int32_t value;
+			uint8_t address;
+			if (!decode_value_block(image.data + block * MIFARE_BLOCK_SIZE, &value, &address)) {
+				s->malformed_value_blocks++;
+				anomaly(s, options, file, sector, "malformed value block");
+				continue;
+			}
+			s->value_blocks++;
+			if (address != block)
+				s->misaddressed_value_blocks++;
+			s->value_min = min<int64_t>(s->value_min, value);
+			s->value_max = max<int64_t>(s->value_max, value);
+			s->value_sum += value;
+		}
+	}
+	// Transport cards and many fleets use one key for both, listing each would bury the rest.
+	if (same_keys) {
+		s->same_keys += same_keys;
+		s->same_keys_cards++;
+	}
+}
+
+static void stats_merge(CorpusStats* into, const CorpusStats& from, const CorpusOptions& options) {
+	into->images += from.images;
+	into->images_1k += from.images_1k;
+	into->images_4k += from.images_4k;
+	into->skipped += from.skipped;
+	into->sectors += from.sectors;
+	for (unordered_map<uint64_t, uint64_t>::const_iterator i = from.key_a.begin(); i != from.key_a.end(); ++i)
+		into->key_a[i->first] += i->second;
+	for (unordered_map<uint64_t, uint64_t>::const_iterator i = from.key_b.begin(); i != from.key_b.end(); ++i)
+		into->key_b[i->first] += i->second;
+	for (unordered_map<uint32_t, uint64_t>::const_iterator i = from.access_bytes.begin(); i != from.access_bytes.end(); ++i)
+		into->access_bytes[i->first] += i->second;
+	for (int i = 0; i < 8; i++) {
+		into->data_access[i] += from.data_access[i];
+		into->trailer_access[i] += from.trailer_access[i];
+	}
+	into->value_blocks += from.value_blocks;
+	into->malformed_value_blocks += from.malformed_value_blocks;
+	into->misaddressed_value_blocks += from.misaddressed_value_blocks;
+	into->value_min = min(into->value_min, from.value_min);
+	into->value_max = max(into->value_max, from.value_max);
+	into->value_sum += from.value_sum;
+	into->invalid_access += from.invalid_access;
+	into->same_keys += from.same_keys;
+	into->same_keys_cards += from.same_keys_cards;
+	into->anomalies += from.anomalies;
+	into->anomaly_list.insert(into->anomaly_list.end(), from.anomaly_list.begin(), from.anomaly_list.end());
+	keep_first(&into->anomaly_list, options.max_anomalies);
+}
+
+template <typename K>
+static void print_top(ostream& out, const unordered_map<K, uint64_t>& counts, size_t top, int digits, uint64_t total) {
+	vector<pair<uint64_t, K> > sorted;
+	sorted.reserve(counts.size());
+	for (typename unordered_map<K, uint64_t>::const_iterator i = counts.begin(); i != counts.end(); ++i)
+		sorted.push_back(make_pair(i->second, i->first));
+	size_t n = min(top, sorted.size());
+	partial_sort(sorted.begin(), sorted.begin() + n, sorted.end(), greater<pair<uint64_t, K> >());
+	for (size_t i = 0; i < n; i++) {
+		char line[80];
+		snprintf(line, sizeof(line), "  %0*llX  %10llu sectors (%5.1f%%)", digits, (unsigned long long) sorted[i].second,
+			(unsigned long long) sorted[i].first, 100.0 * sorted[i].first / total);
+		out << line << "\n";
+	}
+}
+
+static void print_report(ostream& out, const CorpusStats& s, const CorpusOptions& options) {
+	out << "Images: " << s.images << " (1K: " << s.images_1k << ", 4K: " << s.images_4k << "), skipped "
+		<< s.skipped << " files that are not 1K/4K dumps\n";
+	out << "Sectors: " << s.sectors << "\n";
+	if (s.sectors == 0)
+		return;
+
+	out << "\nKey reuse: " << s.key_a.size() << " distinct A keys, " << s.key_b.size() << " distinct B keys\n";
+	out << "Most common A keys:\n";
+	print_top(out, s.key_a, options.top, 12, s.sectors);
+	out << "Most common B keys:\n";
+	print_top(out, s.key_b, options.top, 12, s.sectors);
+
+	// access_bytes keys are the raw bytes read as a little endian word, print them in card order
+	unordered_map<uint32_t, uint64_t> access;
+	for (unordered_map<uint32_t, uint64_t>::const_iterator i = s.access_bytes.begin(); i != s.access_bytes.end(); ++i) {
+		uint32_t b = i->first;
+		access[(b & 0xff) << 24 | (b >> 8 & 0xff) << 16 | (b >> 16 & 0xff) << 8 | b >> 24] = i->second;
+	}
+	out << "\nMost common access bytes (trailer bytes 6-9), " << access.size() << " distinct:\n";
+	print_top(out, access, options.top, 8, s.sectors);
+
+	out << "\nData block access conditions (C1 C2 C3):\n";
+	for (int i = 0; i < 8; i++)
+		out << "  " << DATA_ACCESS_NAMES[i] << ": " << s.data_access[i] << "\n";
+	out << "Trailer access conditions (C1 C2 C3):\n";
+	for (int i = 0; i < 8; i++)
+		out << "  " << TRAILER_ACCESS_NAMES[i] << ": " << s.trailer_access[i] << "\n";
+
+	out << "\nValue blocks: " << s.value_blocks << " well-formed, " << s.malformed_value_blocks << " malformed, "
+		<< s.misaddressed_value_blocks << " with a foreign address byte\n";
+	if (s.value_blocks)
+		out << "  values from " << s.value_min << " to " << s.value_max << ", mean " << (double) s.value_sum / s.value_blocks << "\n";
+
+	out << "\nKey A = key B: " << s.same_keys << " sectors on " << s.same_keys_cards << " cards\n";
+	out << "Anomalies: " << s.anomalies << " (" << s.invalid_access << " blocked sectors, "
+		<< s.malformed_value_blocks << " malformed value blocks)\n";
+	for (size_t i = 0; i < s.anomaly_list.size(); i++) {
+		const Anomaly& a = s.anomaly_list[i];
+		out << "  " << a.file << " sector " << a.sector << ": " << a.what << "\n";
+	}
+	if (s.anomalies > s.anomaly_list.size())
+		out << "  ... " << (s.anomalies - s.anomaly_list.size()) << " more\n";
+}
+
+bool list_files(const string& path, vector<string>* files) {
+#ifdef WIN32
+	DWORD attributes = GetFileAttributesA(path.c_str());
+	if (attributes == INVALID_FILE_ATTRIBUTES)
+		return false;
+	if (!(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		files->push_back(path);
+		return true;
+	}
+	WIN32_FIND_DATAA found;
+	HANDLE h = FindFirstFileA((path + "\\*").c_str(), &found);
+	if (h == INVALID_HANDLE_VALUE)
+		return true;
+	do {
+		if (strcmp(found.cFileName, ".") && strcmp(found.cFileName, ".."))
+			list_files(path + "\\" + found.cFileName, files);
+	} while (FindNextFileA(h, &found));
+	FindClose(h);
+	return true;
+#else
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		return false;
+	if (!S_ISDIR(st.st_mode)) {
+		if (S_ISREG(st.st_mode))
+			files->push_back(path);
+		return true;
+	}
+	DIR* dir = opendir(path.c_str());
+	if (!dir)
+		return false;
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL)
+		if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+			list_files(path + "/" + entry->d_name, files);
+	closedir(dir);
+	return true;
+#endif
+}
+
+static unsigned worker_count(unsigned threads) {
+	if (threads == 0)
+		threads = thread::hardware_concurrency();
+	return threads ? threads : 1;
+}
+
+// The images to scan: the dump files below a directory, or the cards of a sector store archive.
+typedef struct {
+	bool archive;
+	vector<string> files;
+	SectorStore store;
+} ImageSource;
+
+static bool open_source(const char* path, ImageSource* source) {
+	source->archive = is_store(path);
+	if (source->archive)
+		return store_load(path, &source->store);
+	if (!list_files(path, &source->files))
+		return false;
+	sort(source->files.begin(), source->files.end());
+	return true;
+}
+
+// Loads every image with a pool of worker threads and calls fn(worker, name, image), image is NULL
+// for files that are not 1K/4K dumps. Workers pull the next image index, so the calls for one worker
+// are serial and fn can keep per-worker state indexed by worker.
+template <typename Fn>
+static void for_each_image(const ImageSource& source, unsigned threads, Fn fn) {
+	size_t count = source.archive ? source.store.cards.size() : source.files.size();
+	atomic<size_t> next(0);
+	vector<thread> workers;
+	for (unsigned t = 0; t < threads; t++) {
+		workers.push_back(thread([&, t]() {
+			CardImage image;
+			size_t i;
+			while ((i = next++) < count) {
+				if (source.archive) {
+					store_get_image(source.store, i, &image);
+					fn(t, source.store.cards[i].name, &image);
+				}
+				else
+					fn(t, source.files[i], load_card_image(source.files[i].c_str(), &image) ? &image : NULL);
+			}
+		}));
+	}
+	for (unsigned t = 0; t < threads; t++)
+		workers[t].join();
+}
+
+bool analyse_corpus(const char* path, const CorpusOptions& options, ostream& out) {
+	ImageSource source;
+	if (!open_source(path, &source))
+		return false;
+
+	unsigned threads = worker_count(options.threads);
+	vector<CorpusStats> partial(threads);
+	for (unsigned t = 0; t < threads; t++)
+		stats_init(&partial[t]);
+	for_each_image(source, threads, [&](unsigned t, const string& file, const CardImage* image) {
+		if (image)
+			analyse_image(*image, file, options, &partial[t]);
+		else
+			partial[t].skipped++;
+	});
+
+	CorpusStats total;
+	stats_init(&total);
+	for (unsigned t = 0; t < threads; t++)
+		stats_merge(&total, partial[t], options);
+	sort(total.anomaly_list.begin(), total.anomaly_list.end(), anomaly_before);
+	print_report(out, total, options);
+	return true;
+}
+
+string format_value_finding(const string& source, uint32_t sector, const ValueBlockFinding& finding) {
+	ostringstream line;
+	line << source << " sector " << sector << " block " << (int) finding.block << ": " << value_block_status_name(finding.status);
+	if (finding.status != VALUE_CORRUPT)
+		line << ", value " << finding.value;
+	return line.str();
+}
+
+typedef struct {
+	uint64_t images, skipped, blocked_sectors;
+	uint64_t status[VALUE_CORRUPT + 1];
+	vector<string> lines;
+} AuditStats;
+
+static void audit_image(const CardImage& image, const string& file, bool all, AuditStats* s) {
+	s->images++;
+	vector<ValueBlockFinding> findings;
+	for (uint32_t sector = 0; sector < get_sector_count(image.size); sector++) {
+		findings.clear();
+		if (!audit_value_blocks(image.data + get_first_block(sector) * MIFARE_BLOCK_SIZE, sector, &findings)) {
+			s->blocked_sectors++;
+			continue;
+		}
+		for (size_t i = 0; i < findings.size(); i++) {
+			s->status[findings[i].status]++;
+			if ((findings[i].status != VALUE_OK) || all)
+				s->lines.push_back(format_value_finding(file, sector, findings[i]));
+		}
+	}
+}
+
+bool audit_corpus(const char* path, const AuditOptions& options, ostream& out, uint64_t* problems) {
+	ImageSource source;
+	if (!open_source(path, &source))
+		return false;
+
+	unsigned threads = worker_count(options.threads);
+	vector<AuditStats> partial(threads);
+	for (unsigned t = 0; t < threads; t++) {
+		partial[t].images = partial[t].skipped = partial[t].blocked_sectors = 0;
+		memset(partial[t].status, 0, sizeof(partial[t].status));
+	}
+	for_each_image(source, threads, [&](unsigned t, const string& file, const CardImage* image) {
+		if (image)
+			audit_image(*image, file, options.all, &partial[t]);
+		else
+			partial[t].skipped++;
+	});
+
+	AuditStats total = partial[0];
+	for (unsigned t = 1; t < threads; t++) {
+		total.images += partial[t].images;
+		total.skipped += partial[t].skipped;
+		total.blocked_sectors += partial[t].blocked_sectors;
+		for (int i = 0; i <= VALUE_CORRUPT; i++)
+			total.status[i] += partial[t].status[i];
+		total.lines.insert(total.lines.end(), partial[t].lines.begin(), partial[t].lines.end());
+	}
+	sort(total.lines.begin(), total.lines.end());
+	for (size_t i = 0; i < total.lines.size(); i++)
+		out << total.lines[i] << "\n";
+
+	uint64_t blocks = 0;
+	for (int i = 0; i <= VALUE_CORRUPT; i++)
+		blocks += total.status[i];
+	out << "\nImages: " << total.images << ", skipped " << total.skipped << " files that are not 1K/4K dumps\n";
+	out << "Value blocks: " << blocks << "\n";
+	for (int i = 0; i <= VALUE_CORRUPT; i++)
+		out << "  " << value_block_status_name((ValueBlockStatus) i) << ": " << total.status[i] << "\n";
+	out << "Sectors with invalid access bits (not audited): " << total.blocked_sectors << "\n";
+	// A foreign address byte is legal, applications use it as a backup pointer.
+	*problems = blocks - total.status[VALUE_OK] - total.status[VALUE_FOREIGN_ADDRESS] + total.blocked_sectors;
+	return true;
+}
+
+// -- Pattern search --
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define SEARCH_SSE2
+#include <emmintrin.h>
+#endif
+
+static int lowest_bit(uint32_t mask) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int) index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// Calls found(position) for every occurrence of pattern in data, overlapping ones included.
+// 16 candidate positions at a time are checked against the first and the last pattern byte,
+// only positions matching both are compared in full.
+template <typename Fn>
+static void find_all(const uint8_t* data, size_t length, const uint8_t* pattern, size_t pattern_length, Fn found) {
+	if ((pattern_length == 0) || (pattern_length > length))
+		return;
+	size_t last = pattern_length - 1;
+	size_t pos = 0;
+#ifdef SEARCH_SSE2
+	const __m128i first_byte = _mm_set1_epi8((char) pattern[0]);
+	const __m128i last_byte = _mm_set1_epi8((char) pattern[last]);
+	for (; pos + last + 16 <= length; pos += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*) (data + pos));
+		__m128i b = _mm_loadu_si128((const __m128i*) (data + pos + last));
+		uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first_byte), _mm_cmpeq_epi8(b, last_byte)));
+		while (mask) {
+			int bit = lowest_bit(mask);
+			if (memcmp(data + pos + bit, pattern, pattern_length) == 0)
+				found(pos + bit);
+			mask &= mask - 1;
+		}
+	}
+#endif
+	for (; pos + last < length; pos++) {
+		const uint8_t* p = (const uint8_t*) memchr(data + pos, pattern[0], length - last - pos);
+		if (!p)
+			return;
+		pos = p - data;
+		if (memcmp(p, pattern, pattern_length) == 0)
+			found(pos);
+	}
+}
+
+// A 4 byte UID is followed by its BCC in block 0, otherwise the UID is 7 bytes long.
+static string image_uid(const uint8_t* block0) {
+	size_t length = ((block0[0] ^ block0[1] ^ block0[2] ^ block0[3]) == block0[4]) ? 4 : 7;
+	char text[16];
+	for (size_t i = 0; i < length; i++)
+		snprintf(text + 2 * i, 3, "%02X", block0[i]);
+	return text;
+}
+
+static string format_hit(const string& name, const string& uid, uint32_t sector, size_t position) {
+	char text[80];
+	snprintf(text, sizeof(text), " %s sector %u block %u +%u", uid.c_str(), sector,
+		(unsigned) (get_first_block(sector) + position / MIFARE_BLOCK_SIZE), (unsigned) (position % MIFARE_BLOCK_SIZE));
+	return name + text;
+}
+
+static uint32_t sector_bytes(uint32_t sector) {
+	uint32_t first = get_first_block(sector);
+	return (get_trailer_block(first) - first + 1) * MIFARE_BLOCK_SIZE;
+}
+
+// An archive stores every distinct sector once: those are scanned, then the hits are mapped to
+// the cards through the manifests. Sectors are keyed by offset and size, a 1K sector may share
+// its bytes with the start of a 4K one.
+static void search_store(const SectorStore& store, const SearchOptions& options, unsigned threads,
+	vector<string>* lines, SearchStats* stats) {
+	vector<uint64_t> keys;
+	for (size_t c = 0; c < store.cards.size(); c++)
+		for (uint32_t s = 0; s < store.cards[c].sector_count; s++)
+			keys.push_back((store.cards[c].offsets[s] << 1) | (sector_bytes(s) > 64 ? 1 : 0));
+	sort(keys.begin(), keys.end());
+	keys.erase(unique(keys.begin(), keys.end()), keys.end());
+
+	vector<vector<pair<uint64_t, uint16_t> > > partial(threads);
+	atomic<size_t> next(0);
+	const size_t CHUNK = 4096;
+	vector<thread> workers;
+	for (unsigned t = 0; t < threads; t++) {
+		workers.push_back(thread([&, t]() {
+			size_t first;
+			while ((first = next.fetch_add(CHUNK)) < keys.size()) {
+				size_t end = min(first + CHUNK, keys.size());
+				for (size_t i = first; i < end; i++) {
+					uint64_t key = keys[i];
+					find_all(&store.sectors[key >> 1], (key & 1) ? 256 : 64, &options.pattern[0], options.pattern.size(),
+						[&](size_t position) { partial[t].push_back(make_pair(key, (uint16_t) position)); });
+				}
+			}
+		}));
+	}
+	for (unsigned t = 0; t < threads; t++)
+		workers[t].join();
+
+	unordered_map<uint64_t, vector<uint16_t> > hits;
+	for (unsigned t = 0; t < threads; t++)
+		for (size_t i = 0; i < partial[t].size(); i++)
+			hits[partial[t][i].first].push_back(partial[t][i].second);
+	for (size_t i = 0; i < keys.size(); i++)
+		stats->scanned_bytes += (keys[i] & 1) ? 256 : 64;
+	stats->images = store.cards.size();
+	if (hits.empty())
+		return;
+	for (size_t c = 0; c < store.cards.size(); c++) {
+		const StoreManifest& m = store.cards[c];
+		bool matched = false;
+		for (uint32_t s = 0; s < m.sector_count; s++) {
+			unordered_map<uint64_t, vector<uint16_t> >::const_iterator h = hits.find((m.offsets[s] << 1) | (sector_bytes(s) > 64 ? 1 : 0));
+			if (h == hits.end())
+				continue;
+			vector<uint16_t> positions = h->second;
+			sort(positions.begin(), positions.end());
+			string uid = image_uid(&store.sectors[m.offsets[0]]);
+			for (size_t i = 0; i < positions.size(); i++)
+				lines->push_back(format_hit(m.name, uid, s, positions[i]));
+			stats->hits += positions.size();
+			matched = true;
+		}
+		if (matched)
+			stats->matching_images++;
+	}
+}
+
+bool search_corpus(const char* path, const SearchOptions& options, ostream& out, SearchStats* stats) {
+	memset(stats, 0, sizeof(*stats));
+	ImageSource source;
+	if (options.pattern.empty() || !open_source(path, &source))
+		return false;
+	unsigned threads = worker_count(options.threads);
+	vector<string> lines;
+	if (source.archive)
+		search_store(source.store, options, threads, &lines, stats);
+	else {
+		vector<vector<pair<string, string> > > partial(threads);
+		vector<SearchStats> counts(threads);
+		memset(&counts[0], 0, threads * sizeof(SearchStats));
+		for_each_image(source, threads, [&](unsigned t, const string& file, const CardImage* image) {
+			if (!image)
+				return;
+			counts[t].images++;
+			counts[t].scanned_bytes += image->size;
+			string uid = image_uid(image->data);
+			uint64_t before = counts[t].hits;
+			for (uint32_t s = 0; s < get_sector_count(image->size); s++)
+				find_all(image->data + get_first_block(s) * MIFARE_BLOCK_SIZE, sector_bytes(s), &options.pattern[0], options.pattern.size(),
+					[&](size_t position) {
+						partial[t].push_back(make_pair(file, format_hit(file, uid, s, position)));
+						counts[t].hits++;
+					});
+			if (counts[t].hits != before)
+				counts[t].matching_images++;
+		});
+		vector<pair<string, string> > found;
+		for (unsigned t = 0; t < threads; t++) {
+			found.insert(found.end(), partial[t].begin(), partial[t].end());
+			stats->images += counts[t].images;
+			stats->scanned_bytes += counts[t].scanned_bytes;
+			stats->hits += counts[t].hits;
+			stats->matching_images += counts[t].matching_images;
+		}
+		// Files in name order, the hits of one file stay in card order.
+		stable_sort(found.begin(), found.end(), [](const pair<string, string>& a, const pair<string, string>& b) {
+			return a.first < b.first;
+		});
+		for (size_t i = 0; i < found.size(); i++)
+			lines.push_back(found[i].second);
+	}
+	for (size_t i = 0; i < lines.size(); i++)
+		out << lines[i] << "\n";
+	return true;
+}
@@ -0,0 +1,60 @@
+// Corpus.h : Fleet-wide statistics over directories of card dumps.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#ifndef _MICMD_CORPUS_H_
+#define _MICMD_CORPUS_H_
+
+#include <stddef.h>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "CardImage.h"
+
+typedef struct {
+	unsigned threads;	// 0 = one per core
+	size_t top;		// entries listed in the "most common" tables
+	size_t max_anomalies;	// anomalies listed individually, the rest are only counted
+} CorpusOptions;
+
+// Recursively collects the regular files below path (or path itself if it is a file).
+bool list_files(const std::string& path, std::vector<std::string>* files);
+
+// Scans every dump below path, or every card of the sector store archive at path, with a pool
+// of worker threads and writes the report to out.
+bool analyse_corpus(const char* path, const CorpusOptions& options, std::ostream& out);
+
+typedef struct {
+	unsigned threads;	// 0 = one per core
+	bool all;		// list healthy value blocks too
+} AuditOptions;
+
+// One report line for a value block finding, shared by the dump and the live card audit.
+std::string format_value_finding(const std::string& source, uint32_t sector, const ValueBlockFinding& finding);
+
+// Checks every value block in the dumps below path, or in the archive at path. problems receives
+// the number of torn, corrupt or misaddressed value blocks plus sectors whose access bits could not
+// be decoded.
+bool audit_corpus(const char* path, const AuditOptions& options, std::ostream& out, uint64_t* problems);
+
+typedef struct {
+	unsigned threads;	// 0 = one per core
+	std::vector<uint8_t> pattern;
+} SearchOptions;
+
+typedef struct {
+	uint64_t images;
+	uint64_t scanned_bytes;		// an archive scans each distinct sector once
+	uint64_t hits;
+	uint64_t matching_images;
+} SearchStats;
+
+// Finds every occurrence of the pattern in the dumps below path, or in the cards of the archive
+// at path, and writes one line per hit: name, UID, sector, block and offset in the block. A hit
+// lies within one sector, it may span blocks.
+bool search_corpus(const char* path, const SearchOptions& options, std::ostream& out, SearchStats* stats);
+
+#endif // _MICMD_CORPUS_H_
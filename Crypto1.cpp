@@ -0,0 +1,92 @@
+// Crypto1.cpp : Software implementation of the MIFARE Classic Crypto1 stream cipher.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#include "stdafx.h"
+
+#include "Crypto1.h"
+
+#define LF_POLY_ODD (0x29CE5C)
+#define LF_POLY_EVEN (0x870804)
+#define BIT(x, n) ((x) >> (n) & 1)
+#define BEBIT(x, n) BIT(x, (n) ^ 24)
+
+static inline uint32_t parity(uint32_t x) {
+	x ^= x >> 16;
+	x ^= x >> 8;
+	x ^= x >> 4;
+	return BIT(0x6996, x & 0xf);
+}
+
+// Two layer non-linear filter over the 20 odd LFSR bits used by Crypto1.
+static inline uint8_t filter(uint32_t x) {
+	uint32_t f;
+	f  = 0xf22c0 >> (x       & 0xf) & 16;
+	f |= 0x6c9c0 >> (x >>  4 & 0xf) &  8;
+	f |= 0x3c8b0 >> (x >>  8 & 0xf) &  4;
+	f |= 0x1e458 >> (x >> 12 & 0xf) &  2;
+	f |= 0x0d938 >> (x >> 16 & 0xf) &  1;
+	return BIT(0xEC57E80A, f);
+}
+
+void crypto1_init(Crypto1State* s, uint64_t key) {
+	s->odd = s->even = 0;
+	for (int i = 47; i > 0; i -= 2) {
+		s->odd  = s->odd  << 1 | BIT(key, (i - 1) ^ 7);
+		s->even = s->even << 1 | BIT(key, i ^ 7);
+	}
+}
+
+uint8_t crypto1_bit(Crypto1State* s, uint8_t in, bool is_encrypted) {
+	uint8_t ret = filter(s->odd);
+	uint32_t feedin = ret & (is_encrypted ? 1 : 0);
+	feedin ^= (in ? 1 : 0);
+	feedin ^= LF_POLY_ODD & s->odd;
+	feedin ^= LF_POLY_EVEN & s->even;
+	s->even = s->even << 1 | parity(feedin);
+
+	// The new bit lands on an even position, so the halves swap roles.
+	uint32_t tmp = s->odd;
+	s->odd = s->even;
+	s->even = tmp;
+	return ret;
+}
+
+uint8_t crypto1_byte(Crypto1State* s, uint8_t in, bool is_encrypted) {
+	uint8_t ret = 0;
+	for (int i = 0; i < 8; i++)
+		ret |= crypto1_bit(s, BIT(in, i), is_encrypted) << i;
+	return ret;
+}
+
+uint32_t crypto1_word(Crypto1State* s, uint32_t in, bool is_encrypted) {
+	uint32_t ret = 0;
+	for (int i = 0; i < 32; i++)
+		ret |= (uint32_t) crypto1_bit(s, BEBIT(in, i), is_encrypted) << (i ^ 24);
+	return ret;
+}
+
+static inline uint32_t swap_endian(uint32_t x) {
+	x = (x >> 8 & 0xff00ff) | (x & 0xff00ff) << 8;
+	return x >> 16 | x << 16;
+}
+
+uint32_t prng_successor(uint32_t x, uint32_t n) {
+	x = swap_endian(x);
+	while (n--)
+		x = x >> 1 | (x >> 16 ^ x >> 18 ^ x >> 19 ^ x >> 21) << 31;
+	return swap_endian(x);
+}
+
+uint64_t key_from_bytes(const uint8_t* key) {
+	uint64_t k = 0;
+	for (int i = 0; i < 6; i++)
+		k = k << 8 | key[i];
+	return k;
+}
+
+uint32_t word_from_bytes(const uint8_t* data) {
+	return (uint32_t) data[0] << 24 | (uint32_t) data[1] << 16 | (uint32_t) data[2] << 8 | data[3];
+}
@@ -0,0 +1,35 @@
+// Crypto1.h : Software implementation of the MIFARE Classic Crypto1 stream cipher.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#ifndef _MICMD_CRYPTO1_H_
+#define _MICMD_CRYPTO1_H_
+
+#include <stdint.h>
+
+// The 48 bit LFSR, split into the bits at odd and even positions. The filter function only
+// taps odd positions, which lets every step be computed with a few table lookups.
+typedef struct {
+	uint32_t odd;
+	uint32_t even;
+} Crypto1State;
+
+// 48 bit key, most significant byte is the first key byte as typed by the user.
+void crypto1_init(Crypto1State* s, uint64_t key);
+
+// Clocks the LFSR once, shifting in "in" (and the keystream bit when is_encrypted is set,
+// used while the reader nonce is fed in encrypted). Returns the keystream bit.
+uint8_t crypto1_bit(Crypto1State* s, uint8_t in, bool is_encrypted);
+uint8_t crypto1_byte(Crypto1State* s, uint8_t in, bool is_encrypted);
+// Words are taken and returned in wire order, big endian, bits of each byte LSB first.
+uint32_t crypto1_word(Crypto1State* s, uint32_t in, bool is_encrypted);
+
+// The tag's 16 bit PRNG advanced by n steps, used to check the reader and tag answers.
+uint32_t prng_successor(uint32_t x, uint32_t n);
+
+uint64_t key_from_bytes(const uint8_t* key);
+uint32_t word_from_bytes(const uint8_t* data);
+
+#endif // _MICMD_CRYPTO1_H_
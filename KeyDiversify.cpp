@@ -0,0 +1,99 @@
+// KeyDiversify.cpp : Per-card sector keys derived from a master secret and the UID.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#include "stdafx.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "KeyDiversify.h"
+
+using namespace std;
+
+static const uint8_t AES_CMAC_CONSTANT = 0x01;
+
+static void init_aes_cmac(KeyDiversifier* kdf) {
+	aes_cmac_init(&kdf->cmac, kdf->secret);
+}
+
+// All keys of a card go through the AES unit in one call.
+static void derive_aes_cmac(const KeyDiversifier* kdf, const uint8_t* uid, size_t uid_length,
+	size_t sector_count, uint8_t keys[][2][6]) {
+	uint8_t blocks[KDF_MAX_SECTORS * 2][16] = { { 0 } };
+	uint8_t message[16];
+	size_t length = 0;
+	message[length++] = AES_CMAC_CONSTANT;
+	memcpy(message + length, uid, uid_length);
+	length += uid_length;
+	for (size_t sector = 0; sector < sector_count; sector++) {
+		message[length] = (uint8_t) sector;
+		for (int k = 0; k < 2; k++) {
+			message[length + 1] = k ? 'B' : 'A';
+			aes_cmac_final_block(&kdf->cmac, message, length + 2, blocks[2 * sector + k]);
+		}
+	}
+	aes128_encrypt_blocks(&kdf->cmac.aes, blocks[0], blocks[0], 2 * sector_count);
+	for (size_t sector = 0; sector < sector_count; sector++)
+		for (int k = 0; k < 2; k++)
+			memcpy(keys[sector][k], blocks[2 * sector + k], 6);
+}
+
+static const KdfScheme SCHEMES[] = {
+	{ "aes-cmac", 16, init_aes_cmac, derive_aes_cmac, "AES-128 CMAC of 01, UID, sector and key type, first 6 bytes" },
+	{ NULL, 0, NULL, NULL, NULL }
+};
+
+const KdfScheme* kdf_schemes() {
+	return SCHEMES;
+}
+
+static int hex_value(char c) {
+	if (isdigit((unsigned char) c))
+		return c - '0';
+	c = (char) toupper((unsigned char) c);
+	return ((c >= 'A') && (c <= 'F')) ? c - 'A' + 10 : -1;
+}
+
+bool kdf_parse(const char* spec, KeyDiversifier* kdf, string* error) {
+	const char* colon = strchr(spec, ':');
+	string name(spec, colon ? colon - spec : strlen(spec));
+	kdf->scheme = NULL;
+	for (const KdfScheme* s = SCHEMES; s->name; s++)
+		if (name == s->name)
+			kdf->scheme = s;
+	if (!kdf->scheme) {
+		*error = "unknown key diversification scheme " + name;
+		return false;
+	}
+	const char* hex = colon ? colon + 1 : "";
+	size_t length = strlen(hex);
+	if (length != 2 * kdf->scheme->secret_length) {
+		char text[80];
+		snprintf(text, sizeof(text), " needs a master secret of %u bytes in hex", (unsigned) kdf->scheme->secret_length);
+		*error = name + text;
+		return false;
+	}
+	for (size_t i = 0; i < kdf->scheme->secret_length; i++) {
+		int high = hex_value(hex[2 * i]), low = hex_value(hex[2 * i + 1]);
+		if ((high < 0) || (low < 0)) {
+			*error = "the master secret is not hex";
+			return false;
+		}
+		kdf->secret[i] = (uint8_t) ((high << 4) | low);
+	}
+	kdf->scheme->init(kdf);
+	return true;
+}
+
+void kdf_derive(const KeyDiversifier* kdf, const uint8_t* uid, size_t uid_length, size_t sector_count,
+	uint8_t keys[][2][6]) {
+	if (uid_length > 10)
+		uid_length = 10;
+	if (sector_count > KDF_MAX_SECTORS)
+		sector_count = KDF_MAX_SECTORS;
+	kdf->scheme->derive(kdf, uid, uid_length, sector_count, keys);
+}
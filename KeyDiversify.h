@@ -0,0 +1,51 @@
+// KeyDiversify.h : Per-card sector keys derived from a master secret and the UID.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#ifndef _MICMD_KEY_DIVERSIFY_H_
+#define _MICMD_KEY_DIVERSIFY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+#include "Aes.h"
+
+#define KDF_MAX_SECTORS 40
+#define KDF_MAX_SECRET 32
+
+struct KeyDiversifier;
+
+// Fills keys[sector][0] (key A) and keys[sector][1] (key B) of sectors 0 .. sector_count-1.
+typedef void (*kdf_derive_fn)(const struct KeyDiversifier* kdf, const uint8_t* uid, size_t uid_length,
+	size_t sector_count, uint8_t keys[][2][6]);
+
+// A diversification scheme, looked up by name. New schemes only need an entry in the table.
+typedef struct {
+	const char* name;
+	size_t secret_length;	// bytes of master secret
+	void (*init)(struct KeyDiversifier* kdf);	// prepares what derive needs from the secret
+	kdf_derive_fn derive;
+	const char* description;
+} KdfScheme;
+
+typedef struct KeyDiversifier {
+	const KdfScheme* scheme;
+	uint8_t secret[KDF_MAX_SECRET];
+	AesCmac cmac;		// aes-cmac: the master key, with its subkeys
+} KeyDiversifier;
+
+// "aes-cmac": K = AES-CMAC(master, 01 || UID || sector || 'A' or 'B'), the key is the first
+// 6 bytes of K. Messages are at most 13 bytes, so every key is one AES block.
+
+// Parses "scheme:<secret in hex>". Returns false with a reason for an unknown scheme or a secret
+// of the wrong length.
+bool kdf_parse(const char* spec, KeyDiversifier* kdf, std::string* error);
+void kdf_derive(const KeyDiversifier* kdf, const uint8_t* uid, size_t uid_length, size_t sector_count,
+	uint8_t keys[][2][6]);
+// The scheme table, for usage texts. Ends with a NULL name.
+const KdfScheme* kdf_schemes();
+
+#endif // _MICMD_KEY_DIVERSIFY_H_
@@ -0,0 +1,203 @@
+// Mad.cpp : MIFARE Application Directory (MAD1/MAD2) and NDEF messages on MIFARE Classic.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#include "stdafx.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Mad.h"
+
+using namespace std;
+
+const uint8_t MAD_KEY_A[6] = { 0xA0, 0xA1, 0xA2, 0xA3, 0xA4, 0xA5 };
+const uint8_t NDEF_KEY_A[6] = { 0xD3, 0xF7, 0xD3, 0xF7, 0xD3, 0xF7 };
+
+// Not an application: what a directory sector's own entry holds.
+const uint16_t MAD_NOT_APPLICABLE = 0x0005;
+
+uint8_t mad_crc(const uint8_t* data, size_t length) {
+	uint8_t crc = 0xC7;
+	for (size_t i = 0; i < length; i++) {
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 0x80) ? (uint8_t) ((crc << 1) ^ 0x1D) : (uint8_t) (crc << 1);
+	}
+	return crc;
+}
+
+// GPB: bit 7 DA (MAD available), bits 0-1 the MAD version.
+int mad_version(const uint8_t* sector0_trailer) {
+	uint8_t gpb = sector0_trailer[9];
+	if (!(gpb & 0x80))
+		return 0;
+	return gpb & 0x03;
+}
+
+static uint16_t read_aid(const uint8_t* p) {
+	return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+bool mad_decode(const uint8_t* mad1, const uint8_t* mad2, Mad* mad, string* error) {
+	memset(mad, 0, sizeof(*mad));
+	char text[80];
+	uint8_t crc = mad_crc(mad1 + 1, 31);
+	if (crc != mad1[0]) {
+		snprintf(text, sizeof(text), "MAD1 CRC is %02X, the sector 0 data gives %02X", mad1[0], crc);
+		*error = text;
+		return false;
+	}
+	mad->version = mad2 ? 2 : 1;
+	mad->sector_count = mad2 ? 40 : 16;
+	mad->publisher = mad1[1] & 0x3F;
+	mad->aids[MAD_SECTOR] = MAD_NOT_APPLICABLE;
+	for (size_t sector = 1; sector < 16; sector++)
+		mad->aids[sector] = read_aid(mad1 + 2 * sector);
+	if (mad2) {
+		crc = mad_crc(mad2 + 1, 47);
+		if (crc != mad2[0]) {
+			snprintf(text, sizeof(text), "MAD2 CRC is %02X, the sector 16 data gives %02X", mad2[0], crc);
+			*error = text;
+			return false;
+		}
+		mad->aids[MAD2_SECTOR] = MAD_NOT_APPLICABLE;
+		for (size_t sector = 17; sector < 40; sector++)
+			mad->aids[sector] = read_aid(mad2 + 2 * (sector - 16));
+		// The MAD2 info byte takes over for the whole card when it names a publisher.
+		if (mad2[1] & 0x3F)
+			mad->publisher = mad2[1] & 0x3F;
+	}
+	if ((mad->publisher == MAD2_SECTOR) || (mad->publisher >= mad->sector_count)) {
+		snprintf(text, sizeof(text), "the info byte names sector %u as card publisher", mad->publisher);
+		*error = text;
+		return false;
+	}
+	return true;
+}
+
+vector<uint8_t> mad_sectors(const Mad& mad, uint16_t aid) {
+	vector<uint8_t> sectors;
+	for (size_t sector = 1; sector < mad.sector_count; sector++)
+		if ((sector != MAD2_SECTOR) && (mad.aids[sector] == aid))
+			sectors.push_back((uint8_t) sector);
+	return sectors;
+}
+
+const char* mad_aid_name(uint16_t aid) {
+	switch (aid) {
+	case 0x0000: return "free";
+	case 0x0001: return "defect";
+	case 0x0002: return "reserved";
+	case 0x0003: return "additional directory info";
+	case 0x0004: return "card holder info";
+	case 0x0005: return "not applicable";
+	case MAD_NDEF_AID: return "NDEF";
+	}
+	return NULL;
+}
+
+bool ndef_find_message(const uint8_t* data, size_t length, vector<uint8_t>* message) {
+	size_t pos = 0;
+	while (pos < length) {
+		uint8_t type = data[pos++];
+		if (type == 0x00)		// NULL TLV, padding
+			continue;
+		if ((type == 0xFE) || (pos >= length))	// terminator
+			return false;
+		size_t tlv_length = data[pos++];
+		if (tlv_length == 0xFF) {
+			if (pos + 2 > length)
+				return false;
+			tlv_length = (data[pos] << 8) | data[pos + 1];
+			pos += 2;
+		}
+		if (pos + tlv_length > length)
+			return false;
+		if (type == 0x03) {
+			message->assign(data + pos, data + pos + tlv_length);
+			return true;
+		}
+		pos += tlv_length;
+	}
+	return false;
+}
+
+// NFC Forum URI record prefixes, by identifier code.
+static const char* URI_PREFIXES[] = {
+	"", "http://www.", "https://www.", "http://", "https://", "tel:", "mailto:",
+	"ftp://anonymous:anonymous@", "ftp://ftp.", "ftps://", "sftp://", "smb://", "nfs://", "ftp://",
+	"dav://", "news:", "telnet://", "imap:", "rtsp://", "urn:", "pop:", "sip:", "sips:", "tftp:",
+	"btspp://", "btl2cap://", "btgoep://", "tcpobex://", "irdaobex://", "file://", "urn:epc:id:",
+	"urn:epc:tag:", "urn:epc:pat:", "urn:epc:raw:", "urn:epc:", "urn:nfc:"
+};
+
+static string printable(const uint8_t* p, size_t length) {
+	string s;
+	for (size_t i = 0; i < length; i++)
+		s += ((p[i] >= 0x20) && (p[i] < 0x7F)) ? (char) p[i] : '.';
+	return s;
+}
+
+static string hex(const uint8_t* p, size_t length) {
+	string s;
+	char text[4];
+	for (size_t i = 0; i < length; i++) {
+		snprintf(text, sizeof(text), "%02X", p[i]);
+		s += text;
+	}
+	return s;
+}
+
+void print_ndef_message(ostream& out, const vector<uint8_t>& message) {
+	const uint8_t* m = message.empty() ? NULL : &message[0];
+	size_t length = message.size();
+	size_t pos = 0;
+	for (int record = 1; pos < length; record++) {
+		uint8_t header = m[pos++];
+		bool short_record = (header & 0x10) != 0;
+		bool has_id = (header & 0x08) != 0;
+		uint8_t tnf = header & 0x07;
+		size_t need = 1 + (short_record ? 1 : 4) + (has_id ? 1 : 0);
+		if (pos + need > length) {
+			out << "Record " << record << ": truncated header" << endl;
+			return;
+		}
+		size_t type_length = m[pos++];
+		size_t payload_length = 0;
+		if (short_record)
+			payload_length = m[pos++];
+		else {
+			for (int i = 0; i < 4; i++)
+				payload_length = (payload_length << 8) | m[pos++];
+		}
+		size_t id_length = has_id ? m[pos++] : 0;
+		if (pos + type_length + id_length + payload_length > length) {
+			out << "Record " << record << ": truncated, " << payload_length << " payload bytes announced" << endl;
+			return;
+		}
+		const uint8_t* type = m + pos;
+		const uint8_t* payload = type + type_length + id_length;
+		pos += type_length + id_length + payload_length;
+
+		out << "Record " << record << ": TNF " << (int) tnf << ", type '" << printable(type, type_length) << "'";
+		if ((tnf == 1) && (type_length == 1) && (type[0] == 'U') && (payload_length >= 1)) {
+			const char* prefix = (payload[0] < sizeof(URI_PREFIXES) / sizeof(URI_PREFIXES[0])) ? URI_PREFIXES[payload[0]] : "";
+			out << ", URI " << prefix << printable(payload + 1, payload_length - 1) << endl;
+		}
+		else if ((tnf == 1) && (type_length == 1) && (type[0] == 'T') && (payload_length >= 1)
+			&& (1 + (size_t) (payload[0] & 0x3F) <= payload_length)) {
+			size_t lang = payload[0] & 0x3F;
+			out << ", text [" << printable(payload + 1, lang) << "] " << printable(payload + 1 + lang, payload_length - 1 - lang);
+			if (payload[0] & 0x80)
+				out << " (UTF-16)";
+			out << endl;
+		}
+		else
+			out << ", payload " << hex(payload, payload_length) << endl;
+		if (header & 0x40)	// ME, last record
+			return;
+	}
+}
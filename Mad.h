@@ -0,0 +1,58 @@
+// Mad.h : MIFARE Application Directory (MAD1/MAD2) and NDEF messages on MIFARE Classic.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#ifndef _MICMD_MAD_H_
+#define _MICMD_MAD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Public key A of the MAD sectors (0 and 16) and of the NDEF application sectors.
+extern const uint8_t MAD_KEY_A[6];
+extern const uint8_t NDEF_KEY_A[6];
+
+#define MAD_SECTOR 0
+#define MAD2_SECTOR 16
+#define MAD_NDEF_AID 0xE103	// function cluster E1, application code 03
+
+// The MAD lives in sector 0 blocks 1-2 (MAD1) and, on 4K cards, sector 16 blocks 64-66 (MAD2).
+// Each starts with a CRC byte and the info byte (card publisher sector), followed by one 2 byte
+// application ID per sector, application code first.
+typedef struct {
+	int version;			// 1 or 2
+	uint8_t publisher;		// info byte, sector of the card publisher, 0 if none
+	size_t sector_count;		// 16, or 40 with MAD2
+	uint16_t aids[40];		// [0] and [16] are the directory sectors themselves
+} Mad;
+
+// CRC-8 of the MAD: polynomial x^8 + x^4 + x^3 + x^2 + 1, preset 0xC7.
+uint8_t mad_crc(const uint8_t* data, size_t length);
+
+// The general purpose byte (trailer byte 9) of sector 0 says whether there is a MAD and which
+// version. Returns 0 if there is none.
+int mad_version(const uint8_t* sector0_trailer);
+
+// mad1 is blocks 1-2 (32 bytes), mad2 blocks 64-66 (48 bytes) or NULL. Fails with a reason
+// when a CRC does not match or the info byte points at a directory sector.
+bool mad_decode(const uint8_t* mad1, const uint8_t* mad2, Mad* mad, std::string* error);
+
+// The sectors an application occupies, in card order.
+std::vector<uint8_t> mad_sectors(const Mad& mad, uint16_t aid);
+
+// Reserved AIDs and well-known applications, NULL for anything else.
+const char* mad_aid_name(uint16_t aid);
+
+// Finds the first NDEF message TLV in the data blocks of the NDEF sectors, concatenated.
+// Returns false when there is no complete one before the terminator TLV.
+bool ndef_find_message(const uint8_t* data, size_t length, std::vector<uint8_t>* message);
+
+// Prints the records of an NDEF message, decoding well-known URI and text records.
+void print_ndef_message(std::ostream& out, const std::vector<uint8_t>& message);
+
+#endif // _MICMD_MAD_H_
@@ -17,34 +17,73 @@
 #include <string>
 #include <iostream>
 #include <ios>
+#include <iomanip>
 #include <sstream>
+#include <fstream>
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <thread>
 #include <ctype.h>
 #include <math.h>
+#include <signal.h>
 
 #ifdef WIN32
 #include <windows.h>
+#include <io.h>
 
 #endif
+#ifndef WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
 
 
-extern "C" {
-#include <nfc/nfc.h>
-//#include <nfc/mifaretag.h>
-}
+#include "Aes.h"
+#include "AuditLog.h"
+#include "CaptureRing.h"
+#include "CardImage.h"
+#include "Corpus.h"
+#include "Crypto1.h"
+#include "KeyDiversify.h"
+#include "Mad.h"
+#include "Planner.h"
+#include "RtProfile.h"
+#include "SectorStore.h"
+#include "SimReader.h"
+#include "Trace.h"
+#include "Transcript.h"
+#include "TraceDecoder.h"
+#include "MiSession.h"
 
 using namespace std;
 
 typedef unsigned char byte;
 typedef unsigned int UINT;
 
+// Keys, blocks and values travel to the tag as fixed size values, nothing on the heap.
+typedef struct {
+	byte bytes[6];
+} MifareKey;
+
 typedef struct {
-	bool c1,c2,c3;
+	byte bytes[16];
+} BlockData;
 
-} AccessCondition;
+typedef struct {
+	byte bytes[4];
+} ValueData;
 
-static nfc_device_t* pdi;
-static nfc_target_info_t ti;
-static mifare_param param;
+// The CLI drives one reader session, ti is the tag it last selected.
+static mi_session* session;
+static mi_tag ti;
 
 const string VERSION = "0.011";
 
@@ -64,40 +103,61 @@ void set_console_size() {
 
 }
 
-byte* string_to_bytearray(string src, int* return_length)
-{
-	int length = src.length() / 2;
-	byte* buffer = new byte[length];
-	byte* ptr = buffer;
+int hex_digit(char c) {
+	if ((c >= '0') && (c <= '9'))
+		return c - '0';
+	if ((c >= 'a') && (c <= 'f'))
+		return 10 + c - 'a';
+	if ((c >= 'A') && (c <= 'F'))
+		return 10 + c - 'A';
+	return -1;
+}
 
-	*return_length = length;
-	byte c1,c2;
-	for (UINT i=0; i < src.length(); i += 2) {
-		if ((src[i] >= '0') && (src[i] <= '9'))
-			c1 = src[i] - '0';
-		if ((src[i] >= 'a') && (src[i] <= 'f'))
-			c1 = 10 + src[i] - 'a';
-		if ((src[i] >= 'A') && (src[i] <= 'F'))
-			c1 = 10 + src[i] - 'A';
+// Decodes exactly expected_length bytes of hex (no spaces) into dest, false on any other input.
+bool parse_hex(const char* src, size_t length, byte* dest, int expected_length) {
+	if ((int) length != expected_length * 2)
+		return false;
+	for (int i = 0; i < expected_length; i++) {
+		int hi = hex_digit(src[2*i]);
+		int lo = hex_digit(src[2*i+1]);
+		if ((hi < 0) || (lo < 0))
+			return false;
+		dest[i] = (byte) (hi*16 + lo);
+	}
+	return true;
+}
 
-		if ((src[i+1] >= '0') && (src[i+1] <= '9'))
-			c2 = src[i+1] - '0';
-		if ((src[i+1] >= 'a') && (src[i+1] <= 'f'))
-			c2 = 10 + src[i+1] - 'a';
-		if ((src[i+1] >= 'A') && (src[i+1] <= 'F'))
-			c2 = 10 + src[i+1] - 'A';
+bool parse_hex(const string& src, byte* dest, int expected_length) {
+	return parse_hex(src.data(), src.length(), dest, expected_length);
+}
 
-		*ptr++ = c1*16 + c2;
+bool parse_key(const string& src, MifareKey* key) {
+	return parse_hex(src, key->bytes, 6);
+}
 
+bool parse_block_data(const string& src, BlockData* data) {
+	return parse_hex(src, data->bytes, 16);
+}
 
+bool parse_value(const string& src, ValueData* value) {
+	return parse_hex(src, value->bytes, 4);
+}
 
-	}
-	return buffer;
+// Worker threads of the offline modes, -j 1..MAX_THREADS. No -j leaves 0, one per core.
+const long MAX_THREADS = 256;
 
+bool parse_threads(const char* src, unsigned* threads) {
+	char* end;
+	long n = strtol(src, &end, 10);
+	if (!*src || *end || (n <= 0) || (n > MAX_THREADS))
+		return false;
+	*threads = (unsigned) n;
+	return true;
 }
 
-string bytearray_to_string(byte* arr, int length, bool spacing=true) {
+string bytearray_to_string(const byte* arr, int length, bool spacing=true) {
 	string buffer = "";
+	buffer.reserve(length * 3);
 	char table[] = {'0','1','2','3','4','5','6','7','8','9','A','B','C','D','E','F'};
 
 	for (int i = 0; i < length; i++) {
@@ -114,30 +174,6 @@ string bytearray_to_string(byte* arr, int length, bool spacing=true) {
 
 }
 
-bool is_first_block(uint32_t uiBlock)
-{
-	// Test if we are in the small or big sectors
-	if (uiBlock < 128) return ((uiBlock)%4 == 0); else return ((uiBlock)%16 == 0);
-}
-
-bool is_trailer_block(uint32_t uiBlock)
-{
-	// Test if we are in the small or big sectors
-	if (uiBlock < 128) return ((uiBlock+1)%4 == 0); else return ((uiBlock+1)%16 == 0);
-}
-
-uint32_t get_trailer_block(uint32_t uiFirstBlock)
-{
-	// Test if we are in the small or big sectors
-	if (uiFirstBlock<128) return uiFirstBlock+3; else return uiFirstBlock+15;
-}
-
-void press_to_continue() {
-	string dummy = "";
-	cout << "Press ENTER to continue... ";
-	getline(cin, dummy);
-
-}
 void cls() {
 #ifdef WIN32
 	system("cls");
@@ -150,94 +186,294 @@ void cls() {
 
 }
 
-void print_menu() {
+void close_connection() {
 
-	cout << "\nMain menu:\n";
-	/* MC_AUTH_A         = 0x60,
-	MC_AUTH_B         = 0x61,
-	MC_READ           = 0x30,
-	MC_WRITE          = 0xA0,
-	MC_TRANSFER       = 0xB0,
-	MC_DECREMENT      = 0xC0,
-	MC_INCREMENT      = 0xC1,
-	MC_STORE          = 0xC2, */
-
-	cout << "h - display main menu\n";
-	cout << "o - Open connection\n";
-	cout << "at - analyse manually input trailer data\n";
-	cout << "cls, clear - Clear screen\n";
-	cout << "q - Exit\n";
-	cout << "\n-- After connection is successfully opened, you may use following\n-- additional commands:\n";
+	cout << "Closing connection to " << mi_device_name(session) << endl;
+	mi_disconnect(session);
+	connected = false;
+	cout << "Connection closed." << endl;
 
-	cout << "a - Authenticate with A key\n";
-	cout << "b - Authenticate with B key\n";
-	cout << "r - Read specific block data\n";
-	cout << "w - Write specific block data\n";
-	cout << "t - Transfer value block to volatile memory\n";
-	cout << "d - Decrement value block\n";
-	cout << "i - Increment value block\n";
-	cout << "s - ReStore value block\n";
-	cout << "c - Close existing connection\n";
-	cout << "\n";
+}
 
+// Reader chosen with -reader or MICMD_READER, libnfc picks the first device it finds otherwise.
+static bool reader_chosen = false;
+static string reader_driver, reader_port;
+static uint32_t reader_speed = 0;
+
+// Parses "driver[:port[:speed]]", e.g. "PN532_UART:/dev/ttyUSB0:460800".
+bool parse_reader(const char* spec) {
+	string s(spec);
+	string::size_type p1 = s.find(':');
+	string::size_type p2 = (p1 == string::npos) ? string::npos : s.find(':', p1 + 1);
+	reader_driver = s.substr(0, p1);
+	reader_port = (p1 == string::npos) ? "" : s.substr(p1 + 1, p2 - p1 - 1);
+	reader_speed = 0;
+	if (p2 != string::npos) {
+		char* end;
+		reader_speed = strtoul(s.c_str() + p2 + 1, &end, 10);
+		if (*end || !reader_speed)
+			return false;
+	}
+	if (reader_driver.empty())
+		return false;
+	reader_chosen = true;
+	return true;
+}
+
+// Audit log chosen with -log or MICMD_AUDIT_LOG, every tag command of the session goes to it.
+static AuditLog* audit_log = NULL;
 
+void close_audit_log() {
+	if (!audit_log_close(audit_log))
+		cerr << "Could not write the audit log." << endl;
+	audit_log = NULL;
 }
 
-void close_connection() {
+bool open_audit_log(const char* spec) {
+	AuditLogOptions options;
+	if (!audit_log_parse(spec, &options))
+		return false;
+	if (audit_log)
+		close_audit_log();
+	audit_log = audit_log_open(options);
+	if (!audit_log) {
+		cerr << "Could not open the audit log " << options.path << endl;
+		exit(1);
+	}
+	mi_set_event_handler(session, audit_log_event, audit_log);
+	return true;
+}
 
-	cout << "Closing connection to " << pdi->acName << endl;
-	nfc_disconnect(pdi);
-	pdi = 0;
-	connected = false;
-	cout << "Connection closed." << endl;
+// Key diversification chosen with -kdf or MICMD_KDF. The keys of every sector are derived from
+// the UID whenever a tag is selected, ad and bd authenticate with them.
+static bool kdf_chosen = false;
+static KeyDiversifier kdf;
+static uint8_t derived_keys[KDF_MAX_SECTORS][2][6];
+
+bool parse_kdf(const char* spec) {
+	string error;
+	if (!kdf_parse(spec, &kdf, &error)) {
+		cerr << "Invalid key diversification: " << error << endl;
+		return false;
+	}
+	// Wrong keys from a broken AES would look like a card with other keys, so they are never derived.
+	const char* failed;
+	if (!aes_self_test(&failed)) {
+		cerr << "AES self-test failed (" << failed << "), no keys are derived" << endl;
+		return false;
+	}
+	kdf_chosen = true;
+	return true;
+}
 
+void derive_tag_keys() {
+	if (kdf_chosen)
+		kdf_derive(&kdf, ti.uid, ti.uid_length, KDF_MAX_SECTORS, derived_keys);
 }
 
-bool open_connection() {
-	pdi = nfc_connect(NULL);
-	if (!pdi) {
-		cout << "Could not connect to the device." << endl;
+// Real-time profile chosen with -rt or MICMD_RT. It is applied to the thread that connects the
+// reader, the first time it does, so offline modes and their worker threads are left alone.
+static bool rt_chosen = false;
+static bool rt_applied = false;
+static RtProfile rt_profile;
+
+bool parse_rt(const char* spec) {
+	if (!rt_parse(spec, &rt_profile)) {
+		cerr << "Invalid real-time profile: " << spec << endl;
+		return false;
+	}
+	rt_chosen = true;
+	return true;
+}
+
+void apply_rt_profile() {
+	if (!rt_chosen || rt_applied)
+		return;
+	rt_applied = true;
+	string report;
+	rt_apply(rt_profile, &report);
+	cerr << "Real-time profile: " << report << endl;
+}
+
+// Transcripts: -record writes every libnfc call of the session to a file, -replay answers the
+// calls from such a file instead of a reader, at the recorded speed or faster.
+static TranscriptWriter recording;
+static bool replay_chosen = false;
+static TranscriptReplay replay;
+static chrono::steady_clock::time_point replay_start;
+
+void close_recording() {
+	if (recording.file && !transcript_finish(&recording))
+		cerr << "Could not write the transcript." << endl;
+}
+
+bool open_recording(const char* filename) {
+	close_recording();
+	if (!transcript_create(&recording, filename)) {
+		cerr << "Could not create the transcript " << filename << endl;
+		return false;
+	}
+	// Keys are recorded only as a hash, but a 48 bit key can be searched from its hash.
+	cerr << "The transcript " << filename << " holds the UIDs, the data read and written and a hash "
+		"of every key used, keep it like the keys themselves." << endl;
+	mi_set_recorder(session, &recording);
+	return true;
+}
+
+// Parses "file[:speed]", the speed divides the recorded durations, 0 does not wait at all.
+bool open_replay(const char* spec) {
+	string filename(spec);
+	double speed = 1;
+	string::size_type colon = filename.rfind(':');
+	if ((colon != string::npos) && (colon + 1 < filename.length())) {
+		char* end;
+		double value = strtod(filename.c_str() + colon + 1, &end);
+		if (!*end && (value >= 0)) {
+			speed = value;
+			filename.erase(colon);
+		}
+	}
+	if (!transcript_load(&replay, filename.c_str(), speed)) {
+		cerr << "Could not read the transcript " << filename << endl;
 		return false;
 	}
-	nfc_initiator_init(pdi);
+	replay_chosen = true;
+	replay_start = chrono::steady_clock::now();
+	return true;
+}
+
+void print_replay_summary() {
+	if (!replay_chosen)
+		return;
+	cerr << "Replayed " << replay.next << " of " << replay.records.size() << " reader calls in "
+		<< (UINT) chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - replay_start).count() << " ms, "
+		<< replay.mismatches << " differed from the recording, " << replay.past_end << " past its end" << endl;
+	if (replay.mismatches)
+		cerr << "First difference at " << replay.first_mismatch << endl;
+}
+
+// Connects to the reader and prepares it for MIFARE Classic work, without selecting any tag.
+bool connect_reader() {
+	apply_rt_profile();
+	if (replay_chosen)
+		return mi_connect_replay(session, &replay) == MI_OK;
+	if (!reader_chosen)
+		return mi_connect(session, NULL, NULL, 0) == MI_OK;
+	return mi_connect(session, reader_driver.c_str(), reader_port.empty() ? NULL : reader_port.c_str(), reader_speed) == MI_OK;
+}
+
+// Selects the first tag in the field, fills ti and b4k. Silent, returns false if there is no tag.
+bool select_tag() {
+	if (mi_select(session, &ti) != MI_OK)
+		return false;
+	b4k = mi_is_4k(&ti);
+	derive_tag_keys();
+	return true;
+}
+
+bool is_classic_tag() {
+	return mi_is_classic(&ti);
+}
+
+// -- Stacked tags --
+
+const size_t MAX_STACK_TAGS = 32;
+
+static vector<mi_tag> tag_stack;
+
+size_t enumerate_tags() {
+	mi_tag tags[MAX_STACK_TAGS];
+	size_t count = 0;
+	mi_enumerate(session, tags, MAX_STACK_TAGS, &count);
+	tag_stack.assign(tags, tags + count);
+	return count;
+}
 
-	nfc_configure(pdi,NDO_ACTIVATE_FIELD,false);
+// Selects one specific tag of the stack by its UID, leaving the others idle.
+bool select_stacked_tag(const mi_tag& tag) {
+	if (mi_select_uid(session, tag.uid, tag.uid_length, &ti) != MI_OK)
+		return false;
+	b4k = mi_is_4k(&ti);
+	derive_tag_keys();
+	return true;
+}
 
+// Wakes the tag up again after a failed command halted it.
+bool reselect_tag() {
+	mi_tag tag = ti;
+	return select_stacked_tag(tag);
+}
 
-	nfc_configure(pdi,NDO_INFINITE_SELECT,false);
-	nfc_configure(pdi,NDO_HANDLE_CRC,true);
-	nfc_configure(pdi,NDO_HANDLE_PARITY,true);
+void print_tag_stack() {
+	for (size_t i = 0; i < tag_stack.size(); i++) {
+		const mi_tag& tag = tag_stack[i];
+		cout << i << ": UID " << bytearray_to_string(tag.uid, tag.uid_length)
+			<< "SAK " << bytearray_to_string(&tag.sak, 1)
+			<< (!mi_is_classic(&tag) ? "(not MIFARE Classic)" : (mi_is_4k(&tag) ? "(4K)" : "(1K)")) << endl;
+	}
+}
 
-	nfc_configure(pdi,NDO_ACTIVATE_FIELD,true); 
-	cout << "Connected to " << pdi->acName << endl;
-	if (!nfc_initiator_select_tag(pdi, NM_ISO14443A_106, NULL, 0, &ti)) {
+bool open_connection() {
+	if (!connect_reader()) {
+		cout << "Could not connect to the device." << endl;
+		return false;
+	}
+	cout << "Connected to " << mi_device_name(session) << endl;
+	if (!select_tag()) {
 		cout << "No MIFARE tag found!" << endl;
-		press_to_continue();
 		close_connection();
 		return false;
-	} 
-	if ((ti.nai.btSak & 0x08) == 0) {
+	}
+	if (!is_classic_tag()) {
 		cout << "This is not a valid MIFARE _classic_ tag!" << endl;
-		press_to_continue();
 		close_connection();
 		return false;
 	}
-	b4k = (ti.nai.abtAtqa[1] == 0x02);
-	cout << "Found MIFARE Classic " << (b4k ? 4 : 1) << "K tag, UID: " << bytearray_to_string(ti.nai.abtUid, 4) << endl;
+	cout << "Found MIFARE Classic " << (b4k ? 4 : 1) << "K tag, UID: " << bytearray_to_string(ti.uid, ti.uid_length) << endl;
 
 	return true;
 }
 
-// b3de9843c86d
-bool authenticate(byte* key, bool keyB, uint8_t sector) {
-	uint8_t block = (sector+1)*4 - 1;
-	memcpy(param.mpa.abtUid, ti.nai.abtUid,4);
-	memcpy(param.mpa.abtKey, key, 6);
+// Silent tag primitives on the session, a failure halts the tag.
+bool auth_sector(const MifareKey& key, bool keyB, uint8_t sector) {
+	return mi_authenticate(session, sector, keyB ? MI_KEY_B : MI_KEY_A, key.bytes) == MI_OK;
+}
+
+bool read_block(uint8_t block, BlockData* data) {
+	return mi_read_block(session, block, data->bytes) == MI_OK;
+}
 
-	bool res = nfc_initiator_mifare_cmd(pdi, (keyB ? MC_AUTH_B : MC_AUTH_A), block, &param);
+bool write_block(uint8_t block, const BlockData& data) {
+	return mi_write_block(session, block, data.bytes) == MI_OK;
+}
+
+bool value_command(mi_value_op op, uint8_t block, const ValueData& value) {
+	return mi_value(session, op, block, value.bytes) == MI_OK;
+}
+
+// Reads every block of an authenticated sector, trailer included, into data.
+bool read_sector(uint8_t sector, uint8_t* data) {
+	uint32_t first = get_first_block(sector);
+	uint32_t trailer = get_trailer_block(first);
+	for (uint32_t block = first; block <= trailer; block++) {
+		BlockData b;
+		if (!read_block(block, &b))
+			return false;
+		memcpy(data + (block - first) * MIFARE_BLOCK_SIZE, b.bytes, MIFARE_BLOCK_SIZE);
+	}
+	return true;
+}
+
+// b3de9843c86d
+// Moving on to another sector authenticates inside the running session. A failure halts the
+// tag, selecting it again is enough; the reader is only reconnected if the tag does not answer.
+bool authenticate(const MifareKey& key, bool keyB, uint8_t sector) {
+	bool res = auth_sector(key, keyB, sector);
 
 	if (res)
 		cout << "Authentication successful. :-P" << endl;
+	else if (reselect_tag())
+		cout << "Authentication FAILURE! :'( Tag halted and selected again." << endl;
 	else {
 		cout << "Authentication FAILURE! :'( Tag halted, reconnecting..." << endl;
 		close_connection();
@@ -247,35 +483,29 @@ bool authenticate(byte* key, bool keyB, uint8_t sector) {
 	return res;
 }
 
-void parse_trailer(byte* data) {
+void parse_trailer(const byte* data) {
 	byte keyA[6];
 	byte keyB[6];
 	byte AC[4];
-	byte mask = 0x01;
-	uint32_t ACint = 0;
 	memcpy(keyA, data, 6);
 	memcpy(AC, data+6, 4);
 	memcpy(keyB, data+10, 6);
-	memcpy(&ACint, data+6, 4);
 	cout << "Key A: " << bytearray_to_string(keyA, 6) << endl;
 	cout << "Key B: " << bytearray_to_string(keyB, 6) << endl << endl;
 	cout << "Access Conditions: " << bytearray_to_string(AC, 4) << endl;
 	cout << "AC matrix (x = bit set to 1; - = bit set to 0)\n" << endl;
 	cout << "  C1 C2 C3 " << endl;
 	AccessCondition acs[4];
-	for (int i = 0; i <= 3; i++) 
-		acs[i].c1 = ((AC[1] & (mask << (i+4))) > 0);
-	for (int i = 0; i <= 3; i++) 
-		acs[i].c2 = ((AC[2] & (mask << (i))) > 0);
-	for (int i = 0; i <= 3; i++) 
-		acs[i].c3 = ((AC[2] & (mask << (i+4))) > 0);
+	bool valid = decode_access_conditions(data, acs);
 
 	for (int i=3; i >= 0; i--) {
 		cout << "|" << (acs[i].c1 ? " x " : " - ") << (acs[i].c2 ? " x " : " - ") << (acs[i].c3 ? " x " : " - ") << "| block " << i << ((i == 3) ? " (trailer) " : "") << endl;
 	}
 	cout << endl;
+	if (!valid)
+		cout << "!! The inverted AC bits do not match, the card treats this sector as blocked !!" << endl << endl;
 
-		cout << "-- Trailer block has following AC set: " << endl;
+	cout << "-- Trailer block has following AC set: " << endl;
 	if ((!acs[3].c1) && (!acs[3].c2) && (!acs[3].c3))
 		cout << "Key A may be written by itself, AC may be read by key A, key B may be read and written by key A." << endl;
 	if ((!acs[3].c1) && (acs[3].c2) && (!acs[3].c3))
@@ -323,16 +553,25 @@ void parse_trailer(byte* data) {
 
 }
 
+// A command refused by the remembered access conditions was never sent, the tag is still selected.
+void print_denial() {
+	cout << "Not sent, " << mi_denial_reason(session) << "." << endl;
+}
+
 bool readblock(uint8_t block) {
-	bool res = nfc_initiator_mifare_cmd(pdi, MC_READ, block, &param);
+	BlockData data;
+	mi_status status = mi_read_block(session, block, data.bytes);
+	bool res = (status == MI_OK);
 
 	if (res) {
-		cout << bytearray_to_string(param.mpd.abtData, 16) << "\n( " << bytearray_to_string(param.mpd.abtData, 16, false) << " ) " << endl;
+		cout << bytearray_to_string(data.bytes, 16) << "\n( " << bytearray_to_string(data.bytes, 16, false) << " ) " << endl;
 		if (is_trailer_block(block)) {
 			cout << "\nThis is the TRAILER block!" << endl;
-			parse_trailer(param.mpd.abtData);
+			parse_trailer(data.bytes);
 		}
-	} else {
+	} else if (status == MI_ERR_DENIED)
+		print_denial();
+	else {
 		cout << "Could not read the data block! Tag halted, reconnecting..." << endl;
 		close_connection();
 		connected = open_connection();
@@ -341,28 +580,15 @@ bool readblock(uint8_t block) {
 
 }
 
-bool writeblock(uint8_t block, byte* data) {
-	if (is_trailer_block(block)) {
-		string response = "";
-		cout << "----- !!!!! WARNING !!!!! -----" << endl;
-		cout << "-- You are trying to write data into a trailer block of certain sector." << endl;
-		cout << "-- Writing incorrect data may damage your MIFARE card." << endl;
-		cout << "Proceed only if you are completely sure what you are doing." << endl;
-		cout << "Continue?? (y - yes, anything else - no) : " << endl;
-		getline(cin, response);
-		if (response.compare("y") != 0) {
-			cout << "Aborting." << endl;
-			return false;
-		}
-
-	}
-
-	memcpy(param.mpd.abtData, data, 16);
-	bool res = nfc_initiator_mifare_cmd(pdi, MC_WRITE, block, &param);
+bool writeblock(uint8_t block, const BlockData& data) {
+	mi_status status = mi_write_block(session, block, data.bytes);
+	bool res = (status == MI_OK);
 
 	if (res) {
-		cout << "Successfully wrote " << bytearray_to_string(param.mpd.abtData, 16) << "into block " << (UINT) block << endl;
-	} else {
+		cout << "Successfully wrote " << bytearray_to_string(data.bytes, 16) << "into block " << (UINT) block << endl;
+	} else if (status == MI_ERR_DENIED)
+		print_denial();
+	else {
 		cout << "Could not write the data block! Tag halted, reconnecting..." << endl;
 		close_connection();
 		connected = open_connection();
@@ -371,14 +597,16 @@ bool writeblock(uint8_t block, byte* data) {
 
 }
 
-bool valueblock(const mifare_cmd cmd, uint8_t block, byte* data) {
-	memcpy(param.mpv.abtValue, data, 4);
-	bool res = nfc_initiator_mifare_cmd(pdi, cmd, block, &param);
+bool valueblock(mi_value_op op, uint8_t block, const ValueData& value) {
+	mi_status status = mi_value(session, op, block, value.bytes);
+	bool res = (status == MI_OK);
 	if (res) {
 		cout << "Command successfully completed." << endl;
-		if ((cmd == MC_INCREMENT) || (cmd == MC_DECREMENT))
+		if ((op == MI_INCREMENT) || (op == MI_DECREMENT))
 			cout << "Don't forget to TRANSFER(t) the data back to permanent memory of the chip" << endl;
-	} else {
+	} else if (status == MI_ERR_DENIED)
+		print_denial();
+	else {
 		cout << "Something failed. Command was NOT completed. Tag halted, reconnecting..." << endl;
 		close_connection();
 		connected = open_connection();
@@ -389,189 +617,2774 @@ bool valueblock(const mifare_cmd cmd, uint8_t block, byte* data) {
 
 
 
-int main(int argc, char* argv[])
-{
-	//set_console_size();
-
-	string menu_option;
-	connected = false;	
+// -- Access control decision mode (-acs) --
+// Minimal tap sequence for door/turnstile readers: select, authenticate one sector,
+// read one block, compare a part of it against the in-memory policy, answer grant/deny.
 
-	cout << "\n*** MiCmd " << VERSION << " -- MIFARE(R) command line ***\n";
-	print_menu();
-	while (true) {
+typedef struct {
+	byte data[16];
+} Credential;
 
-		cout << '\n';
-		if (connected) {
-			cout << "You are CONNECTED to " << pdi->acName << endl;
-			cout << "Found MIFARE Classic " << (b4k ? 4 : 1) << "K tag, UID: " << bytearray_to_string(ti.nai.abtUid, 4) << endl;
-		}
-		else
-			cout << "You are NOT connected, additional commands will not work.\n";
-		cout << "Type h for help.\n";
-		cout << "MiCmd " << VERSION << "> " ;
-		getline(cin, menu_option);
-		cout << endl;
-		if ((menu_option.compare("q")) == 0) {
-			if (connected)
-				close_connection();
+bool operator<(const Credential& a, const Credential& b) {
+	return memcmp(a.data, b.data, 16) < 0;
+}
 
-			return 0;
-		}
+typedef struct {
+	uint8_t sector;
+	bool keyB;
+	MifareKey key;
+	uint8_t block;
+	uint8_t offset;
+	uint8_t length;
+	UINT holdoff_ms;
+	string socket_path;
+	vector<Credential> grants;	// sorted, searched with binary_search
+} AccessPolicy;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+void request_stop(int) {
+	stop_requested = 1;
+}
 
-		if ((menu_option.compare("h")) == 0) {
-			print_menu();
+// Policy file, one directive per line, # starts a comment:
+//   sector 1 / key A FFFFFFFFFFFF / block 4 / offset 0 / length 4 / holdoff 1000
+//   socket /run/door.sock / grant 0A0B0C0D (one line per granted credential)
+bool load_policy(const char* filename, AccessPolicy* policy) {
+	ifstream in(filename);
+	if (!in) {
+		cerr << "Could not open policy file " << filename << endl;
+		return false;
+	}
+	policy->sector = 0;
+	policy->keyB = false;
+	memset(policy->key.bytes, 0xFF, 6);
+	policy->block = 1;
+	policy->offset = 0;
+	policy->length = 16;
+	policy->holdoff_ms = 1000;
+	policy->grants.clear();
+
+	string line;
+	int line_no = 0;
+	while (getline(in, line)) {
+		line_no++;
+		if (!line.empty() && line[line.length()-1] == '\r')
+			line.erase(line.length()-1);
+		string::size_type hash = line.find('#');
+		if (hash != string::npos)
+			line.erase(hash);
+		istringstream ls(line);
+		string directive, arg;
+		if (!(ls >> directive))
 			continue;
+		bool ok = true;
+		UINT number = 0;
+		if (directive.compare("sector") == 0) {
+			ok = (ls >> number) && (number < 40);
+			policy->sector = number;
+		} else if (directive.compare("block") == 0) {
+			ok = (ls >> number) && (number < 256);
+			policy->block = number;
+		} else if (directive.compare("offset") == 0) {
+			ok = (ls >> number) && (number < 16);
+			policy->offset = number;
+		} else if (directive.compare("length") == 0) {
+			ok = (ls >> number) && (number >= 1) && (number <= 16);
+			policy->length = number;
+		} else if (directive.compare("holdoff") == 0) {
+			ok = !!(ls >> policy->holdoff_ms);
+		} else if (directive.compare("socket") == 0) {
+			ok = !!(ls >> policy->socket_path);
+		} else if (directive.compare("key") == 0) {
+			string type;
+			ok = (ls >> type >> arg) && ((type == "A") || (type == "a") || (type == "B") || (type == "b"));
+			policy->keyB = ok && ((type == "B") || (type == "b"));
+			ok = ok && parse_key(arg, &policy->key);
+		} else if (directive.compare("grant") == 0) {
+			Credential c;
+			memset(c.data, 0, 16);
+			ok = (ls >> arg) && (arg.length() <= 32) && parse_hex(arg, c.data, arg.length() / 2);
+			if (ok)
+				policy->grants.push_back(c);
+		} else
+			ok = false;
+		if (!ok) {
+			cerr << filename << ":" << line_no << ": invalid directive '" << line << "'" << endl;
+			return false;
 		}
+	}
 
-		if ((menu_option.compare("o")) == 0) {
-			if (connected) {
-				cout << "You are already connected, disconnect with c first!" << endl;
-				continue;
-			}
-			connected = open_connection();
-			continue;
+	UINT first = get_first_block(policy->sector);
+	if ((policy->block < first) || (policy->block >= get_trailer_block(first))) {
+		cerr << "Block " << (UINT) policy->block << " is not a data block of sector " << (UINT) policy->sector << endl;
+		return false;
+	}
+	if (policy->offset + policy->length > 16) {
+		cerr << "offset + length exceeds the 16 byte block" << endl;
+		return false;
+	}
+	sort(policy->grants.begin(), policy->grants.end());
+	return true;
+}
+
+// Masks the compared window out of a block, so it can be looked up as a Credential.
+void extract_credential(const AccessPolicy& policy, const byte* block_data, Credential* c) {
+	memset(c->data, 0, 16);
+	memcpy(c->data, block_data + policy.offset, policy.length);
+}
+
+double percentile(vector<double> samples, double p) {
+	if (samples.empty())
+		return 0;
+	size_t n = (size_t) (p * (samples.size() - 1) + 0.5);
+	nth_element(samples.begin(), samples.begin() + n, samples.end());
+	return samples[n];
+}
+
+// A door terminal runs for months, its latencies are counted in fixed buckets of 10 us up to 1 s
+// instead of being kept. Slower decisions share the last bucket, the maximum is kept exactly.
+const size_t LATENCY_BUCKETS = 100000;
+const double LATENCY_BUCKET_MS = 0.01;
+
+typedef struct {
+	vector<uint32_t> buckets;
+	uint64_t count;
+	double max;
+} LatencyHistogram;
+
+void histogram_init(LatencyHistogram* h) {
+	h->buckets.assign(LATENCY_BUCKETS, 0);
+	h->count = 0;
+	h->max = 0;
+}
+
+void histogram_add(LatencyHistogram* h, double ms) {
+	size_t bucket = (size_t) (ms / LATENCY_BUCKET_MS);
+	h->buckets[min(bucket, LATENCY_BUCKETS - 1)]++;
+	h->count++;
+	h->max = max(h->max, ms);
+}
+
+// The upper edge of the bucket holding the p-th sample, at most the maximum.
+double histogram_percentile(const LatencyHistogram& h, double p) {
+	uint64_t rank = (uint64_t) (p * (h.count - 1) + 0.5) + 1;
+	uint64_t seen = 0;
+	for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += h.buckets[i];
+		if (seen >= rank)
+			return min((i + 1) * LATENCY_BUCKET_MS, h.max);
+	}
+	return h.max;
+}
+
+void print_latency_report(const LatencyHistogram& latencies, UINT grants, UINT denies) {
+	cerr << "Decisions: " << latencies.count << " (" << grants << " granted, " << denies << " denied)" << endl;
+	if (latencies.count == 0)
+		return;
+	cerr << "Tap-to-decision latency [ms]: p50 " << histogram_percentile(latencies, 0.50)
+		<< ", p99 " << histogram_percentile(latencies, 0.99)
+		<< ", max " << latencies.max << endl;
+}
+
+int access_control_mode(const char* policy_file) {
+	AccessPolicy policy;
+	if (!load_policy(policy_file, &policy))
+		return 1;
+
+#ifndef WIN32
+	int sock = -1;
+	sockaddr_un peer;
+	if (!policy.socket_path.empty()) {
+		if (policy.socket_path.length() >= sizeof(peer.sun_path)) {
+			cerr << "Socket path too long: " << policy.socket_path << endl;
+			return 1;
 		}
-		if (((menu_option.compare("cls")) == 0) || (menu_option.compare("clear") == 0)) {
-			cls();
-			continue;
+		memset(&peer, 0, sizeof(peer));
+		peer.sun_family = AF_UNIX;
+		strcpy(peer.sun_path, policy.socket_path.c_str());
+		sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+		if (sock < 0) {
+			cerr << "Could not create decision socket." << endl;
+			return 1;
 		}
+	}
+#else
+	if (!policy.socket_path.empty())
+		cerr << "Decision sockets are not supported on this platform, using stdout." << endl;
+#endif
 
-		if (menu_option.compare("at") == 0) {
-			string data = "";
-			int length = 0;
-			cout << "Enter trailer block data (16B HEX value, without spaces): ";
-			getline(cin, data);
-			cout << endl;
-			cout << "-- !!!! ATTENTION !!!!\nManual parsing does NOT detect inner format violation of AC part of the trailer block." << endl;
-			cout << "-- It only computes AC bits from 4-byte value by applying bitwise operations." << endl;
-			cout << "-- It totally ignores inverse AC bits in those 4 bytes." << endl;
-			cout << "-- DO NOT rely on this when calculating correct 4-byte value to write into the trailer block!" << endl;
-			cout << "-- !!!! ATTENTION !!!!" << endl << endl;
-
-			parse_trailer(string_to_bytearray(data, &length));
+	if (!connect_reader()) {
+		cerr << "Could not connect to the device." << endl;
+		return 1;
+	}
+	cerr << "Connected to " << mi_device_name(session) << ", " << policy.grants.size() << " credentials loaded. Waiting for tags..." << endl;
+
+	signal(SIGINT, request_stop);
+	signal(SIGTERM, request_stop);
+
+	LatencyHistogram latencies;
+	histogram_init(&latencies);
+	UINT grants = 0, denies = 0;
+	byte last_uid[10];
+	size_t last_uid_len = 0;
+	chrono::steady_clock::time_point last_seen;
+	char message[96];
+	BlockData data;
+
+	while (!stop_requested) {
+		chrono::steady_clock::time_point tap = chrono::steady_clock::now();
+		if (!select_tag())
+			continue;
 
+		// The same tag still sitting on the reader is not a new tap.
+		if ((ti.uid_length == last_uid_len) && (memcmp(ti.uid, last_uid, last_uid_len) == 0)
+			&& (tap - last_seen < chrono::milliseconds(policy.holdoff_ms))) {
+			last_seen = tap;
+			mi_deselect(session);
 			continue;
 		}
-		if (connected) {
-			if ((menu_option.compare("c")) == 0) {
-				close_connection();
-				continue;
+		last_uid_len = ti.uid_length;
+		memcpy(last_uid, ti.uid, last_uid_len);
+		last_seen = tap;
+
+		const char* reason = NULL;
+		if (!is_classic_tag())
+			reason = "not-classic";
+		else {
+			if (!auth_sector(policy.key, policy.keyB, policy.sector))
+				reason = "auth-failed";
+			else if (!read_block(policy.block, &data))
+				reason = "read-failed";
+			else {
+				Credential c;
+				extract_credential(policy, data.bytes, &c);
+				if (!binary_search(policy.grants.begin(), policy.grants.end(), c))
+					reason = "not-granted";
 			}
-			if (((menu_option.compare("a")) == 0) || ((menu_option.compare("b")) == 0)) {
-				byte* key_c;
-				int bbbb;
-				char tmp[20];
-
-				uint8_t block = 0;
-				cout << "Enter sector number: ";
-				fgets(tmp, 20, stdin);
-				sscanf(tmp, "%d", &block);
-				cout << "Enter key (6B HEX value, WITHOUT spaces): ";
-				string key = "";
-				getline(cin, key);
+		}
 
+		string uid = bytearray_to_string(ti.uid, ti.uid_length, false);
+		if (reason)
+			snprintf(message, sizeof(message), "DENY %s %s\n", uid.c_str(), reason);
+		else
+			snprintf(message, sizeof(message), "GRANT %s\n", uid.c_str());
 
-				key_c = string_to_bytearray(key, &bbbb);
-				authenticate(key_c, (menu_option.compare("b") == 0), block);
+#ifndef WIN32
+		if (sock >= 0)
+			sendto(sock, message, strlen(message), 0, (sockaddr*) &peer, sizeof(peer));
+		else
+#endif
+		{
+			fputs(message, stdout);
+			fflush(stdout);
+		}
+		histogram_add(&latencies, chrono::duration<double, milli>(chrono::steady_clock::now() - tap).count());
+		if (reason)
+			denies++;
+		else
+			grants++;
 
-				continue;
-			}
-			if ((menu_option.compare("r")) == 0) {
-				char tmp[20];
-				uint8_t block;
-				cout << "Enter block number: ";
-				fgets(tmp, 20, stdin); 
-				sscanf(tmp, "%d", &block);
-				readblock(block);
-				continue;
-			}
+		mi_deselect(session);
+	}
 
-			if ((menu_option.compare("w")) == 0) {
-				int length = 0;
-				char tmp[20];
-				uint8_t block;
-				string data = "";
-				cout << "Enter block number: ";
-				fgets(tmp, 20, stdin);
-				sscanf(tmp, "%d", &block);
-				
-				cout << "Enter data (16B hex, WITHOUT spaces) to write: ";
-				getline(cin, data);
+	print_latency_report(latencies, grants, denies);
+#ifndef WIN32
+	if (sock >= 0)
+		close(sock);
+#endif
+	mi_disconnect(session);
+	return 0;
+}
 
+// -- Tear-safe debit (-debit) --
+// Debits a fixed amount from every card presented, one mi_debit() transaction per tap. Each
+// transaction is timed from the tap to its result and flagged when it exceeds the budget.
+// A card whose debit ended uncertain is not charged again on its next tap if that debit
+// turns out to have reached it.
+
+// A card left on the reader is debited once, it has to be away this long to be a new tap.
+const UINT DEBIT_HOLDOFF_MS = 1000;
+
+int debit_mode(int argc, char* argv[]) {
+	const char* syntax = "Usage: MiCmd -debit <sector> <A|B> <key> <block> <backup block> <amount> [-budget ms] [-n count]";
+	UINT sector, block, backup;
+	MifareKey key;
+	string type = (argc > 1) ? argv[1] : "";
+	if ((argc < 6) || (sscanf(argv[0], "%u", &sector) != 1) || ((type != "A") && (type != "B")) || !parse_key(argv[2], &key)
+		|| (sscanf(argv[3], "%u", &block) != 1) || (sscanf(argv[4], "%u", &backup) != 1) || (block > 255) || (backup > 255)
+		|| (atoi(argv[5]) <= 0)) {
+		cerr << syntax << endl;
+		return 1;
+	}
+	int32_t amount = atoi(argv[5]);
+	double budget_ms = 100;
+	UINT count = 0;
+	for (int i = 6; i < argc; i++) {
+		if ((strcmp(argv[i], "-budget") == 0) && (i + 1 < argc) && (atof(argv[i + 1]) > 0))
+			budget_ms = atof(argv[++i]);
+		else if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc) && (atoi(argv[i + 1]) > 0))
+			count = atoi(argv[++i]);
+		else {
+			cerr << syntax << endl;
+			return 1;
+		}
+	}
+	if ((sector >= 40) || (get_sector(block) != sector) || (get_sector(backup) != sector) || (block == backup)
+		|| (block == 0) || (backup == 0) || is_trailer_block(block) || is_trailer_block(backup)) {
+		cerr << "The value block and its backup must be two different data blocks of sector " << sector << endl;
+		return 1;
+	}
 
-				writeblock(block, string_to_bytearray(data, &length));
+	if (!connect_reader()) {
+		cerr << "Could not connect to the device." << endl;
+		return 1;
+	}
+	cerr << "Connected to " << mi_device_name(session) << ", debiting " << amount << " per tap. Waiting for tags..." << endl;
 
-				continue;
-			}
+	signal(SIGINT, request_stop);
+	signal(SIGTERM, request_stop);
 
-			if ((menu_option.compare("s")) == 0) {
-				char tmp[20];
-				string data = "";
-				int length = 0;
-				uint8_t block;
-				cout << "Enter block number: ";
-				fgets(tmp, 20, stdin);
-				sscanf(tmp, "%d", &block);
-				cout << "Enter data (enter 4B HEX value, WITHOUT spaces): ";
-				getline(cin, data);
-				valueblock(MC_STORE, block, string_to_bytearray(data, &length));
+	vector<double> latencies;
+	UINT debited = 0, failed = 0, recovered = 0, over_budget = 0;
+	byte last_uid[10], uncertain_uid[10];
+	size_t last_uid_len = 0, uncertain_uid_len = 0;
+	chrono::steady_clock::time_point last_seen;
+	mi_key_type key_type = (type == "B") ? MI_KEY_B : MI_KEY_A;
 
-				continue;
-			}
+	while (!stop_requested && (!count || (debited + failed < count))) {
+		chrono::steady_clock::time_point tap = chrono::steady_clock::now();
+		if (!select_tag())
+			continue;
+		if ((ti.uid_length == last_uid_len) && (memcmp(ti.uid, last_uid, last_uid_len) == 0)
+			&& (tap - last_seen < chrono::milliseconds(DEBIT_HOLDOFF_MS))) {
+			last_seen = tap;
+			mi_deselect(session);
+			continue;
+		}
+		last_uid_len = ti.uid_length;
+		memcpy(last_uid, ti.uid, last_uid_len);
+		last_seen = tap;
+
+		mi_debit_result result;
+		memset(&result, 0, sizeof(result));
+		mi_status status = is_classic_tag() ? MI_OK : MI_ERR_NO_TAG;
+		bool earlier = (ti.uid_length == uncertain_uid_len) && (memcmp(ti.uid, uncertain_uid, uncertain_uid_len) == 0);
+		int applied = 0;
+		if ((status == MI_OK) && earlier)
+			status = mi_debit_applied(session, sector, key_type, key.bytes, block, backup, &applied, &result);
+		if ((status == MI_OK) && !applied)
+			status = mi_debit(session, sector, key_type, key.bytes, block, backup, amount, &result);
+		if (status == MI_ERR_UNCERTAIN) {
+			uncertain_uid_len = ti.uid_length;
+			memcpy(uncertain_uid, ti.uid, uncertain_uid_len);
+		}
+		else if (earlier && (status == MI_OK))
+			uncertain_uid_len = 0;
+		double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - tap).count();
+		latencies.push_back(ms);
+
+		string uid = bytearray_to_string(ti.uid, ti.uid_length, false);
+		if (status == MI_OK) {
+			debited++;
+			printf("OK %s balance=%d previous=%d%s", uid.c_str(), result.after, result.before, applied ? " charged-on-previous-tap" : "");
+		} else {
+			failed++;
+			printf("ERR %s %s", uid.c_str(), is_classic_tag() ? mi_status_text(status) : "not-classic");
+			if (status == MI_ERR_BALANCE)
+				printf(" balance=%d", result.before);
+		}
+		if (result.recovery != MI_RECOVERY_NONE) {
+			recovered++;
+			printf(" recovered=%s", mi_recovery_text(result.recovery));
+		}
+		printf(" ms=%.1f%s\n", ms, (ms > budget_ms) ? " over-budget" : "");
+		fflush(stdout);
+		if (ms > budget_ms)
+			over_budget++;
 
-			if ((menu_option.compare("i")) == 0) {
-				char tmp[20];
-				byte* data = new byte[4];
-				string how_many = "";
-				int length = 0;
-				uint8_t block;
-				cout << "Enter block number: ";
-				fgets(tmp, 20, stdin);
-				sscanf(tmp, "%d", &block);
-				cout << "Increment by what number (enter 4B HEX value, WITHOUT spaces)? ";
-				getline(cin, how_many);
-				valueblock(MC_INCREMENT, block, string_to_bytearray(how_many, &length));
+		mi_deselect(session);
+	}
 
-				continue;
-			}
+	cerr << "Transactions: " << latencies.size() << " (" << debited << " debited, " << failed << " failed, "
+		<< recovered << " recovered)" << endl;
+	if (!latencies.empty())
+		cerr << "Transaction latency [ms]: p50 " << percentile(latencies, 0.50)
+			<< ", p99 " << percentile(latencies, 0.99)
+			<< ", max " << *max_element(latencies.begin(), latencies.end())
+			<< ", over the " << budget_ms << " ms budget: " << over_budget << endl;
+	mi_disconnect(session);
+	return failed ? 2 : 0;
+}
 
-			if ((menu_option.compare("d")) == 0) {
-				char tmp[20];
-				byte* data = new byte[4];
-				string how_many = "";
-				int length = 0;
-				uint8_t block;
-				cout << "Enter block number: ";
-				fgets(tmp, 20, stdin);
-				sscanf(tmp, "%d", &block);
-				cout << "Decrement by what number (enter 4B HEX value, WITHOUT spaces)? ";
-				getline(cin, how_many);
-				valueblock(MC_DECREMENT, block, string_to_bytearray(how_many, &length));
+// -- Reader daemon (-daemon) and its thin client (-client) --
+// The daemon owns the reader and keeps the tag selected and the last sector authenticated
+// between requests of the same client; a request from another client starts with the tag
+// deselected, so no client inherits another one's authentication. Clients send one request
+// per line over a Unix domain socket, several commands may be chained with ';' and are
+// executed together without interleaving with other clients. Each request is answered with
+// one line of "OK key=value ..." / "ERR reason" results, joined by "; ". Execution of a
+// request stops at the first error.
+
+// The session keeps the tag selected and the sector authenticated, a failed command has
+// already dropped both when the error is reported.
+string session_error(mi_status status) {
+	return string("ERR ") + mi_status_text(status);
+}
 
-				continue;
-			}
+bool session_ensure_tag() {
+	if (mi_selected_tag(session, NULL))
+		return true;
+	return select_tag() && is_classic_tag();
+}
 
-			if ((menu_option.compare("t")) == 0) {
-				char tmp[20];
-				string data = "";
-				int length = 0;
-				uint8_t block;
-				cout << "Enter block number: ";
-				fgets(tmp, 20, stdin);
-				sscanf(tmp, "%d", &block);
-				cout << "Enter data (4B HEX value, WITHOUT spaces): ";
-				getline(cin, data);
-				valueblock(MC_TRANSFER, block, string_to_bytearray(data, &length));
+bool parse_block(istringstream& args, uint8_t* block) {
+	UINT number;
+	if (!(args >> number) || (number > 255))
+		return false;
+	*block = (uint8_t) number;
+	return true;
+}
 
-				continue;
-			}
+string execute_daemon_command(const string& command) {
+	istringstream args(command);
+	string name, arg;
+	uint8_t block;
+	if (!(args >> name))
+		return "ERR empty-command";
+
+	if (name == "info") {
+		ostringstream out;
+		bool selected = mi_selected_tag(session, NULL);
+		out << "OK device=" << mi_device_name(session) << " selected=" << (selected ? 1 : 0);
+		if (selected)
+			out << " uid=" << bytearray_to_string(ti.uid, ti.uid_length, false);
+		return out.str();
+	}
+	if (name == "halt") {
+		mi_deselect(session);
+		return "OK";
+	}
+	if (name == "list") {
+		enumerate_tags();
+		ostringstream out;
+		out << "OK count=" << tag_stack.size() << " uids=";
+		for (size_t i = 0; i < tag_stack.size(); i++)
+			out << (i ? "," : "") << bytearray_to_string(tag_stack[i].uid, tag_stack[i].uid_length, false);
+		return out.str();
+	}
+	if (name == "select") {
+		if (args >> arg) {
+			// select <uid> picks one tag of a stack
+			mi_tag tag;
+			tag.uid_length = arg.length() / 2;
+			if (((tag.uid_length != 4) && (tag.uid_length != 7) && (tag.uid_length != 10)) || !parse_hex(arg, tag.uid, tag.uid_length))
+				return "ERR syntax: select [uid]";
+			if (!select_stacked_tag(tag) || !is_classic_tag())
+				return "ERR no-tag";
+		} else {
+			mi_deselect(session);
+			if (!session_ensure_tag())
+				return "ERR no-tag";
 		}
-		cout << "Command " << menu_option << " not understood.\nRemember, to use additional commands like Read,Write,...\nyou have to be connected to the reader first." << endl;
-		press_to_continue();
+		ostringstream out;
+		out << "OK uid=" << bytearray_to_string(ti.uid, ti.uid_length, false)
+			<< " atqa=" << bytearray_to_string(ti.atqa, 2, false)
+			<< " sak=" << bytearray_to_string(&ti.sak, 1, false)
+			<< " type=" << (b4k ? "4K" : "1K");
+		return out.str();
 	}
 
+	if (!session_ensure_tag())
+		return "ERR no-tag";
+
+	if (name == "auth") {
+		UINT sector;
+		string type;
+		MifareKey key;
+		if (!(args >> sector >> type >> arg) || (sector >= (b4k ? 40u : 16u))
+			|| ((type != "A") && (type != "B")) || !parse_key(arg, &key))
+			return "ERR syntax: auth <sector> <A|B> <key>";
+		mi_key_type key_type = (type == "B") ? MI_KEY_B : MI_KEY_A;
+		// Same sector with the same key is still authenticated, the session sends nothing.
+		bool cached = mi_is_authenticated(session, sector, key_type, key.bytes);
+		mi_status status = mi_authenticate(session, sector, key_type, key.bytes);
+		if (status != MI_OK)
+			return session_error(status);
+		ostringstream out;
+		out << "OK sector=" << sector << " key=" << type << " cached=" << (cached ? 1 : 0);
+		return out.str();
+	}
+	if (name == "read") {
+		if (!parse_block(args, &block))
+			return "ERR syntax: read <block>";
+		BlockData data;
+		mi_status status = mi_read_block(session, block, data.bytes);
+		if (status != MI_OK)
+			return session_error(status);
+		ostringstream out;
+		out << "OK block=" << (UINT) block << " data=" << bytearray_to_string(data.bytes, 16, false);
+		return out.str();
+	}
+	if (name == "audit") {
+		UINT sector;
+		uint8_t data[16 * MIFARE_BLOCK_SIZE];
+		vector<ValueBlockFinding> findings;
+		if (!(args >> sector) || (sector >= (b4k ? 40u : 16u)))
+			return "ERR syntax: audit <sector>";
+		if (!read_sector(sector, data))
+			return session_error(MI_ERR_READ);
+		if (!audit_value_blocks(data, sector, &findings))
+			return "ERR invalid-access-bits";
+		ostringstream out;
+		out << "OK sector=" << sector << " values=" << findings.size() << " blocks=";
+		for (size_t i = 0; i < findings.size(); i++)
+			out << (i ? "," : "") << (int) findings[i].block << ":" << value_block_status_name(findings[i].status)
+				<< ":" << findings[i].value;
+		return out.str();
+	}
+	if (name == "debit") {
+		UINT sector, backup;
+		int32_t amount;
+		string type;
+		MifareKey key;
+		if (!(args >> sector >> type >> arg) || (sector >= (b4k ? 40u : 16u)) || ((type != "A") && (type != "B"))
+			|| !parse_key(arg, &key) || !parse_block(args, &block) || !(args >> backup) || (backup > 255) || !(args >> amount))
+			return "ERR syntax: debit <sector> <A|B> <key> <block> <backup block> <amount>";
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		mi_debit_result result;
+		mi_status status = mi_debit(session, sector, (type == "B") ? MI_KEY_B : MI_KEY_A, key.bytes, block, backup, amount, &result);
+		double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		if ((status != MI_OK) && (status != MI_ERR_BALANCE))
+			return session_error(status);
+		ostringstream out;
+		out << ((status == MI_OK) ? "OK" : session_error(status)) << " balance=" << result.after
+			<< " previous=" << result.before << " recovered=" << mi_recovery_text(result.recovery)
+			<< " ms=" << fixed << setprecision(1) << ms;
+		return out.str();
+	}
+	if (name == "write") {
+		BlockData data;
+		if (!parse_block(args, &block) || !(args >> arg) || !parse_block_data(arg, &data))
+			return "ERR syntax: write <block> <16B hex data>";
+		mi_status status = mi_write_block(session, block, data.bytes);
+		if (status != MI_OK)
+			return session_error(status);
+		ostringstream out;
+		out << "OK block=" << (UINT) block;
+		return out.str();
+	}
 
+	mi_value_op op;
+	if (name == "inc")
+		op = MI_INCREMENT;
+	else if (name == "dec")
+		op = MI_DECREMENT;
+	else if (name == "restore")
+		op = MI_RESTORE;
+	else if (name == "transfer")
+		op = MI_TRANSFER;
+	else
+		return "ERR unknown-command " + name;
+	ValueData value;
+	if (!parse_block(args, &block) || !(args >> arg) || !parse_value(arg, &value))
+		return "ERR syntax: " + name + " <block> <4B hex value>";
+	mi_status status = mi_value(session, op, block, value.bytes);
+	if (status != MI_OK)
+		return session_error(status);
+	ostringstream out;
+	out << "OK block=" << (UINT) block;
+	return out.str();
+}
 
+string execute_daemon_request(const string& request) {
+	string response;
+	string::size_type start = 0;
+	while (start <= request.length()) {
+		string::size_type end = request.find(';', start);
+		if (end == string::npos)
+			end = request.length();
+		string result = execute_daemon_command(request.substr(start, end - start));
+		if (!response.empty())
+			response += "; ";
+		response += result;
+		if (result.compare(0, 3, "ERR") == 0)
+			break;
+		start = end + 1;
+	}
+	return response;
+}
 
+// Runs a script of daemon commands (one request per line) against every tag of the stack.
+int stack_mode(const char* script_file) {
+	ifstream in(script_file);
+	if (!in) {
+		cerr << "Could not open script file " << script_file << endl;
+		return 1;
+	}
+	vector<string> script;
+	string line;
+	while (getline(in, line)) {
+		if (!line.empty() && line[line.length()-1] == '\r')
+			line.erase(line.length()-1);
+		if (!line.empty() && (line[0] != '#'))
+			script.push_back(line);
+	}
+	if (!connect_reader()) {
+		cerr << "Could not connect to the device." << endl;
+		return 1;
+	}
+	size_t count = enumerate_tags();
+	cerr << "Found " << count << " tag(s) in the field." << endl;
+
+	UINT failed_tags = 0;
+	for (size_t t = 0; t < tag_stack.size(); t++) {
+		string uid = bytearray_to_string(tag_stack[t].uid, tag_stack[t].uid_length, false);
+		if (!select_stacked_tag(tag_stack[t]) || !is_classic_tag()) {
+			cout << uid << " ERR not-selectable" << endl;
+			failed_tags++;
+			continue;
+		}
+		bool ok = true;
+		for (size_t i = 0; ok && (i < script.size()); i++) {
+			string response = execute_daemon_request(script[i]);
+			cout << uid << " " << response << endl;
+			ok = (response.find("ERR") == string::npos);
+		}
+		if (!ok)
+			failed_tags++;
+		mi_halt(session);
+	}
+	cerr << "Processed " << count << " tag(s), " << failed_tags << " failed." << endl;
+	mi_disconnect(session);
+	return (failed_tags == 0) ? 0 : 1;
 }
 
+#ifndef WIN32
+typedef struct {
+	int fd;
+	uint64_t id;
+	string input;
+	string output;		// responses the socket did not take yet
+} DaemonClient;
+
+const size_t MAX_REQUEST_LENGTH = 4096;
+// A client that reads its responses slower than it sends requests is dropped once this much is
+// waiting for it, the daemon never blocks on one client.
+const size_t MAX_PENDING_OUTPUT = 65536;
+
+int open_unix_socket(const char* path, bool listening) {
+	sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		cerr << "Socket path too long: " << path << endl;
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (listening) {
+		// A socket file nobody accepts on is left over from a daemon that died. One that still
+		// accepts belongs to a running daemon and is left alone, bind() then fails.
+		if (connect(fd, (sockaddr*) &addr, sizeof(addr)) == 0) {
+			cerr << "Another daemon is listening on " << path << endl;
+			close(fd);
+			return -1;
+		}
+		if (errno == ECONNREFUSED)
+			unlink(path);
+		close(fd);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		if ((bind(fd, (sockaddr*) &addr, sizeof(addr)) < 0) || (listen(fd, 16) < 0)) {
+			close(fd);
+			return -1;
+		}
+	} else if (connect(fd, (sockaddr*) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool send_all(int fd, const string& data) {
+	size_t sent = 0;
+	while (sent < data.length()) {
+		ssize_t n = send(fd, data.data() + sent, data.length() - sent, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		sent += n;
+	}
+	return true;
+}
+
+// Sends what the socket takes without waiting, false if the client is gone.
+bool flush_output(DaemonClient* client) {
+	while (!client->output.empty()) {
+		ssize_t n = send(client->fd, client->output.data(), client->output.length(), 0);
+		if ((n < 0) && (errno == EINTR))
+			continue;
+		if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+			return true;
+		if (n <= 0)
+			return false;
+		client->output.erase(0, n);
+	}
+	return true;
+}
+
+int daemon_mode(const char* socket_path) {
+	int listener = open_unix_socket(socket_path, true);
+	if (listener < 0) {
+		cerr << "Could not listen on " << socket_path << endl;
+		return 1;
+	}
+	if (!connect_reader()) {
+		cerr << "Could not connect to the device." << endl;
+		close(listener);
+		unlink(socket_path);
+		return 1;
+	}
+	cerr << "Connected to " << mi_device_name(session) << ", listening on " << socket_path << endl;
+
+	signal(SIGINT, request_stop);
+	signal(SIGTERM, request_stop);
+	signal(SIGPIPE, SIG_IGN);
+
+	vector<DaemonClient> clients;
+	vector<pollfd> fds;
+	char buffer[1024];
+	uint64_t next_id = 1, served_id = 0;
+	while (!stop_requested) {
+		fds.resize(clients.size() + 1);
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+		for (size_t i = 0; i < clients.size(); i++) {
+			fds[i+1].fd = clients[i].fd;
+			fds[i+1].events = clients[i].output.empty() ? POLLIN : (POLLIN | POLLOUT);
+		}
+		if (poll(&fds[0], fds.size(), -1) < 0)
+			continue;	// EINTR, check stop_requested
+
+		// Walk backwards so that dropping a client does not shift the unvisited ones.
+		for (size_t i = clients.size(); i > 0; i--) {
+			if (!fds[i].revents)
+				continue;
+			DaemonClient& client = clients[i-1];
+			bool keep = true;
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				ssize_t n = recv(client.fd, buffer, sizeof(buffer), 0);
+				keep = (n > 0) || ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)));
+				if (n > 0)
+					client.input.append(buffer, n);
+			}
+			string::size_type eol;
+			while (keep && ((eol = client.input.find('\n')) != string::npos)) {
+				string request = client.input.substr(0, eol);
+				client.input.erase(0, eol + 1);
+				if (!request.empty() && request[request.length()-1] == '\r')
+					request.erase(request.length()-1);
+				if (client.id != served_id) {
+					mi_deselect(session);
+					served_id = client.id;
+				}
+				client.output += execute_daemon_request(request) + "\n";
+				keep = flush_output(&client) && (client.output.length() <= MAX_PENDING_OUTPUT);
+			}
+			if (keep && (fds[i].revents & POLLOUT))
+				keep = flush_output(&client);
+			if (client.input.length() > MAX_REQUEST_LENGTH)
+				keep = false;
+			if (!keep) {
+				close(client.fd);
+				clients.erase(clients.begin() + (i-1));
+			}
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int fd = accept(listener, NULL, NULL);
+			if (fd >= 0) {
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				DaemonClient client;
+				client.fd = fd;
+				client.id = next_id++;
+				clients.push_back(client);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < clients.size(); i++)
+		close(clients[i].fd);
+	close(listener);
+	unlink(socket_path);
+	mi_disconnect(session);
+	return 0;
+}
+
+// Sends the request given on the command line, or every line of stdin when there is none.
+int client_mode(const char* socket_path, int argc, char* argv[]) {
+	int fd = open_unix_socket(socket_path, false);
+	if (fd < 0) {
+		cerr << "Could not connect to the daemon at " << socket_path << endl;
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	string request;
+	for (int i = 0; i < argc; i++)
+		request += (i ? " " : "") + string(argv[i]);
+	bool from_stdin = (argc == 0);
+	bool failed = false;
+	string input;
+	char buffer[1024];
+	while (!from_stdin || getline(cin, request)) {
+		if (!send_all(fd, request + "\n")) {
+			cerr << "Connection to the daemon lost." << endl;
+			close(fd);
+			return 1;
+		}
+		string::size_type eol;
+		while ((eol = input.find('\n')) == string::npos) {
+			ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+			if (n <= 0) {
+				cerr << "Connection to the daemon lost." << endl;
+				close(fd);
+				return 1;
+			}
+			input.append(buffer, n);
+		}
+		string response = input.substr(0, eol);
+		input.erase(0, eol + 1);
+		cout << response << endl;
+		failed = failed || (response.find("ERR") != string::npos);
+		if (!from_stdin)
+			break;
+	}
+	close(fd);
+	return failed ? 1 : 0;
+}
+#else
+int daemon_mode(const char*) {
+	cerr << "Daemon mode is not supported on this platform." << endl;
+	return 1;
+}
+
+int client_mode(const char*, int, char**) {
+	cerr << "Client mode is not supported on this platform." << endl;
+	return 1;
+}
+#endif
+
+void print_usage();
+
+// -- Transport calibration (-calibrate) --
+// Connects at each UART speed in turn and times host <-> reader round trips: a register write
+// that never leaves the chip, plus a deselect/select cycle when a tag is in the field. The fastest
+// speed at which every round succeeded is recommended, ties go to the higher speed.
+
+static const uint32_t UART_SPEEDS[] = { 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600 };
+
+int calibrate_mode(int argc, char* argv[]) {
+	UINT rounds = 200;
+	for (int i = 0; i < argc; i++) {
+		if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc) && (atoi(argv[i + 1]) > 0))
+			rounds = atoi(argv[++i]);
+		else {
+			print_usage();
+			return 1;
+		}
+	}
+	if (!reader_chosen) {
+		mi_reader found;
+		if ((mi_list_readers(&found, 1) == 0) || !found.driver[0]) {
+			cerr << "No reader found, choose one with -reader driver:port." << endl;
+			return 1;
+		}
+		reader_driver = found.driver;
+		reader_port = found.port;
+		reader_chosen = true;
+	}
+
+	cout << "Calibrating " << reader_driver << (reader_port.empty() ? "" : " on " + reader_port)
+		<< ", " << rounds << " rounds per speed" << endl;
+	uint32_t best_speed = 0;
+	double best_p50 = 0;
+	for (size_t i = 0; i < sizeof(UART_SPEEDS) / sizeof(UART_SPEEDS[0]); i++) {
+		reader_speed = UART_SPEEDS[i];
+		cout << setw(7) << UART_SPEEDS[i] << " baud: ";
+		if (!connect_reader()) {
+			cout << "no answer" << endl;
+			continue;
+		}
+		bool tag = select_tag();
+		vector<double> samples;
+		samples.reserve(rounds);
+		UINT failures = 0;
+		for (UINT r = 0; r < rounds; r++) {
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			bool ok = (mi_ping(session) == MI_OK);
+			if (ok && tag) {
+				mi_deselect(session);
+				ok = select_tag();
+			}
+			double us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+			if (ok)
+				samples.push_back(us);
+			else
+				failures++;
+		}
+		mi_disconnect(session);
+
+		double p50 = percentile(samples, 0.50);
+		cout << (rounds - failures) << "/" << rounds << " ok" << (tag ? " (with tag)" : "");
+		if (!samples.empty())
+			cout << ", round trip [us]: p50 " << (UINT) p50 << ", p99 " << (UINT) percentile(samples, 0.99)
+				<< ", max " << (UINT) *max_element(samples.begin(), samples.end());
+		cout << endl;
+		if ((failures == 0) && (!best_speed || (p50 <= best_p50))) {
+			best_speed = UART_SPEEDS[i];
+			best_p50 = p50;
+		}
+	}
+	if (!best_speed) {
+		cout << "No speed was stable." << endl;
+		return 1;
+	}
+	cout << "Recommended: -reader " << reader_driver << ":" << reader_port << ":" << best_speed
+		<< " (or set MICMD_READER to the same)" << endl;
+	return 0;
+}
+
+// -- Scheduling jitter (-jitter) --
+// Runs the same periodic loop twice, with the normal scheduler and then with the real-time profile
+// (the one given with -rt, otherwise the last core at SCHED_FIFO 50). Every round sleeps until its
+// deadline and records how late it woke up; with a reader it also times a round trip, and a
+// reselect when a tag is in the field. Run on a loaded machine, it shows what -rt buys.
+
+void print_jitter(const char* label, vector<double>& samples) {
+	if (samples.empty())
+		return;
+	cout << "  " << label << " [us]: p50 " << (UINT) percentile(samples, 0.50) << ", p99 " << (UINT) percentile(samples, 0.99)
+		<< ", p99.9 " << (UINT) percentile(samples, 0.999) << ", max " << (UINT) *max_element(samples.begin(), samples.end()) << endl;
+}
+
+int jitter_mode(int argc, char* argv[]) {
+	UINT rounds = 2000, period_us = 1000;
+	for (int i = 0; i < argc; i++) {
+		if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc) && (atoi(argv[i + 1]) > 0))
+			rounds = atoi(argv[++i]);
+		else if ((strcmp(argv[i], "-period") == 0) && (i + 1 < argc) && (atoi(argv[i + 1]) > 0))
+			period_us = atoi(argv[++i]);
+		else {
+			print_usage();
+			return 1;
+		}
+	}
+	RtProfile profile = rt_profile;
+	if (!rt_chosen) {
+		profile.cpu = (int) thread::hardware_concurrency() - 1;
+		profile.priority = 50;
+		profile.lock_memory = true;
+	}
+	// Applied below between the two runs, not when connecting.
+	rt_chosen = false;
+	bool reader = connect_reader();
+	bool tag = reader && select_tag();
+	cout << "Jitter: " << rounds << " rounds every " << period_us << " us, "
+		<< (reader ? (tag ? "reader round trips with a tag" : "reader round trips") : "no reader") << endl;
+
+	const chrono::microseconds period(period_us);
+	for (int run = 0; run < 2; run++) {
+		vector<double> wakeups, trips;
+		if (run == 1) {
+			string report;
+			rt_apply(profile, &report);
+			cout << "Real-time profile: " << report << endl;
+		} else
+			cout << "Normal scheduling" << endl;
+		wakeups.reserve(rounds);
+		trips.reserve(rounds);
+		UINT failures = 0, overruns = 0;
+		chrono::steady_clock::time_point deadline = chrono::steady_clock::now();
+		for (UINT r = 0; r < rounds; r++) {
+			deadline += period;
+			this_thread::sleep_until(deadline);
+			chrono::steady_clock::time_point woke = chrono::steady_clock::now();
+			wakeups.push_back(chrono::duration<double, micro>(woke - deadline).count());
+			if (reader) {
+				bool ok = (mi_ping(session) == MI_OK);
+				if (ok && tag) {
+					mi_deselect(session);
+					ok = select_tag();
+				}
+				if (ok)
+					trips.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - woke).count());
+				else
+					failures++;
+			}
+			// A round that ran past the next deadline starts a new schedule, it is not counted
+			// as the next wake-up being late.
+			if (chrono::steady_clock::now() > deadline + period) {
+				deadline = chrono::steady_clock::now();
+				overruns++;
+			}
+		}
+		print_jitter("wake-up late", wakeups);
+		print_jitter("round trip", trips);
+		if (failures || overruns)
+			cout << "  " << failures << " failed round trips, " << overruns << " rounds overran the period" << endl;
+	}
+	if (reader)
+		mi_disconnect(session);
+	return 0;
+}
+
+// -- UID inventory (-inventory) --
+// Identifies tags as fast as the reader allows: select, note the UID, halt the tag so that the
+// next select finds another one, and reset the field once nobody answers so that the halted
+// tags and new arrivals answer again. Each UID is printed once, when it is first seen.
+
+typedef struct {
+	uint8_t length;
+	uint8_t bytes[MI_MAX_UID];
+} UidKey;
+
+bool operator==(const UidKey& a, const UidKey& b) {
+	return (a.length == b.length) && (memcmp(a.bytes, b.bytes, a.length) == 0);
+}
+
+// FNV-1a over the UID bytes.
+struct UidHash {
+	size_t operator()(const UidKey& k) const {
+		uint64_t h = 14695981039346656037ULL;
+		for (uint8_t i = 0; i < k.length; i++)
+			h = (h ^ k.bytes[i]) * 1099511628211ULL;
+		return (size_t) h;
+	}
+};
+
+int inventory_mode(int argc, char* argv[]) {
+	double limit_s = 0;
+	uint64_t limit_tags = 0;
+	for (int i = 0; i < argc; i++) {
+		if ((strcmp(argv[i], "-t") == 0) && (i + 1 < argc) && (atof(argv[i + 1]) > 0))
+			limit_s = atof(argv[++i]);
+		else if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc) && (atoi(argv[i + 1]) > 0))
+			limit_tags = strtoull(argv[++i], NULL, 10);
+		else {
+			print_usage();
+			return 1;
+		}
+	}
+	if (!connect_reader()) {
+		cerr << "Could not connect to the device." << endl;
+		return 1;
+	}
+	cerr << "Inventory on " << mi_device_name(session) << ", new UIDs follow (UID ATQA SAK)." << endl;
+
+	signal(SIGINT, request_stop);
+	signal(SIGTERM, request_stop);
+
+	unordered_set<UidKey, UidHash> seen;
+	seen.reserve(65536);
+	uint64_t reads = 0, resets = 0;
+	mi_tag tag;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	while (!stop_requested) {
+		if (mi_select(session, &tag) == MI_OK) {
+			reads++;
+			UidKey key;
+			key.length = (uint8_t) tag.uid_length;
+			memcpy(key.bytes, tag.uid, tag.uid_length);
+			if (seen.insert(key).second) {
+				printf("%s %s %s\n", bytearray_to_string(tag.uid, tag.uid_length, false).c_str(),
+					bytearray_to_string(tag.atqa, 2, false).c_str(), bytearray_to_string(&tag.sak, 1, false).c_str());
+				fflush(stdout);
+				if (limit_tags && (seen.size() >= limit_tags))
+					break;
+			}
+			mi_halt(session);
+		} else {
+			mi_reset_field(session);
+			resets++;
+		}
+		if (limit_s && (chrono::duration<double>(chrono::steady_clock::now() - start).count() >= limit_s))
+			break;
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	mi_disconnect(session);
+
+	cerr << "Unique tags: " << seen.size() << ", reads: " << reads << ", field resets: " << resets
+		<< " in " << fixed << setprecision(2) << seconds << " s" << endl;
+	if (seconds > 0)
+		cerr << setprecision(1) << "Identified " << reads / seconds << " tags/s, "
+			<< seen.size() / seconds << " new tags/s" << endl;
+	return 0;
+}
+
+// -- MAD-directed reading (-mad) --
+// Reads the MIFARE Application Directory (sector 0, and sector 16 on 4K cards), checks its CRC
+// and prints which application owns which sector. Given an application ID, only that
+// application's sectors are authenticated and read; for NDEF (E103) the message is decoded.
+
+// Authenticates with the first key that works, the tag is reselected after every failure.
+static bool auth_with_keys(uint8_t sector, const vector<MifareKey>& keys, const mi_tag& tag) {
+	for (size_t i = 0; i < keys.size(); i++) {
+		if (!mi_selected_tag(session, NULL) && (mi_select_uid(session, tag.uid, tag.uid_length, NULL) != MI_OK))
+			return false;
+		if (mi_authenticate(session, sector, MI_KEY_A, keys[i].bytes) == MI_OK)
+			return true;
+	}
+	return false;
+}
+
+static bool read_blocks(uint32_t first, uint32_t count, uint8_t* data) {
+	for (uint32_t i = 0; i < count; i++)
+		if (mi_read_block(session, (uint8_t) (first + i), data + i * MIFARE_BLOCK_SIZE) != MI_OK)
+			return false;
+	return true;
+}
+
+int mad_mode(int argc, char* argv[]) {
+	long aid = -1;
+	vector<MifareKey> keys;
+	for (int i = 0; i < argc; i++) {
+		MifareKey key;
+		char* end;
+		if ((strcmp(argv[i], "-k") == 0) && (i + 1 < argc) && parse_key(argv[i + 1], &key)) {
+			keys.push_back(key);
+			i++;
+		} else if ((aid < 0) && (strcmp(argv[i], "ndef") == 0))
+			aid = MAD_NDEF_AID;
+		else if ((aid < 0) && isxdigit((unsigned char) argv[i][0]) && ((aid = strtol(argv[i], &end, 16)) <= 0xFFFF) && !*end)
+			continue;
+		else {
+			print_usage();
+			return 1;
+		}
+	}
+	MifareKey mad_key, ndef_key, default_key;
+	memcpy(mad_key.bytes, MAD_KEY_A, 6);
+	memcpy(ndef_key.bytes, NDEF_KEY_A, 6);
+	memset(default_key.bytes, 0xFF, 6);
+	vector<MifareKey> mad_keys(1, mad_key);
+	mad_keys.push_back(default_key);
+	if (aid == MAD_NDEF_AID)
+		keys.push_back(ndef_key);
+	keys.push_back(default_key);
+
+	if (!connect_reader()) {
+		cerr << "Could not connect to the device." << endl;
+		return 1;
+	}
+	mi_tag tag;
+	if (mi_select(session, &tag) != MI_OK) {
+		cerr << "No tag in the field." << endl;
+		mi_disconnect(session);
+		return 1;
+	}
+	bool is_4k = mi_is_4k(&tag) != 0;
+	uint32_t sectors_read = 0;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	// Blocks 1-3 of sector 0: MAD1 and the trailer with the GPB.
+	uint8_t mad1[3 * MIFARE_BLOCK_SIZE], mad2[3 * MIFARE_BLOCK_SIZE];
+	if (!auth_with_keys(MAD_SECTOR, mad_keys, tag) || !read_blocks(1, 3, mad1)) {
+		cerr << "Could not read sector 0 with the MAD key or the default key." << endl;
+		mi_disconnect(session);
+		return 1;
+	}
+	sectors_read++;
+	int version = mad_version(mad1 + 2 * MIFARE_BLOCK_SIZE);
+	if (!version) {
+		cerr << "The card has no MAD (GPB " << bytearray_to_string(mad1 + 2 * MIFARE_BLOCK_SIZE + 9, 1, false) << ")." << endl;
+		mi_disconnect(session);
+		return 1;
+	}
+	bool has_mad2 = (version == 2) && is_4k;
+	if (has_mad2) {
+		uint32_t first = get_first_block(MAD2_SECTOR);
+		if (!auth_with_keys(MAD2_SECTOR, mad_keys, tag) || !read_blocks(first, 3, mad2)) {
+			cerr << "Could not read the MAD2 in sector 16." << endl;
+			mi_disconnect(session);
+			return 1;
+		}
+		sectors_read++;
+	}
+	Mad mad;
+	string error;
+	if (!mad_decode(mad1, has_mad2 ? mad2 : NULL, &mad, &error)) {
+		cerr << "Invalid MAD: " << error << endl;
+		mi_disconnect(session);
+		return 1;
+	}
+
+	cout << "MAD" << mad.version << " on " << bytearray_to_string(tag.uid, tag.uid_length, false)
+		<< ", card publisher sector " << (UINT) mad.publisher << endl;
+	for (size_t sector = 1; sector < mad.sector_count; sector++) {
+		if ((sector == MAD2_SECTOR) || (mad.aids[sector] == 0x0000))
+			continue;
+		const char* name = mad_aid_name(mad.aids[sector]);
+		cout << "  sector " << setw(2) << sector << ": " << hex << uppercase << setw(4) << setfill('0') << mad.aids[sector]
+			<< dec << setfill(' ') << (name ? string(" ") + name : "") << endl;
+	}
+
+	int result = 0;
+	if (aid >= 0) {
+		vector<uint8_t> sectors = mad_sectors(mad, (uint16_t) aid);
+		vector<uint8_t> data;
+		for (size_t i = 0; i < sectors.size(); i++) {
+			uint32_t first = get_first_block(sectors[i]);
+			uint32_t count = get_trailer_block(first) - first;
+			size_t offset = data.size();
+			data.resize(offset + count * MIFARE_BLOCK_SIZE);
+			if (!auth_with_keys(sectors[i], keys, tag) || !read_blocks(first, count, &data[offset])) {
+				cerr << "Could not read sector " << (UINT) sectors[i] << "." << endl;
+				result = 1;
+				break;
+			}
+			sectors_read++;
+		}
+		if (sectors.empty()) {
+			cout << "No sector belongs to application " << hex << uppercase << setw(4) << setfill('0') << aid
+				<< dec << setfill(' ') << endl;
+			result = 1;
+		}
+		else if (!result && (aid == MAD_NDEF_AID)) {
+			vector<uint8_t> message;
+			if (ndef_find_message(data.empty() ? NULL : &data[0], data.size(), &message))
+				print_ndef_message(cout, message);
+			else {
+				cout << "No NDEF message in the NDEF sectors." << endl;
+				result = 1;
+			}
+		}
+		else if (!result) {
+			for (size_t offset = 0; offset < data.size(); offset += MIFARE_BLOCK_SIZE)
+				cout << bytearray_to_string(&data[offset], MIFARE_BLOCK_SIZE, false) << endl;
+		}
+	}
+	double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	mi_disconnect(session);
+	cerr << "Read " << sectors_read << " of " << (is_4k ? 40 : 16) << " sectors in " << fixed << setprecision(1)
+		<< ms << " ms" << endl;
+	return result;
+}
+
+// -- Bulk key diversification (-derive) --
+// Derives the sector keys of every UID in a list (hex, one per line) with the scheme chosen by
+// -kdf, printing "UID sector keyA keyB" lines. The list is read in chunks, each chunk is split
+// over the worker threads which format into their own buffer, the buffers are written in list
+// order.
+
+const size_t DERIVE_CHUNK = 65536;	// UIDs per chunk
+
+static void append_hex(string* out, const uint8_t* p, size_t length) {
+	static const char DIGITS[] = "0123456789ABCDEF";
+	for (size_t i = 0; i < length; i++) {
+		*out += DIGITS[p[i] >> 4];
+		*out += DIGITS[p[i] & 0x0F];
+	}
+}
+
+static void derive_range(const vector<UidKey>& uids, size_t first, size_t last, UINT sectors, string* out) {
+	uint8_t keys[KDF_MAX_SECTORS][2][6];
+	char text[16];	// " <sector> ", room for any UINT
+	out->clear();
+	out->reserve((last - first) * sectors * 48);
+	for (size_t i = first; i < last; i++) {
+		kdf_derive(&kdf, uids[i].bytes, uids[i].length, sectors, keys);
+		for (UINT sector = 0; sector < sectors; sector++) {
+			append_hex(out, uids[i].bytes, uids[i].length);
+			snprintf(text, sizeof(text), " %u ", sector);
+			*out += text;
+			append_hex(out, keys[sector][0], 6);
+			*out += ' ';
+			append_hex(out, keys[sector][1], 6);
+			*out += '\n';
+		}
+	}
+}
+
+int derive_mode(int argc, char* argv[]) {
+	const char* filename = NULL;
+	unsigned threads = 0;
+	UINT sectors = 16;
+	for (int i = 0; i < argc; i++) {
+		if ((strcmp(argv[i], "-j") == 0) && (i + 1 < argc) && parse_threads(argv[i + 1], &threads))
+			i++;
+		else if ((strcmp(argv[i], "-s") == 0) && (i + 1 < argc) && (atoi(argv[i + 1]) > 0) && (atoi(argv[i + 1]) <= KDF_MAX_SECTORS))
+			sectors = atoi(argv[++i]);
+		else if (!filename && ((argv[i][0] != '-') || (strcmp(argv[i], "-") == 0)))
+			filename = argv[i];
+		else {
+			print_usage();
+			return 1;
+		}
+	}
+	if (!filename) {
+		print_usage();
+		return 1;
+	}
+	if (!kdf_chosen) {
+		cerr << "No key diversification, choose one with -kdf or MICMD_KDF." << endl;
+		return 1;
+	}
+	ifstream file;
+	if (strcmp(filename, "-") != 0) {
+		file.open(filename);
+		if (!file) {
+			cerr << "Could not open " << filename << endl;
+			return 1;
+		}
+	}
+	istream& in = file.is_open() ? (istream&) file : cin;
+	if (threads == 0)
+		threads = thread::hardware_concurrency();
+	if (threads == 0)
+		threads = 1;
+
+	vector<UidKey> uids;
+	uids.reserve(DERIVE_CHUNK);
+	vector<string> outputs(threads);
+	uint64_t total = 0, invalid = 0, line_number = 0;
+	string line;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	bool more = true;
+	while (more) {
+		uids.clear();
+		while (uids.size() < DERIVE_CHUNK) {
+			if (!getline(in, line)) {
+				more = false;
+				break;
+			}
+			line_number++;
+			while (!line.empty() && isspace((unsigned char) line[line.length() - 1]))
+				line.erase(line.length() - 1);
+			if (line.empty())
+				continue;
+			UidKey uid;
+			uid.length = (uint8_t) (line.length() / 2);
+			if (((uid.length != 4) && (uid.length != 7) && (uid.length != 10)) || !parse_hex(line, uid.bytes, uid.length)) {
+				cerr << "Line " << line_number << ": not a 4, 7 or 10 byte UID in hex" << endl;
+				invalid++;
+				continue;
+			}
+			uids.push_back(uid);
+		}
+		vector<thread> workers;
+		for (unsigned t = 0; t < threads; t++)
+			workers.push_back(thread(derive_range, cref(uids), uids.size() * t / threads, uids.size() * (t + 1) / threads,
+				sectors, &outputs[t]));
+		for (unsigned t = 0; t < threads; t++) {
+			workers[t].join();
+			fwrite(outputs[t].data(), 1, outputs[t].size(), stdout);
+		}
+		total += uids.size();
+	}
+	fflush(stdout);
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	cerr << total << " UIDs, " << total * sectors * 2 << " keys (" << kdf.scheme->name << ", "
+		<< (aes128_hardware() ? "AES-NI" : "software AES") << ", " << threads << " threads) in "
+		<< fixed << setprecision(2) << seconds << " s";
+	if (seconds > 0)
+		cerr << ", " << setprecision(0) << total * sectors * 2 / seconds << " keys/s";
+	cerr << endl;
+	if (invalid)
+		cerr << invalid << " lines were not UIDs." << endl;
+	return invalid ? 1 : 0;
+}
+
+// -- Fault injection (-stress) --
+// Runs a long random workload of reads, writes and debits through the session against the
+// stand-in reader, which removes the tag, drops transmissions and tears writes at the given
+// rates. Every operation is retried under the retry policy (reselect, authenticate, repeat,
+// backoff in between) and checked against a shadow copy of the card. Times are the stand-in's
+// virtual time, the same seed replays the same run.
+
+// The debit workload owns sector 1: its value block and the backup.
+const uint8_t STRESS_VALUE_BLOCK = 4;
+const uint8_t STRESS_BACKUP_BLOCK = 5;
+const int32_t STRESS_BALANCE = 100000000;
+
+// A blank 1K card: UID 01020304, transport trailers with the default keys.
+void blank_card(CardImage* image) {
+	static const uint8_t BLOCK0[16] = { 0x01, 0x02, 0x03, 0x04, 0x04, 0x08, 0x04, 0x00 };
+	static const uint8_t TRAILER[16] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x07, 0x80, 0x69,
+		0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+	memset(image->data, 0, sizeof(image->data));
+	image->size = MIFARE_1K_SIZE;
+	memcpy(image->data, BLOCK0, 16);
+	for (uint32_t sector = 0; sector < 16; sector++)
+		memcpy(image->data + get_trailer_block(get_first_block(sector)) * MIFARE_BLOCK_SIZE, TRAILER, 16);
+}
+
+void format_value_block(uint8_t* block, int32_t value, uint8_t address) {
+	for (int i = 0; i < 4; i++) {
+		block[i] = block[8 + i] = (uint8_t) ((uint32_t) value >> (8 * i));
+		block[4 + i] = (uint8_t) ~block[i];
+	}
+	block[12] = block[14] = address;
+	block[13] = block[15] = (uint8_t) ~address;
+}
+
+int stress_mode(int argc, char* argv[]) {
+	const char* image_file = NULL;
+	UINT operations = 10000, retries = 5;
+	double backoff_ms = 20;
+	SimFaults faults = { 0.001, 0.01, 0.005, 200, 1 };
+	for (int i = 0; i < argc; i++) {
+		bool has_arg = (i + 1 < argc);
+		if ((strcmp(argv[i], "-image") == 0) && has_arg)
+			image_file = argv[++i];
+		else if ((strcmp(argv[i], "-n") == 0) && has_arg && (atoi(argv[i + 1]) > 0))
+			operations = atoi(argv[++i]);
+		else if ((strcmp(argv[i], "-removal") == 0) && has_arg)
+			faults.removal_rate = atof(argv[++i]);
+		else if ((strcmp(argv[i], "-error") == 0) && has_arg)
+			faults.error_rate = atof(argv[++i]);
+		else if ((strcmp(argv[i], "-tear") == 0) && has_arg)
+			faults.tear_rate = atof(argv[++i]);
+		else if ((strcmp(argv[i], "-away") == 0) && has_arg)
+			faults.away_ms = atof(argv[++i]);
+		else if ((strcmp(argv[i], "-retries") == 0) && has_arg)
+			retries = atoi(argv[++i]);
+		else if ((strcmp(argv[i], "-backoff") == 0) && has_arg)
+			backoff_ms = atof(argv[++i]);
+		else if ((strcmp(argv[i], "-seed") == 0) && has_arg)
+			faults.seed = strtoul(argv[++i], NULL, 10);
+		else {
+			print_usage();
+			return 1;
+		}
+	}
+
+	CardImage shadow;
+	if (!image_file)
+		blank_card(&shadow);
+	else if (!load_card_image(image_file, &shadow)) {
+		cerr << "Could not load the card image " << image_file << endl;
+		return 1;
+	}
+	format_value_block(shadow.data + STRESS_VALUE_BLOCK * MIFARE_BLOCK_SIZE, STRESS_BALANCE, STRESS_VALUE_BLOCK);
+	format_value_block(shadow.data + STRESS_BACKUP_BLOCK * MIFARE_BLOCK_SIZE, STRESS_BALANCE, STRESS_VALUE_BLOCK);
+
+	// The workload reads and writes every other data block with key A of its sector.
+	vector<uint8_t> blocks;
+	uint32_t block_count = (uint32_t) (shadow.size / MIFARE_BLOCK_SIZE);
+	for (uint32_t block = 1; block < block_count; block++)
+		if (!is_trailer_block(block) && (get_sector(block) != get_sector(STRESS_VALUE_BLOCK)))
+			blocks.push_back((uint8_t) block);
+	vector<bool> known(block_count, true);
+
+	SimReader* sim = new SimReader;
+	sim_init(sim, shadow, faults);
+	mi_connect_simulator(session, sim);
+	mt19937 rng(faults.seed + 1);
+
+	vector<double> recovery_ms;
+	UINT completed = 0, abandoned = 0, violations = 0, debits = 0, repeated_debits = 0, max_attempts = 0;
+	int32_t balance = STRESS_BALANCE;
+	int64_t unconfirmed = 0;	// amounts of abandoned debits that may still have reached the tag
+	chrono::steady_clock::time_point wall = chrono::steady_clock::now();
+
+	for (UINT n = 0; n < operations; n++) {
+		UINT kind = uniform_int_distribution<UINT>(0, 99)(rng);
+		OperationType type = (kind < 60) ? OP_READ : ((kind < 85) ? OP_WRITE : OP_DECREMENT);
+		uint8_t block = (type == OP_DECREMENT) ? STRESS_VALUE_BLOCK : blocks[uniform_int_distribution<size_t>(0, blocks.size() - 1)(rng)];
+		uint8_t sector = (uint8_t) get_sector(block);
+		const uint8_t* key = shadow.data + get_trailer_block(get_first_block(sector)) * MIFARE_BLOCK_SIZE;
+		BlockData data;
+		for (int i = 0; i < 16; i++)
+			data.bytes[i] = (uint8_t) rng();
+		int32_t amount = uniform_int_distribution<int32_t>(1, 100)(rng);
+
+		mi_status status = MI_ERR_NO_TAG;
+		mi_debit_result result;
+		double first_failure = -1;
+		bool uncertain = false;		// a debit attempt may have reached the tag, ask before retrying
+		UINT attempt;
+		for (attempt = 0; attempt <= retries; attempt++) {
+			if (attempt)
+				sim_wait(sim, backoff_ms);
+			status = mi_selected_tag(session, NULL) ? MI_OK : mi_select(session, NULL);
+			if ((status == MI_OK) && (type == OP_DECREMENT) && uncertain) {
+				int applied;
+				status = mi_debit_applied(session, sector, MI_KEY_A, key, STRESS_VALUE_BLOCK, STRESS_BACKUP_BLOCK, &applied, &result);
+				uncertain = (status != MI_OK);
+				if ((status == MI_OK) && !applied)
+					status = mi_debit(session, sector, MI_KEY_A, key, STRESS_VALUE_BLOCK, STRESS_BACKUP_BLOCK, amount, &result);
+				uncertain = uncertain || (status == MI_ERR_UNCERTAIN);
+			}
+			else if ((status == MI_OK) && (type == OP_DECREMENT)) {
+				status = mi_debit(session, sector, MI_KEY_A, key, STRESS_VALUE_BLOCK, STRESS_BACKUP_BLOCK, amount, &result);
+				uncertain = (status == MI_ERR_UNCERTAIN);
+			}
+			else if (status == MI_OK)
+				status = mi_authenticate(session, sector, MI_KEY_A, key);
+			if ((status == MI_OK) && (type == OP_READ))
+				status = mi_read_block(session, block, data.bytes);
+			else if ((status == MI_OK) && (type == OP_WRITE))
+				status = mi_write_block(session, block, data.bytes);
+			if ((status == MI_OK) || (status == MI_ERR_BALANCE) || (status == MI_ERR_CORRUPT))
+				break;
+			if (first_failure < 0)
+				first_failure = sim_now(sim);
+		}
+		if ((status != MI_OK) && uncertain)
+			unconfirmed += amount;
+
+		uint8_t* expected = shadow.data + block * MIFARE_BLOCK_SIZE;
+		if (status != MI_OK) {
+			abandoned++;
+			// An abandoned write may have torn the block, the next read tells what it holds.
+			if (type == OP_WRITE)
+				known[block] = false;
+			if (status == MI_ERR_CORRUPT) {
+				violations++;
+				cout << "Operation " << n << ": value block and backup both destroyed" << endl;
+			}
+			continue;
+		}
+		completed++;
+		max_attempts = max(max_attempts, attempt + 1);
+		if (first_failure >= 0)
+			recovery_ms.push_back(sim_now(sim) - first_failure);
+
+		if (type == OP_READ) {
+			if (known[block] && (memcmp(data.bytes, expected, 16) != 0)) {
+				violations++;
+				cout << "Operation " << n << ": block " << (UINT) block << " reads " << bytearray_to_string(data.bytes, 16, false)
+					<< ", expected " << bytearray_to_string(expected, 16, false) << endl;
+			}
+			memcpy(expected, data.bytes, 16);
+			known[block] = true;
+		}
+		else if (type == OP_WRITE) {
+			memcpy(expected, data.bytes, 16);
+			known[block] = true;
+		}
+		else {
+			// An abandoned debit may have reached the tag, this one then starts from less. Less
+			// than that is a debit applied twice.
+			debits++;
+			int64_t missing = (int64_t) balance - result.before;
+			if (missing < 0) {
+				violations++;
+				cout << "Operation " << n << ": debit started from " << result.before << ", expected " << balance << endl;
+			}
+			else if (missing > unconfirmed) {
+				// Charging a card twice is as much a failure as losing data.
+				repeated_debits++;
+				violations++;
+				cout << "Operation " << n << ": debit started from " << result.before << ", expected " << balance
+					<< ", a debit was applied again by a retry" << endl;
+			}
+			balance = result.after;
+			unconfirmed = 0;
+		}
+	}
+	double wall_s = chrono::duration<double>(chrono::steady_clock::now() - wall).count();
+
+	// What the tag holds in the end must match every block the workload knows.
+	for (uint32_t block = 1; block < block_count; block++) {
+		if (is_trailer_block(block) || !known[block] || (get_sector(block) == get_sector(STRESS_VALUE_BLOCK)))
+			continue;
+		if (memcmp(sim->image.data + block * MIFARE_BLOCK_SIZE, shadow.data + block * MIFARE_BLOCK_SIZE, 16) != 0) {
+			violations++;
+			cout << "Block " << block << " holds " << bytearray_to_string(sim->image.data + block * MIFARE_BLOCK_SIZE, 16, false)
+				<< ", expected " << bytearray_to_string(shadow.data + block * MIFARE_BLOCK_SIZE, 16, false) << endl;
+		}
+	}
+	int32_t value, backup;
+	ValueBlockStatus value_status = check_value_block(sim->image.data + STRESS_VALUE_BLOCK * MIFARE_BLOCK_SIZE, STRESS_VALUE_BLOCK, &value);
+	ValueBlockStatus backup_status = check_value_block(sim->image.data + STRESS_BACKUP_BLOCK * MIFARE_BLOCK_SIZE, STRESS_BACKUP_BLOCK, &backup);
+
+	double virtual_s = sim_now(sim) / 1000;
+	const SimCounters& c = sim->counters;
+	cout << "Operations: " << operations << " (" << completed << " completed, " << abandoned << " abandoned after "
+		<< retries << " retries)" << endl;
+	cout << "Injected: " << c.removals << " removals, " << c.errors << " errors, " << c.tears << " tears in "
+		<< c.commands << " commands" << endl;
+	cout << fixed << setprecision(1) << "Throughput: " << (virtual_s > 0 ? completed / virtual_s : 0) << " operations/s over "
+		<< virtual_s << " s of reader time (simulated in " << setprecision(2) << wall_s << " s)" << endl;
+	cout << setprecision(1);
+	if (!recovery_ms.empty())
+		cout << "Recovery latency [ms]: p50 " << percentile(recovery_ms, 0.50) << ", p99 " << percentile(recovery_ms, 0.99)
+			<< ", max " << *max_element(recovery_ms.begin(), recovery_ms.end()) << " (" << recovery_ms.size()
+			<< " recovered operations, at most " << max_attempts << " attempts)" << endl;
+	cout << "Debits: " << debits << ", " << repeated_debits << " applied again by a retry after the first had reached the tag" << endl;
+	cout << "Value block: " << value_block_status_name(value_status) << " " << value << ", backup: "
+		<< value_block_status_name(backup_status) << " " << backup << ", expected " << balance << endl;
+	cout << "Integrity violations: " << violations << " (" << repeated_debits << " repeated debits)" << endl;
+
+	mi_disconnect(session);
+	delete sim;
+	return violations ? 2 : 0;
+}
+
+// -- Planned batch execution (-plan) --
+// A batch file lists what is known about the card and the operations to run:
+//   key <sector> <A|B> <key>        trailer <sector> <16B hex>
+//   read <block>                    write <block> <16B hex>
+//   inc|dec|restore <block> <4B hex value>
+//   transfer <block>
+// Trailers that are not given are read from the tag first. The planner groups the operations by
+// sector, picks the keys and rejects what the access conditions deny before anything is sent.
+
+bool load_batch(const char* filename, vector<Operation>* ops, vector<SectorKnowledge>* sectors) {
+	ifstream in(filename);
+	if (!in) {
+		cerr << "Could not open batch file " << filename << endl;
+		return false;
+	}
+	SectorKnowledge unknown;
+	memset(&unknown, 0, sizeof(unknown));
+	sectors->assign(PLAN_MAX_SECTORS, unknown);
+	ops->clear();
+
+	string line;
+	int line_no = 0;
+	while (getline(in, line)) {
+		line_no++;
+		if (!line.empty() && line[line.length()-1] == '\r')
+			line.erase(line.length()-1);
+		string::size_type hash = line.find('#');
+		if (hash != string::npos)
+			line.erase(hash);
+		istringstream ls(line);
+		string name, arg;
+		if (!(ls >> name))
+			continue;
+		bool ok;
+		UINT number = 0;
+		if (name == "key") {
+			string type;
+			MifareKey key;
+			ok = (ls >> number >> type >> arg) && (number < PLAN_MAX_SECTORS) && ((type == "A") || (type == "B")) && parse_key(arg, &key);
+			if (ok) {
+				SectorKnowledge& k = (*sectors)[number];
+				k.has_key[type == "B"] = true;
+				memcpy(k.key[type == "B"], key.bytes, 6);
+			}
+		} else if (name == "trailer") {
+			BlockData data;
+			ok = (ls >> number >> arg) && (number < PLAN_MAX_SECTORS) && parse_block_data(arg, &data);
+			if (ok) {
+				(*sectors)[number].has_trailer = true;
+				memcpy((*sectors)[number].trailer, data.bytes, 16);
+			}
+		} else {
+			Operation op;
+			memset(&op, 0, sizeof(op));
+			op.line = line_no;
+			ok = !!(ls >> number) && (number < 256);
+			op.block = (uint8_t) number;
+			if (name == "read")
+				op.type = OP_READ;
+			else if (name == "transfer")
+				op.type = OP_TRANSFER;
+			else if (name == "write") {
+				BlockData data;
+				op.type = OP_WRITE;
+				ok = ok && (ls >> arg) && parse_block_data(arg, &data);
+				memcpy(op.data, data.bytes, 16);
+			} else {
+				ValueData value;
+				if (name == "inc")
+					op.type = OP_INCREMENT;
+				else if (name == "dec")
+					op.type = OP_DECREMENT;
+				else if (name == "restore")
+					op.type = OP_RESTORE;
+				else
+					ok = false;
+				ok = ok && (ls >> arg) && parse_value(arg, &value);
+				memcpy(op.data, value.bytes, 4);
+			}
+			if (ok)
+				ops->push_back(op);
+		}
+		if (!ok || (ls >> arg)) {
+			cerr << filename << ":" << line_no << ": invalid line" << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Reads the trailers the batch did not give, for the sectors it operates on. The session keeps
+// the last authentication, a first plan step on the same sector and key does not repeat it.
+void fetch_trailers(const vector<Operation>& ops, vector<SectorKnowledge>* sectors) {
+	for (size_t i = 0; i < ops.size(); i++) {
+		uint32_t sector = get_sector(ops[i].block);
+		SectorKnowledge& k = (*sectors)[sector];
+		if (k.has_trailer || (sector >= (b4k ? 40u : 16u)))
+			continue;
+		for (int kt = 0; (kt < 2) && !k.has_trailer; kt++) {
+			if (!k.has_key[kt])
+				continue;
+			MifareKey key;
+			BlockData data;
+			memcpy(key.bytes, k.key[kt], 6);
+			if (auth_sector(key, kt == 1, sector) && read_block(get_trailer_block(get_first_block(sector)), &data)) {
+				k.has_trailer = true;
+				memcpy(k.trailer, data.bytes, 16);
+			}
+			else
+				reselect_tag();
+		}
+	}
+}
+
+bool execute_operation(const Operation& op, BlockData* data) {
+	ValueData value;
+	memcpy(value.bytes, op.data, 4);
+	switch (op.type) {
+	case OP_READ: return read_block(op.block, data);
+	case OP_WRITE: memcpy(data->bytes, op.data, 16); return write_block(op.block, *data);
+	case OP_INCREMENT: return value_command(MI_INCREMENT, op.block, value);
+	case OP_DECREMENT: return value_command(MI_DECREMENT, op.block, value);
+	case OP_RESTORE: return value_command(MI_RESTORE, op.block, value);
+	case OP_TRANSFER: return value_command(MI_TRANSFER, op.block, value);
+	}
+	return false;
+}
+
+int plan_mode(int argc, char* argv[]) {
+	bool dry_run = false;
+	const char* filename = NULL;
+	for (int i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "-n") == 0)
+			dry_run = true;
+		else if (!filename && argv[i][0] != '-')
+			filename = argv[i];
+		else {
+			print_usage();
+			return 1;
+		}
+	}
+	vector<Operation> ops;
+	vector<SectorKnowledge> sectors;
+	if (!filename) {
+		print_usage();
+		return 1;
+	}
+	if (!load_batch(filename, &ops, &sectors))
+		return 1;
+
+	if (!dry_run) {
+		if (!connect_reader()) {
+			cerr << "Could not connect to the device." << endl;
+			return 1;
+		}
+		if (!select_tag() || !is_classic_tag()) {
+			cerr << "No MIFARE Classic tag found." << endl;
+			mi_disconnect(session);
+			return 1;
+		}
+		fetch_trailers(ops, &sectors);
+	}
+
+	Plan plan;
+	plan_operations(ops, sectors, &plan);
+	if (dry_run) {
+		print_plan(cout, plan);
+		return plan.rejected.empty() ? 0 : 1;
+	}
+
+	UINT failed = 0;
+	for (size_t i = 0; i < plan.steps.size(); i++) {
+		const PlanStep& step = plan.steps[i];
+		size_t done = 0;
+		MifareKey key;
+		memcpy(key.bytes, step.key, 6);
+		if (!auth_sector(key, step.keyB, step.sector))
+			done = step.ops.size();
+		for (; done < step.ops.size(); done++) {
+			const Operation& op = step.ops[done];
+			BlockData data;
+			if (!execute_operation(op, &data))
+				break;
+			cout << op.line << " OK " << operation_name(op.type) << " block=" << (UINT) op.block;
+			if (op.type == OP_READ)
+				cout << " data=" << bytearray_to_string(data.bytes, 16, false);
+			cout << endl;
+		}
+		if (done < step.ops.size()) {
+			// The tag halted, the rest of the step is lost with the authentication.
+			for (size_t j = done; j < step.ops.size(); j++, failed++)
+				cout << step.ops[j].line << " ERR " << ((j == done) ? "failed" : "skipped") << " " << operation_name(step.ops[j].type)
+					<< " block=" << (UINT) step.ops[j].block << endl;
+			reselect_tag();
+		}
+	}
+	for (size_t i = 0; i < plan.rejected.size(); i++)
+		cout << plan.rejected[i].op.line << " REJECTED " << operation_name(plan.rejected[i].op.type) << " block="
+			<< (UINT) plan.rejected[i].op.block << ": " << plan.rejected[i].reason << endl;
+	mi_disconnect(session);
+	return (failed || !plan.rejected.empty()) ? 1 : 0;
+}
+
+// -- Passive capture (-sniff) --
+// The PN53x FIFO holds 64 bytes, frames are lost unless the next receive is issued right away.
+// The capture loop therefore only receives into the ring and timestamps; the writer thread
+// drains the ring into the trace file. A full ring drops frames and counts them, the capture
+// loop never waits for the disk.
+
+int sniff_mode(int argc, char* argv[]) {
+	if (argc < 1) {
+		print_usage();
+		return 1;
+	}
+	const char* filename = argv[0];
+	uint64_t max_frames = 0;
+	size_t ring_size = 65536;
+	for (int i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc) && (atoi(argv[i + 1]) > 0))
+			max_frames = strtoull(argv[++i], NULL, 10);
+		else if ((strcmp(argv[i], "-ring") == 0) && (i + 1 < argc) && (atoi(argv[i + 1]) > 0))
+			ring_size = atoi(argv[++i]);
+		else {
+			print_usage();
+			return 1;
+		}
+	}
+
+	TraceWriter writer;
+	if (!trace_create(&writer, filename)) {
+		cerr << "Could not create " << filename << endl;
+		return 1;
+	}
+	if (!connect_reader()) {
+		cerr << "Could not connect to the device." << endl;
+		trace_finish(&writer);
+		return 1;
+	}
+
+	CaptureRing ring;
+	ring_init(&ring, ring_size);
+	atomic<bool> capture_done(false);
+	bool write_failed = false;
+	thread writer_thread([&]() {
+		rt_leave_thread();
+		TraceFrame f;
+		for (;;) {
+			if (ring_pop(&ring, &f)) {
+				write_failed = !trace_write(&writer, f) || write_failed;
+				continue;
+			}
+			// Everything published before the flag was set is visible once it is seen.
+			if (capture_done.load(memory_order_acquire)) {
+				while (ring_pop(&ring, &f))
+					write_failed = !trace_write(&writer, f) || write_failed;
+				break;
+			}
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+	});
+
+	signal(SIGINT, request_stop);
+	signal(SIGTERM, request_stop);
+	cerr << "Listening on " << mi_device_name(session) << ", writing " << filename << ". Ctrl-C stops after the next frame." << endl;
+
+	uint64_t frames = 0, invalid = 0, dropped = 0, fields = 0;
+	uint8_t parity[MI_MAX_FRAME];
+	TraceFrame spare;
+	bool listening = false;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	while (!stop_requested && (!max_frames || (frames < max_frames))) {
+		// A full ring still has to empty the FIFO, the frame goes to the spare slot and is dropped.
+		TraceFrame* f = ring_reserve(&ring);
+		TraceFrame* slot = f ? f : &spare;
+		size_t bits = 0;
+		mi_status status;
+		if (listening)
+			status = mi_receive_frame(session, slot->data, &bits, parity);
+		else {
+			status = mi_listen(session, slot->data, &bits, parity);
+			fields++;
+		}
+		if (status != MI_OK) {
+			// The reader in the field went away, or never came: wait for the next one.
+			if (!listening)
+				break;
+			listening = false;
+			continue;
+		}
+		listening = true;
+		slot->timestamp = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+		slot->bits = (uint16_t) min(bits, (size_t) MAX_TRACE_FRAME * 8);
+		slot->direction = TRACE_READER_TO_TAG;
+		// Short frames (REQA, WUPA) have 7 bits, any other partial byte is a broken frame.
+		slot->flags = ((bits % 8) && (bits != 7)) ? TRACE_FLAG_INVALID : 0;
+		frames++;
+		if (slot->flags)
+			invalid++;
+		if (f)
+			ring_publish(&ring);
+		else
+			dropped++;
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	capture_done.store(true, memory_order_release);
+	writer_thread.join();
+	mi_disconnect(session);
+	bool closed = trace_finish(&writer);
+
+	cerr << "Frames: " << frames << " (" << invalid << " invalid), " << writer.frames << " written, "
+		<< dropped << " dropped with the ring full" << endl;
+	cerr << "Reader activations: " << fields << ", ring high water: " << ring.high_water << " of " << ring.slots.size()
+		<< " frames, " << fixed << setprecision(1) << (seconds > 0 ? frames / seconds : 0) << " frames/s" << endl;
+	if (write_failed || !closed) {
+		cerr << "Could not write " << filename << endl;
+		return 1;
+	}
+	return dropped ? 2 : 0;
+}
+
+// -- Offline trace decoder (-decode) --
+
+int decode_mode(int argc, char* argv[]) {
+	TraceDecodeOptions options;
+	options.threads = 0;
+	const char* filename = NULL;
+	for (int i = 0; i < argc; i++) {
+		MifareKey key;
+		if ((strcmp(argv[i], "-k") == 0) && (i + 1 < argc) && parse_key(argv[i+1], &key)) {
+			options.keys.push_back(key_from_bytes(key.bytes));
+			i++;
+		} else if ((strcmp(argv[i], "-j") == 0) && (i + 1 < argc) && parse_threads(argv[i + 1], &options.threads)) {
+			i++;
+		} else if (!filename && argv[i][0] != '-')
+			filename = argv[i];
+		else {
+			print_usage();
+			return 1;
+		}
+	}
+	if (!filename) {
+		print_usage();
+		return 1;
+	}
+
+	TraceDecodeStats stats;
+	if (!decode_trace(filename, options, cout, &stats)) {
+		cerr << "Could not open " << filename << " or it is not a MiCmd trace file." << endl;
+		return 1;
+	}
+	cerr << stats.frames << " frames (" << stats.bytes << " bytes), " << stats.sessions << " sessions, "
+		<< stats.authentications << " authentications decrypted, " << stats.failed_authentications << " without a known key" << endl;
+	if (stats.truncated)
+		cerr << "The trace ends with a malformed or truncated record." << endl;
+	return stats.truncated ? 1 : 0;
+}
+
+// -- Offline corpus analysis (-corpus) --
+
+int corpus_mode(int argc, char* argv[]) {
+	CorpusOptions options;
+	options.threads = 0;
+	options.top = 10;
+	options.max_anomalies = 100;
+	const char* path = NULL;
+	for (int i = 0; i < argc; i++) {
+		if ((strcmp(argv[i], "-j") == 0) && (i + 1 < argc) && parse_threads(argv[i + 1], &options.threads))
+			i++;
+		else if ((strcmp(argv[i], "-top") == 0) && (i + 1 < argc))
+			options.top = atoi(argv[++i]);
+		else if (!path && argv[i][0] != '-')
+			path = argv[i];
+		else {
+			print_usage();
+			return 1;
+		}
+	}
+	if (!path) {
+		print_usage();
+		return 1;
+	}
+	if (!analyse_corpus(path, options, cout)) {
+		cerr << "Could not read " << path << endl;
+		return 1;
+	}
+	return 0;
+}
+
+// -- Offline value block audit (-audit) --
+
+int audit_mode(int argc, char* argv[]) {
+	AuditOptions options;
+	options.threads = 0;
+	options.all = false;
+	const char* path = NULL;
+	for (int i = 0; i < argc; i++) {
+		if ((strcmp(argv[i], "-j") == 0) && (i + 1 < argc) && parse_threads(argv[i + 1], &options.threads))
+			i++;
+		else if (strcmp(argv[i], "-all") == 0)
+			options.all = true;
+		else if (!path && argv[i][0] != '-')
+			path = argv[i];
+		else {
+			print_usage();
+			return 1;
+		}
+	}
+	if (!path) {
+		print_usage();
+		return 1;
+	}
+	uint64_t problems;
+	if (!audit_corpus(path, options, cout, &problems)) {
+		cerr << "Could not read " << path << endl;
+		return 1;
+	}
+	return problems ? 2 : 0;
+}
+
+// -- Pattern search over dumps (-grep) --
+
+int grep_mode(int argc, char* argv[]) {
+	SearchOptions options;
+	options.threads = 0;
+	const char* path = NULL;
+	const char* pattern = NULL;
+	bool text = false;
+	for (int i = 0; i < argc; i++) {
+		if ((strcmp(argv[i], "-j") == 0) && (i + 1 < argc) && parse_threads(argv[i + 1], &options.threads))
+			i++;
+		else if (strcmp(argv[i], "-t") == 0)
+			text = true;
+		else if (!path && argv[i][0] != '-')
+			path = argv[i];
+		else if (!pattern && path)
+			pattern = argv[i];
+		else {
+			print_usage();
+			return 1;
+		}
+	}
+	if (!path || !pattern || !*pattern) {
+		print_usage();
+		return 1;
+	}
+	if (text)
+		options.pattern.assign(pattern, pattern + strlen(pattern));
+	else {
+		options.pattern.resize(strlen(pattern) / 2);
+		if (!parse_hex(pattern, strlen(pattern), options.pattern.data(), (int) options.pattern.size())) {
+			cerr << "The pattern is not hex, use -t for text." << endl;
+			return 1;
+		}
+	}
+
+	SearchStats stats;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	if (!search_corpus(path, options, cout, &stats)) {
+		cerr << "Could not read " << path << endl;
+		return 1;
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cerr << stats.hits << " hits in " << stats.matching_images << " of " << stats.images << " images, "
+		<< stats.scanned_bytes / 1024 << " KB scanned in " << fixed << setprecision(2) << seconds << " s" << endl;
+	return stats.hits ? 0 : 1;
+}
+
+// -- Deduplicated dump archive (-archive, -extract) --
+
+int archive_mode(int argc, char* argv[]) {
+	if (argc < 2) {
+		print_usage();
+		return 1;
+	}
+	SectorStore store;
+	if (!store_open(argv[0], &store)) {
+		cerr << "Could not open archive " << argv[0] << endl;
+		return 1;
+	}
+	uint64_t skipped = 0, bytes = 0;
+	bool ok = true;
+	for (int a = 1; ok && (a < argc); a++) {
+		// Cards are named by their path below the given directory, or by the file name.
+		string root(argv[a]);
+		vector<string> files;
+		if (!list_files(root, &files)) {
+			cerr << "Could not read " << root << endl;
+			ok = false;
+			break;
+		}
+		sort(files.begin(), files.end());
+		for (size_t i = 0; i < files.size(); i++) {
+			CardImage image;
+			if (!load_card_image(files[i].c_str(), &image)) {
+				skipped++;
+				continue;
+			}
+			string name = (files[i] == root) ? files[i].substr(files[i].find_last_of("/\\") + 1) : files[i].substr(root.size() + 1);
+			if (!store_add(&store, name, image)) {
+				cerr << "Could not add " << files[i] << endl;
+				ok = false;
+				break;
+			}
+			bytes += image.size;
+		}
+	}
+	ok = store_close(&store) && ok;
+	cout << "Cards: " << store.added_cards << " added, " << store.unchanged_cards << " unchanged, "
+		<< skipped << " files skipped, " << store.cards.size() << " in the archive" << endl;
+	cout << "Sectors: " << store.new_sectors << " new, " << store.shared_sectors << " already stored" << endl;
+	cout << "Read " << bytes << " bytes of dumps, the archive holds " << store.sectors.size() << " bytes of sectors" << endl;
+	return ok ? 0 : 1;
+}
+
+bool make_parent_dirs(const string& path) {
+	for (string::size_type p = path.find_first_of("/\\", 1); p != string::npos; p = path.find_first_of("/\\", p + 1)) {
+#ifdef WIN32
+		CreateDirectoryA(path.substr(0, p).c_str(), NULL);
+#else
+		if ((mkdir(path.substr(0, p).c_str(), 0777) != 0) && (errno != EEXIST))
+			return false;
+#endif
+	}
+	return true;
+}
+
+int extract_mode(const char* archive, const char* dir) {
+	SectorStore store;
+	if (!store_load(archive, &store)) {
+		cerr << "Could not read archive " << archive << endl;
+		return 1;
+	}
+	UINT written = 0, failed = 0;
+	for (size_t i = 0; i < store.cards.size(); i++) {
+		const string& name = store.cards[i].name;
+		// Names come from the archive, do not let them escape the output directory.
+		if (name.empty() || (name[0] == '/') || (name[0] == '\\') || (name.find("..") != string::npos)) {
+			cerr << "Skipping card with unsafe name " << name << endl;
+			failed++;
+			continue;
+		}
+		CardImage image;
+		store_get_image(store, i, &image);
+		string filename = string(dir) + "/" + name;
+		FILE* f = make_parent_dirs(filename) ? fopen(filename.c_str(), "wb") : NULL;
+		bool ok = f && (fwrite(image.data, 1, image.size, f) == image.size);
+		if (f)
+			ok = (fclose(f) == 0) && ok;
+		if (ok)
+			written++;
+		else {
+			cerr << "Could not write " << filename << endl;
+			failed++;
+		}
+	}
+	cout << "Extracted " << written << " card images to " << dir << endl;
+	return failed ? 1 : 0;
+}
+
+void print_usage() {
+	cout << "Usage: MiCmd [-reader <driver[:port[:speed]]>] [-log <file[:json|binary[:never|batch|ms]]>]\n";
+	cout << "             [-kdf <scheme:master secret>] [-rt <cpu|any>[:priority]]\n";
+	cout << "             [-record <transcript> | -replay <transcript[:speed]>] [mode]\n";
+	cout << "       MiCmd                      interactive mode\n";
+	cout << "       MiCmd -acs <policy file>   access control decision mode\n";
+	cout << "       MiCmd -inventory [-t seconds] [-n tags]\n";
+	cout << "                                  print each UID in the field once, with tags/s identified\n";
+	cout << "       MiCmd -mad [aid|ndef] [-k key]...\n";
+	cout << "                                  read the application directory, then only that application\n";
+	cout << "       MiCmd -derive <UID list|-> [-s sectors] [-j threads]\n";
+	cout << "                                  print the diversified keys of every UID in a list\n";
+	cout << "       MiCmd -daemon <socket>     keep the reader open and serve clients on a Unix socket\n";
+	cout << "       MiCmd -stack <script>      run a script of daemon requests on every tag in the field\n";
+	cout << "       MiCmd -sniff <trace> [-n frames] [-ring frames]\n";
+	cout << "                                  capture what a reader in the field sends into a trace file\n";
+	cout << "       MiCmd -decode <trace> [-k key]... [-j threads]\n";
+	cout << "                                  decode a captured trace, decrypting with the given keys\n";
+	cout << "       MiCmd -corpus <dir> [-j threads] [-top n]\n";
+	cout << "                                  key reuse, access condition and value statistics over dumps\n";
+	cout << "       MiCmd -audit <dir> [-j threads] [-all]\n";
+	cout << "                                  check value blocks in dumps for torn or corrupt copies\n";
+	cout << "       MiCmd -grep <dir|archive> <hex pattern | -t text> [-j threads]\n";
+	cout << "                                  list the UID, sector and block of every occurrence\n";
+	cout << "       MiCmd -archive <archive> <dir|dump>...\n";
+	cout << "                                  add dumps to a deduplicated archive (-corpus and -audit read it)\n";
+	cout << "       MiCmd -extract <archive> <dir>\n";
+	cout << "                                  write the cards of an archive back as dump files\n";
+	cout << "       MiCmd -plan <batch> [-n]  check a batch against the access conditions and run it\n";
+	cout << "                                  (-n only prints the plan)\n";
+	cout << "       MiCmd -debit <sector> <A|B> <key> <block> <backup block> <amount> [-budget ms] [-n count]\n";
+	cout << "                                  debit every card presented, keeping a backup value block\n";
+	cout << "       MiCmd -calibrate [-n rounds]\n";
+	cout << "                                  time reader round trips at each UART speed\n";
+	cout << "       MiCmd -jitter [-n rounds] [-period us]\n";
+	cout << "                                  compare wake-up and round trip latency without and with -rt\n";
+	cout << "       MiCmd -stress [-image dump] [-n ops] [-removal p] [-error p] [-tear p] [-away ms]\n";
+	cout << "                     [-retries n] [-backoff ms] [-seed n]\n";
+	cout << "                                  run a workload against a simulated reader injecting faults\n";
+	cout << "       MiCmd -client <socket> [request]\n";
+	cout << "                                  send a request (or each line of stdin) to the daemon\n";
+	cout << "The reader may also be chosen with the MICMD_READER environment variable, the audit log\n";
+	cout << "of every tag command with MICMD_AUDIT_LOG, the key diversification with MICMD_KDF and the\n";
+	cout << "real-time profile with MICMD_RT. -rt pins the thread driving the reader to a core, runs it\n";
+	cout << "with SCHED_FIFO (priority 50 by default) and locks and pre-faults memory.\n";
+	cout << "-record writes every reader call with its result and timing to a transcript, -replay\n";
+	cout << "answers the calls from one instead of a reader, speed times faster (0: without waiting).\n";
+	cout << "A transcript stores keys only as a salted hash, 48 bit keys can still be searched from it:\n";
+	cout << "keep transcripts of real cards as safe as their keys.\n";
+	cout << "Key diversification schemes:\n";
+	for (const KdfScheme* s = kdf_schemes(); s->name; s++)
+		cout << "  " << s->name << " (" << s->secret_length << " byte secret): " << s->description << "\n";
+}
+
+// -- Interactive / script commands --
+// A command and all its arguments are on one line. The line is split into tokens in place,
+// the command is looked up by binary search in the sorted table below and its arguments are
+// validated by type before the handler runs. Nothing ever prompts, so scripts can be piped in.
+
+typedef enum {
+	ARG_NONE,
+	ARG_SECTOR,	// 0-39
+	ARG_BLOCK,	// 0-255
+	ARG_LAST_BLOCK,	// 0-255, optional, the end of a range starting at the ARG_BLOCK
+	ARG_INDEX,	// tag stack index
+	ARG_KEY,	// 6B hex
+	ARG_DATA,	// 16B hex
+	ARG_VALUE	// 4B hex
+} ArgType;
+
+const int MAX_ARGS = 2;
+
+// Every command has at most one number and one hex argument, or a block range.
+typedef struct {
+	UINT number;
+	UINT last;	// the ARG_BLOCK itself when no ARG_LAST_BLOCK is given
+	MifareKey key;
+	BlockData data;
+	ValueData value;
+} CommandArgs;
+
+typedef struct {
+	const char* name;
+	ArgType args[MAX_ARGS];
+	bool needs_connection;
+	bool (*handler)(const CommandArgs& args);	// false if the command failed
+	const char* usage;
+} Command;
+
+typedef struct {
+	const char* start;
+	size_t length;
+} Token;
+
+static bool running = true;
+
+void print_menu();
+
+bool cmd_help(const CommandArgs&) {
+	print_menu();
+	return true;
+}
+
+bool cmd_open(const CommandArgs&) {
+	if (connected) {
+		cout << "You are already connected, disconnect with c first!" << endl;
+		return false;
+	}
+	connected = open_connection();
+	return connected;
+}
+
+bool cmd_clear(const CommandArgs&) {
+	cls();
+	return true;
+}
+
+bool cmd_quit(const CommandArgs&) {
+	if (connected)
+		close_connection();
+	running = false;
+	return true;
+}
+
+bool cmd_analyse_trailer(const CommandArgs& args) {
+	cout << "-- !!!! ATTENTION !!!!\nManual parsing only computes AC bits from 4-byte value by applying bitwise operations" << endl;
+	cout << "-- and checks them against the inverse AC bits in those 4 bytes." << endl;
+	cout << "-- DO NOT rely on this when calculating correct 4-byte value to write into the trailer block!" << endl;
+	cout << "-- !!!! ATTENTION !!!!" << endl << endl;
+
+	parse_trailer(args.data.bytes);
+	return true;
+}
+
+bool cmd_close(const CommandArgs&) {
+	close_connection();
+	return true;
+}
+
+bool cmd_list(const CommandArgs&) {
+	cout << "Found " << enumerate_tags() << " tag(s) in the field:" << endl;
+	print_tag_stack();
+	// Enumeration leaves no tag selected, go back to the first one.
+	if (!tag_stack.empty() && !select_stacked_tag(tag_stack[0])) {
+		cout << "Could not select the tag again, reconnecting..." << endl;
+		close_connection();
+		connected = open_connection();
+		return false;
+	}
+	return true;
+}
+
+bool cmd_next(const CommandArgs& args) {
+	if (args.number >= tag_stack.size()) {
+		cout << "No such tag, list the tags with l first." << endl;
+		return false;
+	}
+	if (!select_stacked_tag(tag_stack[args.number]) || !is_classic_tag()) {
+		cout << "Could not select that tag, is it still in the field?" << endl;
+		return false;
+	}
+	cout << "Switched to MIFARE Classic " << (b4k ? 4 : 1) << "K tag, UID: " << bytearray_to_string(ti.uid, ti.uid_length) << endl;
+	return true;
+}
+
+bool authenticate_command(const CommandArgs& args, bool keyB) {
+	if (args.number >= (b4k ? 40u : 16u)) {
+		cout << "This tag has no sector " << args.number << "." << endl;
+		return false;
+	}
+	return authenticate(args.key, keyB, args.number);
+}
+
+bool cmd_auth_a(const CommandArgs& args) {
+	return authenticate_command(args, false);
+}
+
+bool cmd_auth_b(const CommandArgs& args) {
+	return authenticate_command(args, true);
+}
+
+bool derived_authenticate_command(const CommandArgs& args, bool keyB) {
+	if (!kdf_chosen) {
+		cout << "No key diversification, start MiCmd with -kdf or set MICMD_KDF." << endl;
+		return false;
+	}
+	CommandArgs derived = args;
+	if (args.number < KDF_MAX_SECTORS)
+		memcpy(derived.key.bytes, derived_keys[args.number][keyB ? 1 : 0], 6);
+	return authenticate_command(derived, keyB);
+}
+
+bool cmd_auth_a_derived(const CommandArgs& args) {
+	return derived_authenticate_command(args, false);
+}
+
+bool cmd_auth_b_derived(const CommandArgs& args) {
+	return derived_authenticate_command(args, true);
+}
+
+bool cmd_read(const CommandArgs& args) {
+	return readblock(args.number);
+}
+
+bool cmd_write(const CommandArgs& args) {
+	if (is_trailer_block(args.number)) {
+		cout << "Block " << args.number << " is a trailer block, use wt to overwrite keys and access conditions." << endl;
+		return false;
+	}
+	return writeblock(args.number, args.data);
+}
+
+bool cmd_write_trailer(const CommandArgs& args) {
+	if (!is_trailer_block(args.number)) {
+		cout << "Block " << args.number << " is not a trailer block, use w." << endl;
+		return false;
+	}
+	cout << "----- !!!!! WARNING !!!!! -----" << endl;
+	cout << "-- Writing data into the trailer block of sector " << get_sector(args.number) << "." << endl;
+	cout << "-- Writing incorrect data may damage your MIFARE card." << endl;
+	return writeblock(args.number, args.data);
+}
+
+bool cmd_restore(const CommandArgs& args) {
+	return valueblock(MI_RESTORE, args.number, args.value);
+}
+
+bool cmd_increment(const CommandArgs& args) {
+	return valueblock(MI_INCREMENT, args.number, args.value);
+}
+
+bool cmd_decrement(const CommandArgs& args) {
+	return valueblock(MI_DECREMENT, args.number, args.value);
+}
+
+bool cmd_transfer(const CommandArgs& args) {
+	return valueblock(MI_TRANSFER, args.number, args.value);
+}
+
+bool cmd_audit_values(const CommandArgs& args) {
+	uint8_t data[16 * MIFARE_BLOCK_SIZE];
+	vector<ValueBlockFinding> findings;
+	if (!read_sector(args.number, data)) {
+		cout << "Reading sector " << args.number << " FAILED, authenticate it first. Tag halted, reconnecting..." << endl;
+		close_connection();
+		connected = open_connection();
+		return false;
+	}
+	if (!audit_value_blocks(data, args.number, &findings)) {
+		cout << "Sector " << args.number << " has invalid access bits, the sector is blocked." << endl;
+		return false;
+	}
+	if (findings.empty())
+		cout << "Sector " << args.number << " has no value blocks." << endl;
+	string uid = bytearray_to_string(ti.uid, ti.uid_length, false);
+	for (size_t i = 0; i < findings.size(); i++)
+		cout << format_value_finding(uid, args.number, findings[i]) << endl;
+	return true;
+}
+
+// Re-reads the blocks first..last of the authenticated sector until Ctrl-C or the tag leaves,
+// printing a block only when it differs from the previous read.
+bool cmd_watch(const CommandArgs& args) {
+	uint32_t first = args.number;
+	uint32_t sector = get_sector(first);
+	if ((args.last < first) || (get_sector(args.last) != sector)) {
+		cout << "Blocks " << first << "-" << args.last << " are not a range within one sector." << endl;
+		return false;
+	}
+	if (mi_authenticated_sector(session) != (int) sector) {
+		cout << "Authenticate sector " << sector << " first, with a or b." << endl;
+		return false;
+	}
+	uint32_t count = args.last - first + 1;
+	uint8_t last[16 * MIFARE_BLOCK_SIZE];
+	uint8_t current[MIFARE_BLOCK_SIZE];
+	uint64_t polls = 0, changes = 0;
+	mi_status status = MI_OK;
+
+	cout << "Watching blocks " << first << "-" << first + count - 1 << ", Ctrl-C stops." << endl;
+	stop_requested = 0;
+	signal(SIGINT, request_stop);
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	while (!stop_requested && (status == MI_OK)) {
+		for (uint32_t i = 0; i < count; i++) {
+			uint8_t* previous = last + i * MIFARE_BLOCK_SIZE;
+			if ((status = mi_read_block(session, (uint8_t) (first + i), current)) != MI_OK)
+				break;
+			if (polls && (memcmp(current, previous, MIFARE_BLOCK_SIZE) == 0))
+				continue;
+			memcpy(previous, current, MIFARE_BLOCK_SIZE);
+			if (polls)
+				changes++;
+			double s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			cout << "+" << fixed << setprecision(3) << s << " s  block " << setw(3) << first + i << ": "
+				<< bytearray_to_string(current, MIFARE_BLOCK_SIZE) << endl;
+		}
+		if (status == MI_OK)
+			polls++;
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	signal(SIGINT, SIG_DFL);
+
+	cout << polls << " polls, " << changes << " changes in " << fixed << setprecision(2) << seconds << " s";
+	if (seconds > 0)
+		cout << ", " << setprecision(1) << polls / seconds << " polls/s (" << polls * count / seconds << " blocks/s)";
+	cout << endl;
+	cout.unsetf(ios::floatfield);
+	cout.precision(6);
+	if (status == MI_ERR_DENIED)
+		print_denial();
+	else if (status != MI_OK) {
+		cout << "Could not read the data block! Tag halted, reconnecting..." << endl;
+		close_connection();
+		connected = open_connection();
+	}
+	// Ctrl-C ends a watch normally, the tag leaving the field does not.
+	return (status == MI_OK);
+}
+
+// Sorted by name (strcmp order), find_command() relies on it.
+static const Command commands[] = {
+	{"a",     {ARG_SECTOR, ARG_KEY},   true,  cmd_auth_a,          "a <sector> <key> - Authenticate with A key (6B hex)"},
+	{"ad",    {ARG_SECTOR, ARG_NONE},  true,  cmd_auth_a_derived,  "ad <sector> - Authenticate with the diversified A key"},
+	{"at",    {ARG_DATA, ARG_NONE},    false, cmd_analyse_trailer, "at <data> - analyse manually input trailer data (16B hex)"},
+	{"b",     {ARG_SECTOR, ARG_KEY},   true,  cmd_auth_b,          "b <sector> <key> - Authenticate with B key (6B hex)"},
+	{"bd",    {ARG_SECTOR, ARG_NONE},  true,  cmd_auth_b_derived,  "bd <sector> - Authenticate with the diversified B key"},
+	{"c",     {ARG_NONE, ARG_NONE},    true,  cmd_close,           "c - Close existing connection"},
+	{"clear", {ARG_NONE, ARG_NONE},    false, cmd_clear,           "clear - Clear screen"},
+	{"cls",   {ARG_NONE, ARG_NONE},    false, cmd_clear,           "cls - Clear screen"},
+	{"d",     {ARG_BLOCK, ARG_VALUE},  true,  cmd_decrement,       "d <block> <value> - Decrement value block (4B hex)"},
+	{"h",     {ARG_NONE, ARG_NONE},    false, cmd_help,            "h - display main menu"},
+	{"i",     {ARG_BLOCK, ARG_VALUE},  true,  cmd_increment,       "i <block> <value> - Increment value block (4B hex)"},
+	{"l",     {ARG_NONE, ARG_NONE},    true,  cmd_list,            "l - List all tags in the field"},
+	{"n",     {ARG_INDEX, ARG_NONE},   true,  cmd_next,            "n <tag> - Switch to another tag of the stack"},
+	{"o",     {ARG_NONE, ARG_NONE},    false, cmd_open,            "o - Open connection"},
+	{"q",     {ARG_NONE, ARG_NONE},    false, cmd_quit,            "q - Exit"},
+	{"r",     {ARG_BLOCK, ARG_NONE},   true,  cmd_read,            "r <block> - Read specific block data"},
+	{"s",     {ARG_BLOCK, ARG_VALUE},  true,  cmd_restore,         "s <block> <value> - ReStore value block (4B hex)"},
+	{"t",     {ARG_BLOCK, ARG_NONE},   true,  cmd_transfer,        "t <block> - Transfer value block to volatile memory"},
+	{"v",     {ARG_SECTOR, ARG_NONE},  true,  cmd_audit_values,    "v <sector> - Verify value blocks of an authenticated sector"},
+	{"w",     {ARG_BLOCK, ARG_DATA},   true,  cmd_write,           "w <block> <data> - Write specific block data (16B hex)"},
+	{"watch", {ARG_BLOCK, ARG_LAST_BLOCK}, true, cmd_watch,       "watch <block> [<last block>] - Poll blocks of an authenticated sector, print changes"},
+	{"wt",    {ARG_BLOCK, ARG_DATA},   true,  cmd_write_trailer,   "wt <block> <data> - Write a trailer block (keys and AC!)"}
+};
+
+const size_t COMMAND_COUNT = sizeof(commands) / sizeof(commands[0]);
+
+void print_menu() {
+
+	cout << "\nMain menu:\n";
+	for (size_t i = 0; i < COMMAND_COUNT; i++)
+		if (!commands[i].needs_connection)
+			cout << commands[i].usage << "\n";
+	cout << "\n-- After connection is successfully opened, you may use following\n-- additional commands:\n";
+	for (size_t i = 0; i < COMMAND_COUNT; i++)
+		if (commands[i].needs_connection)
+			cout << commands[i].usage << "\n";
+	cout << "\n";
+
+
+}
+
+int compare_token(const Token& token, const char* name) {
+	int res = strncmp(token.start, name, token.length);
+	if (res != 0)
+		return res;
+	return (name[token.length] == '\0') ? 0 : -1;
+}
+
+const Command* find_command(const Token& token) {
+	size_t low = 0, high = COMMAND_COUNT;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		int res = compare_token(token, commands[mid].name);
+		if (res == 0)
+			return &commands[mid];
+		if (res < 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	return NULL;
+}
+
+// Splits the line on whitespace without copying. Returns the token count, max_tokens + 1
+// if there are more.
+int tokenize(const string& line, Token* tokens, int max_tokens) {
+	int count = 0;
+	const char* p = line.c_str();
+	while (true) {
+		while (*p && isspace((unsigned char) *p))
+			p++;
+		if (!*p)
+			return count;
+		if (count == max_tokens)
+			return max_tokens + 1;
+		tokens[count].start = p;
+		while (*p && !isspace((unsigned char) *p))
+			p++;
+		tokens[count].length = p - tokens[count].start;
+		count++;
+	}
+}
+
+bool parse_number(const Token& token, UINT max, UINT* number) {
+	UINT value = 0;
+	if ((token.length == 0) || (token.length > 3))
+		return false;
+	for (size_t i = 0; i < token.length; i++) {
+		if (!isdigit((unsigned char) token.start[i]))
+			return false;
+		value = value * 10 + (token.start[i] - '0');
+	}
+	if (value > max)
+		return false;
+	*number = value;
+	return true;
+}
+
+bool parse_argument(ArgType type, const Token& token, CommandArgs* args) {
+	switch (type) {
+	case ARG_SECTOR: return parse_number(token, 39, &args->number);
+	case ARG_BLOCK:  return parse_number(token, 255, &args->number);
+	case ARG_LAST_BLOCK: return parse_number(token, 255, &args->last);
+	case ARG_INDEX:  return parse_number(token, MAX_STACK_TAGS - 1, &args->number);
+	case ARG_KEY:    return parse_hex(token.start, token.length, args->key.bytes, 6);
+	case ARG_DATA:   return parse_hex(token.start, token.length, args->data.bytes, 16);
+	case ARG_VALUE:  return parse_hex(token.start, token.length, args->value.bytes, 4);
+	default:         return false;
+	}
+}
+
+// Parses and runs one command line, false if it was not understood or failed.
+bool execute_command(const string& line) {
+	Token tokens[MAX_ARGS + 1];
+	int count = tokenize(line, tokens, MAX_ARGS + 1);
+	if (count == 0)
+		return true;
+	const Command* command = (count <= MAX_ARGS + 1) ? find_command(tokens[0]) : NULL;
+	if (!command) {
+		cout << "Command " << line << " not understood. Type h for help." << endl;
+		return false;
+	}
+	if (command->needs_connection && !connected) {
+		cout << "Command " << command->name << " needs a connection, open it with o first." << endl;
+		return false;
+	}
+
+	CommandArgs args;
+	memset(&args, 0, sizeof(args));
+	int expected = 0, required = 0;
+	while ((expected < MAX_ARGS) && (command->args[expected] != ARG_NONE))
+		if (command->args[expected++] != ARG_LAST_BLOCK)
+			required++;
+	bool ok = (count - 1 >= required) && (count - 1 <= expected);
+	for (int i = 0; ok && (i < count - 1); i++)
+		ok = parse_argument(command->args[i], tokens[i+1], &args);
+	if (ok && (count - 1 == required) && (required < expected))
+		args.last = args.number;
+	if (!ok) {
+		cout << "Usage: " << command->usage << endl;
+		return false;
+	}
+	return command->handler(args);
+}
+
+bool stdin_is_terminal() {
+#ifdef WIN32
+	return _isatty(_fileno(stdin)) != 0;
+#else
+	return isatty(fileno(stdin)) != 0;
+#endif
+}
+
+int main(int argc, char* argv[])
+{
+	//set_console_size();
+
+	session = mi_session_new();
+	const char* reader = getenv("MICMD_READER");
+	if (reader && !parse_reader(reader)) {
+		cerr << "Invalid MICMD_READER: " << reader << endl;
+		return 1;
+	}
+	const char* log = getenv("MICMD_AUDIT_LOG");
+	if (log && !open_audit_log(log)) {
+		cerr << "Invalid MICMD_AUDIT_LOG: " << log << endl;
+		return 1;
+	}
+	// The master secret is better kept out of the process list, in the environment.
+	const char* kdf_spec = getenv("MICMD_KDF");
+	if (kdf_spec && !parse_kdf(kdf_spec))
+		return 1;
+	const char* rt_spec = getenv("MICMD_RT");
+	if (rt_spec && !parse_rt(rt_spec))
+		return 1;
+	while ((argc > 2) && ((strcmp(argv[1], "-reader") == 0) || (strcmp(argv[1], "-log") == 0) || (strcmp(argv[1], "-kdf") == 0)
+		|| (strcmp(argv[1], "-rt") == 0) || (strcmp(argv[1], "-record") == 0) || (strcmp(argv[1], "-replay") == 0))) {
+		bool ok;
+		if (strcmp(argv[1], "-reader") == 0)
+			ok = parse_reader(argv[2]);
+		else if (strcmp(argv[1], "-log") == 0)
+			ok = open_audit_log(argv[2]);
+		else if (strcmp(argv[1], "-kdf") == 0)
+			ok = parse_kdf(argv[2]);
+		else if (strcmp(argv[1], "-rt") == 0)
+			ok = parse_rt(argv[2]);
+		else if (strcmp(argv[1], "-record") == 0)
+			ok = open_recording(argv[2]);
+		else
+			ok = open_replay(argv[2]);
+		if (!ok) {
+			print_usage();
+			return 1;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+	// Whichever way main returns, queued audit events and the transcript are written out.
+	atexit(close_audit_log);
+	atexit(close_recording);
+	atexit(print_replay_summary);
+
+	if (argc > 1) {
+		if ((strcmp(argv[1], "-acs") == 0) && (argc == 3))
+			return access_control_mode(argv[2]);
+		if (strcmp(argv[1], "-inventory") == 0)
+			return inventory_mode(argc - 2, argv + 2);
+		if (strcmp(argv[1], "-mad") == 0)
+			return mad_mode(argc - 2, argv + 2);
+		if (strcmp(argv[1], "-derive") == 0)
+			return derive_mode(argc - 2, argv + 2);
+		if ((strcmp(argv[1], "-daemon") == 0) && (argc == 3))
+			return daemon_mode(argv[2]);
+		if ((strcmp(argv[1], "-stack") == 0) && (argc == 3))
+			return stack_mode(argv[2]);
+		if (strcmp(argv[1], "-sniff") == 0)
+			return sniff_mode(argc - 2, argv + 2);
+		if (strcmp(argv[1], "-decode") == 0)
+			return decode_mode(argc - 2, argv + 2);
+		if (strcmp(argv[1], "-corpus") == 0)
+			return corpus_mode(argc - 2, argv + 2);
+		if (strcmp(argv[1], "-audit") == 0)
+			return audit_mode(argc - 2, argv + 2);
+		if (strcmp(argv[1], "-grep") == 0)
+			return grep_mode(argc - 2, argv + 2);
+		if (strcmp(argv[1], "-archive") == 0)
+			return archive_mode(argc - 2, argv + 2);
+		if ((strcmp(argv[1], "-extract") == 0) && (argc == 4))
+			return extract_mode(argv[2], argv[3]);
+		if (strcmp(argv[1], "-plan") == 0)
+			return plan_mode(argc - 2, argv + 2);
+		if (strcmp(argv[1], "-debit") == 0)
+			return debit_mode(argc - 2, argv + 2);
+		if (strcmp(argv[1], "-stress") == 0)
+			return stress_mode(argc - 2, argv + 2);
+		if (strcmp(argv[1], "-calibrate") == 0)
+			return calibrate_mode(argc - 2, argv + 2);
+		if (strcmp(argv[1], "-jitter") == 0)
+			return jitter_mode(argc - 2, argv + 2);
+		if ((strcmp(argv[1], "-client") == 0) && (argc >= 3))
+			return client_mode(argv[2], argc - 3, argv + 3);
+		print_usage();
+		return 1;
+	}
+
+	string line;
+	connected = false;
+	bool interactive = stdin_is_terminal();
+	bool failed = false;	// a script exits with 1 if any of its commands failed
+
+	cout << "\n*** MiCmd " << VERSION << " -- MIFARE(R) command line ***\n";
+	if (interactive)
+		print_menu();
+	while (running) {
+		if (interactive) {
+			cout << '\n';
+			if (connected) {
+				cout << "You are CONNECTED to " << mi_device_name(session) << endl;
+				cout << "Found MIFARE Classic " << (b4k ? 4 : 1) << "K tag, UID: " << bytearray_to_string(ti.uid, ti.uid_length) << endl;
+			}
+			else
+				cout << "You are NOT connected, additional commands will not work.\n";
+			cout << "Type h for help.\n";
+			cout << "MiCmd " << VERSION << "> " ;
+		}
+		if (!getline(cin, line)) {
+			// End of input (script finished), leave like q
+			cmd_quit(CommandArgs());
+			break;
+		}
+		if (interactive)
+			cout << endl;
+		if (!execute_command(line))
+			failed = true;
+	}
+	return (failed && !interactive) ? 1 : 0;
+}
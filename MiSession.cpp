@@ -0,0 +1,745 @@
+// MiSession.cpp : Reader session library with a C interface, the tag primitives of MiCmd.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#include "stdafx.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "CardImage.h"
+#include "MiSession.h"
+#include "Planner.h"
+#include "SimReader.h"
+#include "Transcript.h"
+
+struct mi_session {
+	nfc_device_t* device;
+	SimReader* sim;		// stands in for device when set
+	TranscriptReplay* replay;	// so does a recorded transcript
+	TranscriptWriter* recorder;	// records the device calls when set
+	nfc_target_info_t target;
+	bool selected;
+	int sector;		// authenticated sector, -1 if none
+	mi_key_type key_type;
+	uint8_t key[6];
+	mi_event_handler handler;
+	void* handler_context;
+	// Trailers seen on the card with this UID, for checking access locally.
+	uint8_t card_uid[MI_MAX_UID];
+	size_t card_uid_length;
+	bool trailer_known[40];
+	uint8_t trailers[40][16];
+	char denial[128];
+};
+
+const char* mi_status_text(mi_status status) {
+	switch (status) {
+	case MI_OK: return "ok";
+	case MI_ERR_ARGUMENT: return "invalid-argument";
+	case MI_ERR_NO_DEVICE: return "no-device";
+	case MI_ERR_NOT_CONNECTED: return "not-connected";
+	case MI_ERR_NO_TAG: return "no-tag";
+	case MI_ERR_AUTH: return "auth-failed";
+	case MI_ERR_READ: return "read-failed";
+	case MI_ERR_WRITE: return "write-failed";
+	case MI_ERR_VALUE: return "value-failed";
+	case MI_ERR_READER: return "reader-failed";
+	case MI_ERR_BALANCE: return "insufficient-balance";
+	case MI_ERR_VERIFY: return "verify-failed";
+	case MI_ERR_CORRUPT: return "value-corrupt";
+	case MI_ERR_DENIED: return "access-denied";
+	case MI_ERR_UNCERTAIN: return "debit-uncertain";
+	}
+	return "unknown";
+}
+
+// Copies what fits, a longer src is cut at size - 1 characters.
+static void copy_string(char* dest, size_t size, const char* src) {
+	size_t length = src ? strlen(src) : 0;
+	if (length >= size)
+		length = size - 1;
+	memcpy(dest, src, length);
+	dest[length] = 0;
+}
+
+size_t mi_list_readers(mi_reader* readers, size_t max) {
+	nfc_device_desc_t found[16];
+	size_t count = 0;
+	memset(found, 0, sizeof(found));
+	nfc_list_devices(found, 16, &count);
+	if (count > max)
+		count = max;
+	for (size_t i = 0; i < count; i++) {
+		copy_string(readers[i].name, sizeof(readers[i].name), found[i].acDevice);
+		copy_string(readers[i].driver, sizeof(readers[i].driver), found[i].pcDriver);
+		copy_string(readers[i].port, sizeof(readers[i].port), found[i].pcPort);
+		readers[i].speed = found[i].uiSpeed;
+	}
+	return count;
+}
+
+mi_session* mi_session_new(void) {
+	mi_session* s = new mi_session;
+	s->device = NULL;
+	s->sim = NULL;
+	s->replay = NULL;
+	s->recorder = NULL;
+	s->handler = NULL;
+	s->handler_context = NULL;
+	s->selected = false;
+	s->sector = -1;
+	s->card_uid_length = 0;
+	memset(s->trailer_known, 0, sizeof(s->trailer_known));
+	s->denial[0] = 0;
+	return s;
+}
+
+void mi_session_free(mi_session* s) {
+	if (!s)
+		return;
+	mi_disconnect(s);
+	delete s;
+}
+
+// The reader calls, on the libnfc device, the stand-in reader or a replayed transcript. Calls on
+// the device are recorded when a recorder is set.
+
+static bool connected(const mi_session* s) {
+	return s->device || s->sim || s->replay;
+}
+
+static uint64_t record_start(const mi_session* s) {
+	return s->recorder ? transcript_now(s->recorder) : 0;
+}
+
+static void dev_init(mi_session* s) {
+	if (s->replay) {
+		replay_init(s->replay);
+		return;
+	}
+	uint64_t start = record_start(s);
+	bool ok = nfc_initiator_init(s->device);
+	if (s->recorder)
+		transcript_call(s->recorder, start, CALL_INIT, ok);
+}
+
+static bool dev_configure(mi_session* s, nfc_device_option_t option, bool enable) {
+	if (s->sim)
+		return sim_configure(s->sim, option, enable);
+	if (s->replay)
+		return replay_configure(s->replay, option, enable);
+	uint64_t start = record_start(s);
+	bool ok = nfc_configure(s->device, option, enable);
+	if (s->recorder)
+		transcript_configure(s->recorder, start, option, enable, ok);
+	return ok;
+}
+
+static bool dev_select(mi_session* s, const uint8_t* uid, size_t uid_length) {
+	if (s->sim)
+		return sim_select(s->sim, uid, uid_length, &s->target);
+	if (s->replay)
+		return replay_select(s->replay, uid, uid_length, &s->target);
+	uint64_t start = record_start(s);
+	bool ok = nfc_initiator_select_tag(s->device, NM_ISO14443A_106, uid, uid_length, &s->target);
+	if (s->recorder)
+		transcript_select(s->recorder, start, uid, uid_length, &s->target, ok);
+	return ok;
+}
+
+static void dev_deselect(mi_session* s) {
+	if (s->sim)
+		sim_deselect(s->sim);
+	else if (s->replay)
+		replay_deselect(s->replay);
+	else {
+		uint64_t start = record_start(s);
+		bool ok = nfc_initiator_deselect_tag(s->device);
+		if (s->recorder)
+			transcript_call(s->recorder, start, CALL_DESELECT, ok);
+	}
+}
+
+// A halted tag does not answer, so the transceive is expected to "fail".
+static void dev_halt(mi_session* s) {
+	if (s->sim) {
+		sim_halt(s->sim);
+		return;
+	}
+	if (s->replay) {
+		replay_halt(s->replay);
+		return;
+	}
+	uint8_t hlta[2] = { 0x50, 0x00 };
+	uint8_t rx[16];
+	size_t rx_length = 0;
+	uint64_t start = record_start(s);
+	bool ok = nfc_initiator_transceive_bytes(s->device, hlta, 2, rx, &rx_length);
+	if (s->recorder)
+		transcript_call(s->recorder, start, CALL_HALT, ok);
+}
+
+static bool dev_mifare_cmd(mi_session* s, mifare_cmd cmd, uint8_t block, mifare_param* param) {
+	if (s->sim)
+		return sim_mifare_cmd(s->sim, cmd, block, param);
+	if (s->replay)
+		return replay_mifare_cmd(s->replay, cmd, block, param);
+	if (!s->recorder)
+		return nfc_initiator_mifare_cmd(s->device, cmd, block, param);
+	mifare_param sent = *param;
+	uint64_t start = record_start(s);
+	bool ok = nfc_initiator_mifare_cmd(s->device, cmd, block, param);
+	transcript_mifare(s->recorder, start, cmd, block, &sent, param, ok);
+	return ok;
+}
+
+static void forget_tag(mi_session* s) {
+	s->selected = false;
+	s->sector = -1;
+}
+
+// Once the card has left the field the trailers may change before it comes back (another
+// reader writes them, or another card with the same UID is presented).
+static void forget_card(mi_session* s) {
+	s->card_uid_length = 0;
+	memset(s->trailer_known, 0, sizeof(s->trailer_known));
+}
+
+void mi_set_event_handler(mi_session* s, mi_event_handler handler, void* context) {
+	s->handler = handler;
+	s->handler_context = context;
+}
+
+// Starts the event for a command on the selected tag, before a failure forgets the tag.
+static void begin_event(const mi_session* s, mi_event* e, mi_event_type type, uint8_t block) {
+	memset(e, 0, sizeof(*e));
+	e->type = type;
+	e->uid_length = (s->target.nai.szUidLen <= MI_MAX_UID) ? s->target.nai.szUidLen : MI_MAX_UID;
+	memcpy(e->uid, s->target.nai.abtUid, e->uid_length);
+	e->sector = (uint8_t) get_sector(block);
+	e->block = block;
+}
+
+static mi_status report(const mi_session* s, mi_event* e, mi_status status) {
+	e->status = status;
+	if (s->handler)
+		s->handler(e, s->handler_context);
+	return status;
+}
+
+// A failed command halts the tag, the next command has to select it again.
+static mi_status tag_failed(mi_session* s, mi_status status) {
+	dev_deselect(s);
+	forget_tag(s);
+	return status;
+}
+
+// Every connection starts with the same calls, a replay expects them in this order.
+static void prepare_reader(mi_session* s) {
+	dev_init(s);
+	dev_configure(s, NDO_ACTIVATE_FIELD, false);
+	dev_configure(s, NDO_INFINITE_SELECT, false);
+	dev_configure(s, NDO_HANDLE_CRC, true);
+	dev_configure(s, NDO_HANDLE_PARITY, true);
+	dev_configure(s, NDO_ACTIVATE_FIELD, true);
+}
+
+mi_status mi_connect(mi_session* s, const char* driver, const char* port, uint32_t speed) {
+	mi_disconnect(s);
+	nfc_device_desc_t desc;
+	memset(&desc, 0, sizeof(desc));
+	desc.pcDriver = (char*) driver;
+	desc.pcPort = (char*) port;
+	desc.uiSpeed = speed;
+	uint64_t start = record_start(s);
+	s->device = nfc_connect(driver ? &desc : NULL);
+	if (s->recorder)
+		transcript_connect(s->recorder, start, s->device ? s->device->acName : NULL, s->device != NULL);
+	if (!s->device)
+		return MI_ERR_NO_DEVICE;
+	prepare_reader(s);
+	return MI_OK;
+}
+
+mi_status mi_connect_replay(mi_session* s, struct TranscriptReplay* replay) {
+	mi_disconnect(s);
+	if (!replay)
+		return MI_ERR_ARGUMENT;
+	if (!replay_connect(replay))
+		return MI_ERR_NO_DEVICE;
+	s->replay = replay;
+	prepare_reader(s);
+	return MI_OK;
+}
+
+mi_status mi_connect_simulator(mi_session* s, struct SimReader* reader) {
+	mi_disconnect(s);
+	if (!reader)
+		return MI_ERR_ARGUMENT;
+	s->sim = reader;
+	sim_configure(s->sim, NDO_ACTIVATE_FIELD, true);
+	return MI_OK;
+}
+
+void mi_disconnect(mi_session* s) {
+	if (s->device)
+		nfc_disconnect(s->device);
+	else if (s->sim)
+		sim_configure(s->sim, NDO_ACTIVATE_FIELD, false);
+	s->device = NULL;
+	s->sim = NULL;
+	s->replay = NULL;
+	forget_tag(s);
+	forget_card(s);
+}
+
+void mi_set_recorder(mi_session* s, struct TranscriptWriter* writer) {
+	s->recorder = writer;
+}
+
+int mi_is_connected(const mi_session* s) {
+	return connected(s);
+}
+
+const char* mi_device_name(const mi_session* s) {
+	if (s->sim)
+		return "simulated reader";
+	if (s->replay)
+		return s->replay->device_name;
+	return s->device ? s->device->acName : "";
+}
+
+mi_status mi_ping(mi_session* s) {
+	if (!connected(s))
+		return MI_ERR_NOT_CONNECTED;
+	return dev_configure(s, NDO_HANDLE_CRC, true) ? MI_OK : MI_ERR_READER;
+}
+
+mi_status mi_reset_field(mi_session* s) {
+	if (!connected(s))
+		return MI_ERR_NOT_CONNECTED;
+	forget_tag(s);
+	if (!dev_configure(s, NDO_ACTIVATE_FIELD, false) || !dev_configure(s, NDO_ACTIVATE_FIELD, true))
+		return MI_ERR_READER;
+	return MI_OK;
+}
+
+static void fill_tag(const nfc_iso14443a_info_t& nai, mi_tag* tag) {
+	if (!tag)
+		return;
+	memset(tag, 0, sizeof(*tag));
+	tag->uid_length = (nai.szUidLen <= MI_MAX_UID) ? nai.szUidLen : MI_MAX_UID;
+	memcpy(tag->uid, nai.abtUid, tag->uid_length);
+	memcpy(tag->atqa, nai.abtAtqa, 2);
+	tag->sak = nai.btSak;
+}
+
+// Trailers stay known across reselections of the same card, another card starts over.
+static void remember_card(mi_session* s) {
+	const nfc_iso14443a_info_t& nai = s->target.nai;
+	size_t length = (nai.szUidLen <= MI_MAX_UID) ? nai.szUidLen : MI_MAX_UID;
+	if ((length == s->card_uid_length) && (memcmp(nai.abtUid, s->card_uid, length) == 0))
+		return;
+	memcpy(s->card_uid, nai.abtUid, length);
+	s->card_uid_length = length;
+	memset(s->trailer_known, 0, sizeof(s->trailer_known));
+}
+
+static void remember_trailer(mi_session* s, uint8_t block, const uint8_t data[16]) {
+	if (!is_trailer_block(block))
+		return;
+	uint32_t sector = get_sector(block);
+	memcpy(s->trailers[sector], data, 16);
+	s->trailer_known[sector] = true;
+}
+
+// True when the remembered trailer of the authenticated sector forbids the operation.
+static bool denied(mi_session* s, OperationType type, uint8_t block, const uint8_t* data) {
+	int sector = (int) get_sector(block);
+	if ((sector != s->sector) || !s->trailer_known[sector])
+		return false;
+	Operation op;
+	memset(&op, 0, sizeof(op));
+	op.type = type;
+	op.block = block;
+	if (data)
+		memcpy(op.data, data, (type == OP_WRITE) ? 16 : 4);
+	int key = (s->key_type == MI_KEY_B) ? PLAN_KEY_B : PLAN_KEY_A;
+	if (allowed_keys(op, s->trailers[sector]) & key)
+		return false;
+	snprintf(s->denial, sizeof(s->denial), "%s", access_denial(op, s->trailers[sector], key).c_str());
+	return true;
+}
+
+static mi_status select_target(mi_session* s, const uint8_t* uid, size_t uid_length, mi_tag* tag) {
+	forget_tag(s);
+	if (!dev_select(s, uid, uid_length)) {
+		forget_card(s);
+		return MI_ERR_NO_TAG;
+	}
+	s->selected = true;
+	remember_card(s);
+	fill_tag(s->target.nai, tag);
+	return MI_OK;
+}
+
+mi_status mi_select(mi_session* s, mi_tag* tag) {
+	if (!connected(s))
+		return MI_ERR_NOT_CONNECTED;
+	return select_target(s, NULL, 0, tag);
+}
+
+mi_status mi_select_uid(mi_session* s, const uint8_t* uid, size_t uid_length, mi_tag* tag) {
+	if (!connected(s))
+		return MI_ERR_NOT_CONNECTED;
+	if ((uid_length == 0) || (uid_length > MI_MAX_UID))
+		return MI_ERR_ARGUMENT;
+	mi_halt(s);
+	if (select_target(s, uid, uid_length, tag) == MI_OK)
+		return MI_OK;
+	// The tag may have been halted earlier, wake the whole stack up and try once more.
+	mi_reset_field(s);
+	return select_target(s, uid, uid_length, tag);
+}
+
+// All tags answering in the field are enumerated by selecting one, putting it to HALT and
+// selecting the next, until nobody answers. A field reset wakes them all up again.
+mi_status mi_enumerate(mi_session* s, mi_tag* tags, size_t max, size_t* count) {
+	*count = 0;
+	if (!connected(s))
+		return MI_ERR_NOT_CONNECTED;
+	mi_reset_field(s);
+	mi_tag tag;
+	while ((*count < max) && (select_target(s, NULL, 0, &tag) == MI_OK)) {
+		bool seen = false;
+		for (size_t i = 0; i < *count; i++)
+			seen = seen || ((tags[i].uid_length == tag.uid_length) && (memcmp(tags[i].uid, tag.uid, tag.uid_length) == 0));
+		// Readers selecting with WUPA wake halted tags up, a repeated UID means we are done.
+		if (seen)
+			break;
+		tags[(*count)++] = tag;
+		mi_halt(s);
+	}
+	mi_reset_field(s);
+	return MI_OK;
+}
+
+void mi_halt(mi_session* s) {
+	if (!connected(s))
+		return;
+	dev_halt(s);
+	forget_tag(s);
+}
+
+void mi_deselect(mi_session* s) {
+	if (connected(s))
+		dev_deselect(s);
+	forget_tag(s);
+}
+
+int mi_selected_tag(const mi_session* s, mi_tag* tag) {
+	if (!s->selected)
+		return 0;
+	fill_tag(s->target.nai, tag);
+	return 1;
+}
+
+int mi_is_classic(const mi_tag* tag) {
+	return (tag->sak & 0x08) != 0;
+}
+
+int mi_is_4k(const mi_tag* tag) {
+	return tag->atqa[1] == 0x02;
+}
+
+int mi_is_authenticated(const mi_session* s, uint8_t sector, mi_key_type type, const uint8_t key[6]) {
+	return s->selected && (s->sector == sector) && (s->key_type == type) && (memcmp(s->key, key, 6) == 0);
+}
+
+int mi_authenticated_sector(const mi_session* s) {
+	return s->sector;
+}
+
+const char* mi_denial_reason(const mi_session* s) {
+	return s->denial;
+}
+
+int mi_known_trailer(const mi_session* s, uint8_t sector, uint8_t trailer[16]) {
+	if (!s->selected || (sector >= 40) || !s->trailer_known[sector])
+		return 0;
+	if (trailer)
+		memcpy(trailer, s->trailers[sector], 16);
+	return 1;
+}
+
+static mi_status send_auth(mi_session* s, uint8_t sector, mi_key_type type, const uint8_t key[6]) {
+	mi_event e;
+	mifare_param mp;
+	const nfc_iso14443a_info_t& nai = s->target.nai;
+	// Crypto1 takes the last four bytes of a double or triple size UID.
+	memcpy(mp.mpa.abtUid, nai.abtUid + ((nai.szUidLen > 4) ? nai.szUidLen - 4 : 0), 4);
+	memcpy(mp.mpa.abtKey, key, 6);
+	uint8_t block = (uint8_t) get_trailer_block(get_first_block(sector));
+	begin_event(s, &e, MI_EVENT_AUTH, block);
+	e.key_type = type;
+	if (!dev_mifare_cmd(s, (type == MI_KEY_B) ? MC_AUTH_B : MC_AUTH_A, block, &mp))
+		return report(s, &e, tag_failed(s, MI_ERR_AUTH));
+	s->sector = sector;
+	s->key_type = type;
+	memcpy(s->key, key, 6);
+	return report(s, &e, MI_OK);
+}
+
+// With a sector authenticated, the next authentication runs inside the encrypted session
+// (nested authentication) and the tag is not selected again. Only when that fails is the same
+// card selected again and authenticated from scratch, once. A wrong key therefore costs one
+// more select and authentication when it comes right after another sector.
+mi_status mi_authenticate(mi_session* s, uint8_t sector, mi_key_type type, const uint8_t key[6]) {
+	if (!connected(s))
+		return MI_ERR_NOT_CONNECTED;
+	if (!s->selected)
+		return MI_ERR_NO_TAG;
+	if (sector >= 40)
+		return MI_ERR_ARGUMENT;
+	if (mi_is_authenticated(s, sector, type, key))
+		return MI_OK;
+	bool nested = (s->sector >= 0);
+	mi_status status = send_auth(s, sector, type, key);
+	if ((status == MI_ERR_AUTH) && nested && (select_target(s, s->card_uid, s->card_uid_length, NULL) == MI_OK))
+		status = send_auth(s, sector, type, key);
+	return status;
+}
+
+mi_status mi_read_block(mi_session* s, uint8_t block, uint8_t data[16]) {
+	if (!connected(s))
+		return MI_ERR_NOT_CONNECTED;
+	if (!s->selected)
+		return MI_ERR_NO_TAG;
+	mi_event e;
+	begin_event(s, &e, MI_EVENT_READ, block);
+	if (denied(s, OP_READ, block, NULL))
+		return report(s, &e, MI_ERR_DENIED);
+	mifare_param mp;
+	if (!dev_mifare_cmd(s, MC_READ, block, &mp))
+		return report(s, &e, tag_failed(s, MI_ERR_READ));
+	memcpy(data, mp.mpd.abtData, 16);
+	remember_trailer(s, block, data);
+	return report(s, &e, MI_OK);
+}
+
+mi_status mi_write_block(mi_session* s, uint8_t block, const uint8_t data[16]) {
+	if (!connected(s))
+		return MI_ERR_NOT_CONNECTED;
+	if (!s->selected)
+		return MI_ERR_NO_TAG;
+	mi_event e;
+	begin_event(s, &e, MI_EVENT_WRITE, block);
+	if (denied(s, OP_WRITE, block, data))
+		return report(s, &e, MI_ERR_DENIED);
+	mifare_param mp;
+	memcpy(mp.mpd.abtData, data, 16);
+	if (!dev_mifare_cmd(s, MC_WRITE, block, &mp))
+		return report(s, &e, tag_failed(s, MI_ERR_WRITE));
+	// New keys or access bits in the trailer apply from the next authentication on.
+	if (is_trailer_block(block))
+		s->sector = -1;
+	remember_trailer(s, block, data);
+	return report(s, &e, MI_OK);
+}
+
+mi_status mi_value(mi_session* s, mi_value_op op, uint8_t block, const uint8_t value[4]) {
+	static const mifare_cmd COMMANDS[4] = { MC_INCREMENT, MC_DECREMENT, MC_STORE, MC_TRANSFER };
+	static const OperationType OPERATIONS[4] = { OP_INCREMENT, OP_DECREMENT, OP_RESTORE, OP_TRANSFER };
+	if (!connected(s))
+		return MI_ERR_NOT_CONNECTED;
+	if (!s->selected)
+		return MI_ERR_NO_TAG;
+	if ((op < MI_INCREMENT) || (op > MI_TRANSFER))
+		return MI_ERR_ARGUMENT;
+	mi_event e;
+	begin_event(s, &e, MI_EVENT_VALUE, block);
+	e.value_op = op;
+	mifare_param mp;
+	memset(mp.mpv.abtValue, 0, 4);
+	if (value && (op != MI_TRANSFER)) {
+		memcpy(mp.mpv.abtValue, value, 4);
+		e.operand = (int32_t) (value[0] | (value[1] << 8) | (value[2] << 16) | ((uint32_t) value[3] << 24));
+	}
+	if (denied(s, OPERATIONS[op], block, mp.mpv.abtValue))
+		return report(s, &e, MI_ERR_DENIED);
+	if (!dev_mifare_cmd(s, COMMANDS[op], block, &mp))
+		return report(s, &e, tag_failed(s, MI_ERR_VALUE));
+	return report(s, &e, MI_OK);
+}
+
+mi_status mi_listen(mi_session* s, uint8_t frame[MI_MAX_FRAME], size_t* bits, uint8_t parity[MI_MAX_FRAME]) {
+	if (!connected(s))
+		return MI_ERR_NOT_CONNECTED;
+	// The stand-in reader has no field to listen to, and passive capture is not recorded.
+	if (s->sim || s->replay)
+		return MI_ERR_READER;
+	forget_tag(s);
+	// nfc_target_init() keeps CRC and parity handling as it finds them.
+	nfc_configure(s->device, NDO_HANDLE_CRC, false);
+	nfc_configure(s->device, NDO_HANDLE_PARITY, false);
+	nfc_configure(s->device, NDO_ACCEPT_INVALID_FRAMES, true);
+	nfc_configure(s->device, NDO_ACCEPT_MULTIPLE_FRAMES, true);
+	memset(parity, 0, MI_MAX_FRAME);
+	if (!nfc_target_init(s->device, frame, bits))
+		return MI_ERR_READER;
+	return MI_OK;
+}
+
+mi_status mi_receive_frame(mi_session* s, uint8_t frame[MI_MAX_FRAME], size_t* bits, uint8_t parity[MI_MAX_FRAME]) {
+	if (!s->device)
+		return (s->sim || s->replay) ? MI_ERR_READER : MI_ERR_NOT_CONNECTED;
+	if (!nfc_target_receive_bits(s->device, frame, bits, parity))
+		return MI_ERR_READER;
+	return MI_OK;
+}
+
+const char* mi_recovery_text(mi_recovery recovery) {
+	switch (recovery) {
+	case MI_RECOVERY_NONE: return "none";
+	case MI_RECOVERY_ROLLED_BACK: return "rolled-back";
+	case MI_RECOVERY_BACKUP_REPAIRED: return "backup-repaired";
+	case MI_RECOVERY_COMPLETED: return "completed";
+	}
+	return "unknown";
+}
+
+// Reads a value block, false if the tag answered but the value copies do not agree. A backup
+// made by restore/transfer keeps the address of the block it was copied from, so foreign
+// and bad address bytes do not make a value invalid.
+static mi_status read_value(mi_session* s, uint8_t block, bool* valid, int32_t* value) {
+	uint8_t data[16];
+	mi_status status = mi_read_block(s, block, data);
+	if (status != MI_OK)
+		return status;
+	ValueBlockStatus vs = check_value_block(data, block, value);
+	*valid = (vs != VALUE_TORN) && (vs != VALUE_CORRUPT);
+	return MI_OK;
+}
+
+// Copies a value inside the tag, restore loads it into the tag's buffer and transfer writes it.
+static mi_status copy_value(mi_session* s, uint8_t from, uint8_t to) {
+	mi_status status = mi_value(s, MI_RESTORE, from, NULL);
+	if (status == MI_OK)
+		status = mi_value(s, MI_TRANSFER, to, NULL);
+	return status;
+}
+
+static bool debit_blocks_valid(uint8_t sector, uint8_t value_block, uint8_t backup_block) {
+	if ((value_block == backup_block) || (sector >= 40))
+		return false;
+	uint8_t blocks[2] = { value_block, backup_block };
+	for (int i = 0; i < 2; i++)
+		if ((blocks[i] == 0) || (get_sector(blocks[i]) != sector) || is_trailer_block(blocks[i]))
+			return false;
+	return true;
+}
+
+static mi_status read_debit_blocks(mi_session* s, uint8_t sector, mi_key_type type, const uint8_t key[6],
+	uint8_t value_block, uint8_t backup_block, bool* value_valid, int32_t* value, bool* backup_valid, int32_t* backup) {
+	mi_status status = mi_authenticate(s, sector, type, key);
+	if (status == MI_OK)
+		status = read_value(s, value_block, value_valid, value);
+	if (status == MI_OK)
+		status = read_value(s, backup_block, backup_valid, backup);
+	return status;
+}
+
+mi_status mi_debit(mi_session* s, uint8_t sector, mi_key_type type, const uint8_t key[6],
+	uint8_t value_block, uint8_t backup_block, int32_t amount, mi_debit_result* result) {
+	mi_debit_result r;
+	memset(&r, 0, sizeof(r));
+	if (result)
+		*result = r;
+	if ((amount <= 0) || !debit_blocks_valid(sector, value_block, backup_block))
+		return MI_ERR_ARGUMENT;
+
+	bool value_valid, backup_valid;
+	int32_t value, backup;
+	mi_status status = read_debit_blocks(s, sector, type, key, value_block, backup_block, &value_valid, &value, &backup_valid, &backup);
+	if (status != MI_OK)
+		return status;
+
+	if (!value_valid && !backup_valid)
+		return MI_ERR_CORRUPT;
+	if (!value_valid) {
+		// Torn while the debited value was transferred, the debit never happened.
+		status = copy_value(s, backup_block, value_block);
+		value = backup;
+		r.recovery = MI_RECOVERY_ROLLED_BACK;
+	}
+	else if (!backup_valid) {
+		status = copy_value(s, value_block, backup_block);
+		r.recovery = MI_RECOVERY_BACKUP_REPAIRED;
+	}
+	else if (value != backup) {
+		// The value block was written completely, so was the debit; only its commit is missing.
+		status = copy_value(s, value_block, backup_block);
+		r.recovery = MI_RECOVERY_COMPLETED;
+	}
+	r.before = r.after = value;
+	if (result)
+		*result = r;
+	if (status != MI_OK)
+		return status;
+	if (value < amount)
+		return MI_ERR_BALANCE;
+
+	uint8_t operand[4];
+	for (int i = 0; i < 4; i++)
+		operand[i] = (uint8_t) (amount >> (8 * i));
+	status = mi_value(s, MI_DECREMENT, value_block, operand);
+	if (status != MI_OK)
+		return status;
+	// A transfer that failed may still have been written, as the tag answers only afterwards.
+	status = mi_value(s, MI_TRANSFER, value_block, NULL);
+	if (status == MI_OK)
+		status = read_value(s, value_block, &value_valid, &value);
+	if (status != MI_OK)
+		return MI_ERR_UNCERTAIN;
+	if (!value_valid || (value != r.before - amount)) {
+		// Put the old balance back now rather than leave it for the next tap to complete.
+		copy_value(s, backup_block, value_block);
+		return MI_ERR_VERIFY;
+	}
+	// The debit is on the tag once the value block verified. A backup torn from here on is
+	// repaired by the next debit, so the outcome does not depend on the last copy.
+	r.after = value;
+	if (result)
+		*result = r;
+	copy_value(s, value_block, backup_block);
+	return MI_OK;
+}
+
+// mi_debit() only returns MI_ERR_UNCERTAIN after value and backup were equal and before the
+// backup is touched. The backup still holds the balance before the debit, a value block that
+// differs from it is the debited one, an equal or torn one is not.
+mi_status mi_debit_applied(mi_session* s, uint8_t sector, mi_key_type type, const uint8_t key[6],
+	uint8_t value_block, uint8_t backup_block, int* applied, mi_debit_result* result) {
+	mi_debit_result r;
+	memset(&r, 0, sizeof(r));
+	if (result)
+		*result = r;
+	if (!debit_blocks_valid(sector, value_block, backup_block))
+		return MI_ERR_ARGUMENT;
+	bool value_valid, backup_valid;
+	int32_t value, backup;
+	mi_status status = read_debit_blocks(s, sector, type, key, value_block, backup_block, &value_valid, &value, &backup_valid, &backup);
+	if (status != MI_OK)
+		return status;
+	if (!backup_valid)
+		return MI_ERR_CORRUPT;
+	*applied = value_valid && (value != backup);
+	r.before = backup;
+	r.after = *applied ? value : backup;
+	if (result)
+		*result = r;
+	return MI_OK;
+}
@@ -0,0 +1,214 @@
+// MiSession.h : Reader session library with a C interface, the tag primitives of MiCmd.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#ifndef _MICMD_MI_SESSION_H_
+#define _MICMD_MI_SESSION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A session owns one reader, the selected tag and the authentication state. Functions never
+// print, they return a status. Sessions are independent of each other, one session must not
+// be used by two threads at the same time.
+typedef struct mi_session mi_session;
+
+typedef enum {
+	MI_OK = 0,
+	MI_ERR_ARGUMENT,	// invalid parameter
+	MI_ERR_NO_DEVICE,	// no reader could be opened
+	MI_ERR_NOT_CONNECTED,	// mi_connect() was not called or failed
+	MI_ERR_NO_TAG,		// no (such) tag answered, or no tag is selected
+	MI_ERR_AUTH,		// authentication failed
+	MI_ERR_READ,
+	MI_ERR_WRITE,
+	MI_ERR_VALUE,
+	MI_ERR_READER,		// the reader did not answer a command
+	MI_ERR_BALANCE,		// the value is lower than the amount to debit
+	MI_ERR_VERIFY,		// the value read back is not what was transferred
+	MI_ERR_CORRUPT,		// neither the value block nor its backup holds a valid value
+	MI_ERR_DENIED,		// refused without sending, see mi_denial_reason()
+	MI_ERR_UNCERTAIN	// a debit failed after its transfer was sent, see mi_debit_applied()
+} mi_status;
+
+// A failing tag command halts the tag: the session then has no tag selected and no sector
+// authenticated until the next mi_select().
+// The session remembers every trailer it reads or writes on a card. A read, write or value
+// operation that the remembered access conditions forbid for the authenticated key fails with
+// MI_ERR_DENIED before anything is sent, and the tag stays selected and authenticated. The
+// trailers are forgotten by mi_disconnect() and when a select finds no tag.
+
+typedef enum {
+	MI_KEY_A = 0,
+	MI_KEY_B = 1
+} mi_key_type;
+
+typedef enum {
+	MI_INCREMENT,
+	MI_DECREMENT,
+	MI_RESTORE,
+	MI_TRANSFER
+} mi_value_op;
+
+#define MI_MAX_UID 10
+
+typedef struct {
+	uint8_t uid[MI_MAX_UID];
+	size_t uid_length;
+	uint8_t atqa[2];
+	uint8_t sak;
+} mi_tag;
+
+typedef struct {
+	char name[256];
+	char driver[64];
+	char port[128];
+	uint32_t speed;
+} mi_reader;
+
+// Every command sent to the tag (authentication, read, write, value operation) is reported to
+// the session's event handler after it completed, on the calling thread. Cached
+// authentications send nothing and are not reported.
+typedef enum {
+	MI_EVENT_AUTH,
+	MI_EVENT_READ,
+	MI_EVENT_WRITE,
+	MI_EVENT_VALUE
+} mi_event_type;
+
+typedef struct {
+	mi_event_type type;
+	mi_key_type key_type;	// MI_EVENT_AUTH
+	mi_value_op value_op;	// MI_EVENT_VALUE
+	uint8_t uid[MI_MAX_UID];
+	size_t uid_length;
+	uint8_t sector;
+	uint8_t block;
+	int32_t operand;	// MI_EVENT_VALUE, 0 for MI_TRANSFER
+	mi_status status;
+} mi_event;
+
+// The handler must return quickly, it runs between two tag commands.
+typedef void (*mi_event_handler)(const mi_event* event, void* context);
+
+const char* mi_status_text(mi_status status);
+// Fills up to max readers, returns how many were found.
+size_t mi_list_readers(mi_reader* readers, size_t max);
+
+mi_session* mi_session_new(void);
+void mi_session_free(mi_session* s);
+
+// driver, port may be NULL and speed 0 for the driver's defaults; without a driver the first
+// reader found is used. The field is switched on, no tag is selected.
+mi_status mi_connect(mi_session* s, const char* driver, const char* port, uint32_t speed);
+// Drives the stand-in reader of SimReader.h instead of a device, for fault injection tests.
+struct SimReader;
+mi_status mi_connect_simulator(mi_session* s, struct SimReader* reader);
+// Answers the reader calls from a transcript recorded with mi_set_recorder(), see Transcript.h.
+// The transcript has to start where a connection was made.
+struct TranscriptReplay;
+mi_status mi_connect_replay(mi_session* s, struct TranscriptReplay* replay);
+// Records every libnfc call of the session from now on, on each device it connects to, with
+// arguments, result and timing. NULL stops recording. Passive capture is not recorded.
+struct TranscriptWriter;
+void mi_set_recorder(mi_session* s, struct TranscriptWriter* writer);
+void mi_disconnect(mi_session* s);
+// handler may be NULL to stop reporting.
+void mi_set_event_handler(mi_session* s, mi_event_handler handler, void* context);
+int mi_is_connected(const mi_session* s);
+const char* mi_device_name(const mi_session* s);
+// One command round trip to the reader that does not touch the RF field.
+mi_status mi_ping(mi_session* s);
+// Switches the field off and on, every tag in it resets to IDLE.
+mi_status mi_reset_field(mi_session* s);
+
+// Selects the first tag answering, tag (may be NULL) receives its identification.
+mi_status mi_select(mi_session* s, mi_tag* tag);
+// Selects one specific tag; halted tags are woken up by a field reset if needed.
+mi_status mi_select_uid(mi_session* s, const uint8_t* uid, size_t uid_length, mi_tag* tag);
+// Lists all tags in the field by selecting and halting them in turn, leaves none selected.
+mi_status mi_enumerate(mi_session* s, mi_tag* tags, size_t max, size_t* count);
+// Sends HLTA to the selected tag.
+void mi_halt(mi_session* s);
+void mi_deselect(mi_session* s);
+// Returns 1 and fills tag (may be NULL) if a tag is selected.
+int mi_selected_tag(const mi_session* s, mi_tag* tag);
+
+int mi_is_classic(const mi_tag* tag);
+int mi_is_4k(const mi_tag* tag);
+
+// Returns MI_OK without any traffic when the sector is already authenticated with this key. With
+// another sector authenticated the tag is not selected again, the authentication is nested in
+// the running session; only if that fails is the card selected again and authenticated afresh.
+mi_status mi_authenticate(mi_session* s, uint8_t sector, mi_key_type type, const uint8_t key[6]);
+int mi_is_authenticated(const mi_session* s, uint8_t sector, mi_key_type type, const uint8_t key[6]);
+// The authenticated sector, -1 if none.
+int mi_authenticated_sector(const mi_session* s);
+// Why the last MI_ERR_DENIED was returned.
+const char* mi_denial_reason(const mi_session* s);
+// Returns 1 and fills trailer (may be NULL) if the sector's trailer of the selected card is known.
+int mi_known_trailer(const mi_session* s, uint8_t sector, uint8_t trailer[16]);
+
+mi_status mi_read_block(mi_session* s, uint8_t block, uint8_t data[16]);
+mi_status mi_write_block(mi_session* s, uint8_t block, const uint8_t data[16]);
+// value is the 4 byte operand, ignored by MI_TRANSFER.
+mi_status mi_value(mi_session* s, mi_value_op op, uint8_t block, const uint8_t value[4]);
+
+// -- Passive capture --
+// The reader turns into a target that hears what a reader in the field sends, invalid and
+// back-to-back frames included, CRC and parity left in the frame. parity receives one bit per
+// byte. The session has no tag until the next mi_connect().
+
+#define MI_MAX_FRAME 64
+
+// Waits until a reader in the field sends its first frame and returns that frame.
+mi_status mi_listen(mi_session* s, uint8_t frame[MI_MAX_FRAME], size_t* bits, uint8_t parity[MI_MAX_FRAME]);
+// The next frame, waits for it. Fails when the reader in the field switches off, mi_listen()
+// then waits for the next one.
+mi_status mi_receive_frame(mi_session* s, uint8_t frame[MI_MAX_FRAME], size_t* bits, uint8_t parity[MI_MAX_FRAME]);
+
+// -- Tear-safe debit --
+// The balance lives in a value block with a backup value block in the same sector. Between
+// transactions both hold the same value, the backup is only updated once the debited value
+// has been verified. A card pulled away in the middle leaves at most one of the two blocks
+// torn or different, the next debit repairs that before it debits again.
+
+typedef enum {
+	MI_RECOVERY_NONE,
+	MI_RECOVERY_ROLLED_BACK,	// the value block was torn, it got the backup's value again
+	MI_RECOVERY_BACKUP_REPAIRED,	// the backup was torn, it got the value block's value again
+	MI_RECOVERY_COMPLETED		// a debit had reached the value block only, the backup follows it
+} mi_recovery;
+
+typedef struct {
+	int32_t before;		// the balance debited from, after recovery
+	int32_t after;
+	mi_recovery recovery;
+} mi_debit_result;
+
+const char* mi_recovery_text(mi_recovery recovery);
+// Authenticates, recovers an interrupted previous debit, debits amount (> 0) from value_block,
+// verifies it and copies the new balance to backup_block. result may be NULL. Both blocks must
+// be value blocks of sector that key may decrement, transfer and restore.
+// A failure after the debited value was sent to the tag returns MI_ERR_UNCERTAIN: the tag may
+// or may not hold the debit, and calling mi_debit() again could charge twice.
+mi_status mi_debit(mi_session* s, uint8_t sector, mi_key_type type, const uint8_t key[6],
+	uint8_t value_block, uint8_t backup_block, int32_t amount, mi_debit_result* result);
+// Tells whether the debit that returned MI_ERR_UNCERTAIN reached the tag, by reading both blocks
+// and writing nothing; the card must not have been debited elsewhere in between. *applied is
+// set on MI_OK, result then holds the balance before and after that debit. A failure leaves
+// the question open, ask again.
+mi_status mi_debit_applied(mi_session* s, uint8_t sector, mi_key_type type, const uint8_t key[6],
+	uint8_t value_block, uint8_t backup_block, int* applied, mi_debit_result* result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _MICMD_MI_SESSION_H_
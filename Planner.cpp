@@ -0,0 +1,299 @@
+// Planner.cpp : Access condition aware planning of batched block operations.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#include "stdafx.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "CardImage.h"
+#include "Planner.h"
+
+using namespace std;
+
+#define A PLAN_KEY_A
+#define B PLAN_KEY_B
+#define AB (PLAN_KEY_A | PLAN_KEY_B)
+
+// Data blocks, indexed by C1 C2 C3: read, write, increment, decrement/transfer/restore.
+static const int DATA_PERMISSIONS[8][4] = {
+	{ AB, AB, AB, AB },	// 000 transport
+	{ AB, 0,  0,  AB },	// 001 value, decrement only
+	{ AB, 0,  0,  0  },	// 010 read-only
+	{ B,  B,  0,  0  },	// 011
+	{ AB, B,  0,  0  },	// 100
+	{ B,  0,  0,  0  },	// 101
+	{ AB, B,  B,  AB },	// 110 value
+	{ 0,  0,  0,  0  }	// 111 dead
+};
+
+// Trailer, indexed by C1 C2 C3: write key A, read AC, write AC, write key B.
+static const int TRAILER_PERMISSIONS[8][4] = {
+	{ A, A,  0, A },	// 000
+	{ A, A,  A, A },	// 001 transport
+	{ 0, A,  0, 0 },	// 010
+	{ B, AB, B, B },	// 011
+	{ B, AB, 0, B },	// 100
+	{ 0, AB, B, 0 },	// 101
+	{ 0, AB, 0, 0 },	// 110
+	{ 0, AB, 0, 0 }		// 111
+};
+
+#undef A
+#undef B
+#undef AB
+
+const char* operation_name(OperationType type) {
+	switch (type) {
+	case OP_READ: return "read";
+	case OP_WRITE: return "write";
+	case OP_INCREMENT: return "inc";
+	case OP_DECREMENT: return "dec";
+	case OP_RESTORE: return "restore";
+	case OP_TRANSFER: return "transfer";
+	}
+	return "?";
+}
+
+static bool is_value_operation(OperationType type) {
+	return (type == OP_INCREMENT) || (type == OP_DECREMENT) || (type == OP_RESTORE);
+}
+
+// What the datasheet tables grant, before the readable key B rule.
+static int permitted_keys(const Operation& op, const uint8_t* trailer) {
+	AccessCondition acs[4];
+	if (!decode_access_conditions(trailer, acs))
+		return 0;
+	uint8_t trailer_bits = access_bits(acs[3]);
+	int keys;
+	if (is_trailer_block(op.block)) {
+		const int* p = TRAILER_PERMISSIONS[trailer_bits];
+		if (op.type == OP_READ)
+			keys = p[1];
+		else if (op.type == OP_WRITE) {
+			// Both keys are always written, the access bytes only matter when they change.
+			keys = p[0] & p[3];
+			if (memcmp(op.data + 6, trailer + 6, 3) != 0)
+				keys &= p[2];
+		}
+		else
+			keys = 0;
+	}
+	else {
+		const int* p = DATA_PERMISSIONS[access_bits(acs[get_access_group(op.block)])];
+		switch (op.type) {
+		case OP_READ: keys = p[0]; break;
+		case OP_WRITE: keys = p[1]; break;
+		case OP_INCREMENT: keys = p[2]; break;
+		default: keys = p[3]; break;
+		}
+	}
+	return keys;
+}
+
+// 000, 001 and 010 let key A read key B, which then is plain data and no longer a key.
+static bool key_b_readable(const uint8_t* trailer) {
+	AccessCondition acs[4];
+	return decode_access_conditions(trailer, acs) && (access_bits(acs[3]) <= 2);
+}
+
+int allowed_keys(const Operation& op, const uint8_t* trailer) {
+	int keys = permitted_keys(op, trailer);
+	if (key_b_readable(trailer))
+		keys &= ~PLAN_KEY_B;
+	return keys;
+}
+
+static string access_bits_text(const Operation& op, const AccessCondition acs[4]) {
+	char text[32];
+	uint8_t bits = access_bits(acs[is_trailer_block(op.block) ? 3 : get_access_group(op.block)]);
+	snprintf(text, sizeof(text), "C1 C2 C3 = %d%d%d", bits >> 2, (bits >> 1) & 1, bits & 1);
+	return text;
+}
+
+string access_denial(const Operation& op, const uint8_t* trailer, int key) {
+	AccessCondition acs[4];
+	if (!decode_access_conditions(trailer, acs))
+		return "invalid access bits, the sector is blocked";
+	int permitted = permitted_keys(op, trailer);
+	if (permitted & key)
+		return "the trailer leaves key B readable, so it cannot be used for access";
+	if (permitted && !allowed_keys(op, trailer))
+		return "only key B may, but the trailer leaves key B readable so it cannot authenticate";
+	char text[80];
+	if (permitted)
+		snprintf(text, sizeof(text), "%s of block %u needs key %s", operation_name(op.type), op.block, (key == PLAN_KEY_A) ? "B" : "A");
+	else
+		snprintf(text, sizeof(text), "%s of block %u is denied by the access conditions", operation_name(op.type), op.block);
+	return string(text) + " (" + access_bits_text(op, acs) + ")";
+}
+
+static string format_operation(const Operation& op) {
+	char text[80];
+	int n = snprintf(text, sizeof(text), "%s %u", operation_name(op.type), op.block);
+	size_t length = (op.type == OP_WRITE) ? 16 : (is_value_operation(op.type) ? 4 : 0);
+	if (length)
+		text[n++] = ' ';
+	for (size_t i = 0; i < length; i++)
+		n += snprintf(text + n, sizeof(text) - n, "%02X", op.data[i]);
+	return text;
+}
+
+// The keys that may perform ops[first, last) together, given what is known about the sector.
+static int unit_keys(const vector<Operation>& ops, size_t first, size_t last, const SectorKnowledge& k) {
+	int keys = (k.has_key[0] ? PLAN_KEY_A : 0) | (k.has_key[1] ? PLAN_KEY_B : 0);
+	if (k.has_trailer)
+		for (size_t i = first; i < last; i++)
+			keys &= allowed_keys(ops[i], k.trailer);
+	return keys;
+}
+
+// Ops that must share one authentication: a value operation and the transfer following it,
+// the value only lives in the tag's buffer until then.
+static size_t unit_end(const vector<Operation>& ops, size_t first) {
+	if (is_value_operation(ops[first].type) && (first + 1 < ops.size()) && (ops[first + 1].type == OP_TRANSFER))
+		return first + 2;
+	return first + 1;
+}
+
+static bool writes_trailer(const vector<Operation>& ops, size_t first, size_t last) {
+	for (size_t i = first; i < last; i++)
+		if ((ops[i].type == OP_WRITE) && is_trailer_block(ops[i].block))
+			return true;
+	return false;
+}
+
+static string rejection_reason(const vector<Operation>& ops, size_t first, size_t last, const SectorKnowledge& k) {
+	if (ops[first].type == OP_TRANSFER)
+		return "transfer without a preceding inc, dec or restore";
+	if (!k.has_key[0] && !k.has_key[1])
+		return "no key known for the sector";
+	int allowed = PLAN_KEY_A | PLAN_KEY_B;
+	for (size_t i = first; i < last; i++)
+		allowed &= allowed_keys(ops[i], k.trailer);
+	AccessCondition acs[4];
+	if (!decode_access_conditions(k.trailer, acs))
+		return "invalid access bits, the sector is blocked";
+	if (allowed == 0) {
+		int permitted = PLAN_KEY_A | PLAN_KEY_B;
+		for (size_t i = first; i < last; i++)
+			permitted &= permitted_keys(ops[i], k.trailer);
+		if (permitted == PLAN_KEY_B)
+			return "only key B may, but the trailer leaves key B readable so it cannot authenticate";
+		return "denied by the access conditions (" + access_bits_text(ops[first], acs) + ")";
+	}
+	return string("needs key ") + ((allowed & PLAN_KEY_A) ? "A" : "B") + ", which is not known";
+}
+
+static bool by_line(const Rejection& a, const Rejection& b) {
+	return a.op.line < b.op.line;
+}
+
+void plan_operations(const vector<Operation>& ops, const vector<SectorKnowledge>& sectors, Plan* plan) {
+	plan->steps.clear();
+	plan->rejected.clear();
+
+	// Operations on different sectors do not interact, each sector gets its ops in batch order.
+	vector<uint8_t> order;
+	vector<vector<Operation> > by_sector(PLAN_MAX_SECTORS);
+	for (size_t i = 0; i < ops.size(); i++) {
+		uint8_t sector = (uint8_t) get_sector(ops[i].block);
+		if ((ops[i].block == 0) && (ops[i].type != OP_READ)) {
+			Rejection r = { ops[i], "block 0 is the read-only manufacturer block" };
+			plan->rejected.push_back(r);
+			continue;
+		}
+		if (by_sector[sector].empty())
+			order.push_back(sector);
+		by_sector[sector].push_back(ops[i]);
+	}
+
+	for (size_t o = 0; o < order.size(); o++) {
+		uint8_t sector = order[o];
+		const vector<Operation>& pending = by_sector[sector];
+		SectorKnowledge k = sectors[sector];
+		PlanStep* step = NULL;
+		for (size_t i = 0; i < pending.size(); ) {
+			size_t end = unit_end(pending, i);
+			int keys = (pending[i].type == OP_TRANSFER) ? 0 : unit_keys(pending, i, end, k);
+			if (keys == 0) {
+				string reason = rejection_reason(pending, i, end, k);
+				for (size_t j = i; j < end; j++) {
+					Rejection r = { pending[j], reason };
+					plan->rejected.push_back(r);
+				}
+				i = end;
+				continue;
+			}
+			if (!step || !(keys & (step->keyB ? PLAN_KEY_B : PLAN_KEY_A))) {
+				// Take the key that lasts for the most following units, every switch costs an authentication.
+				bool keyB;
+				if (keys != (PLAN_KEY_A | PLAN_KEY_B))
+					keyB = (keys == PLAN_KEY_B);
+				else {
+					size_t run[2] = { 0, 0 };
+					for (int kt = 0; kt < 2; kt++) {
+						for (size_t j = i; j < pending.size(); ) {
+							size_t e = unit_end(pending, j);
+							if (!(unit_keys(pending, j, e, k) & (kt ? PLAN_KEY_B : PLAN_KEY_A)))
+								break;
+							run[kt]++;
+							if (writes_trailer(pending, j, e))
+								break;
+							j = e;
+						}
+					}
+					keyB = (run[1] > run[0]);
+				}
+				PlanStep s;
+				s.sector = sector;
+				s.keyB = keyB;
+				memcpy(s.key, k.key[keyB ? 1 : 0], 6);
+				s.checked = k.has_trailer;
+				plan->steps.push_back(s);
+				step = &plan->steps.back();
+			}
+			step->ops.insert(step->ops.end(), pending.begin() + i, pending.begin() + end);
+
+			// A new trailer brings new keys and access conditions, later ops authenticate again.
+			if (writes_trailer(pending, i, end)) {
+				for (size_t j = i; j < end; j++) {
+					if ((pending[j].type == OP_WRITE) && is_trailer_block(pending[j].block)) {
+						memcpy(k.trailer, pending[j].data, 16);
+						memcpy(k.key[0], pending[j].data, 6);
+						memcpy(k.key[1], pending[j].data + 10, 6);
+					}
+				}
+				k.has_trailer = k.has_key[0] = k.has_key[1] = true;
+				step = NULL;
+			}
+			i = end;
+		}
+	}
+	stable_sort(plan->rejected.begin(), plan->rejected.end(), by_line);
+}
+
+void print_plan(ostream& out, const Plan& plan) {
+	size_t planned = 0;
+	for (size_t i = 0; i < plan.steps.size(); i++) {
+		const PlanStep& s = plan.steps[i];
+		out << "Sector " << (int) s.sector << ", key " << (s.keyB ? "B" : "A")
+			<< (s.checked ? "" : " (trailer unknown, not checked)") << ":\n";
+		for (size_t j = 0; j < s.ops.size(); j++)
+			out << "  " << s.ops[j].line << ": " << format_operation(s.ops[j]) << "\n";
+		planned += s.ops.size();
+	}
+	if (!plan.rejected.empty()) {
+		out << "Rejected:\n";
+		for (size_t i = 0; i < plan.rejected.size(); i++)
+			out << "  " << plan.rejected[i].op.line << ": " << format_operation(plan.rejected[i].op)
+				<< ": " << plan.rejected[i].reason << "\n";
+	}
+	out << "Authentications: " << plan.steps.size() << ", operations: " << planned
+		<< ", rejected: " << plan.rejected.size() << "\n";
+}
@@ -0,0 +1,78 @@
+// Planner.h : Access condition aware planning of batched block operations.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#ifndef _MICMD_PLANNER_H_
+#define _MICMD_PLANNER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#define PLAN_KEY_A 1
+#define PLAN_KEY_B 2
+#define PLAN_MAX_SECTORS 40
+
+typedef enum {
+	OP_READ,
+	OP_WRITE,
+	OP_INCREMENT,
+	OP_DECREMENT,
+	OP_RESTORE,
+	OP_TRANSFER
+} OperationType;
+
+typedef struct {
+	OperationType type;
+	uint8_t block;
+	uint8_t data[16];	// write: block data, increment/decrement/restore: 4 byte operand
+	size_t line;		// position in the batch, used in reports
+} Operation;
+
+// What is known about a sector before planning. Key bytes are what the executor authenticates
+// with, the trailer only needs valid access bytes (6-9), the keys read back as zeros.
+typedef struct {
+	bool has_key[2];	// [0] = key A, [1] = key B
+	uint8_t key[2][6];
+	bool has_trailer;
+	uint8_t trailer[16];
+} SectorKnowledge;
+
+// One authentication followed by operations, in batch order.
+typedef struct {
+	uint8_t sector;
+	bool keyB;
+	uint8_t key[6];
+	bool checked;		// false if the trailer was unknown, the tag may still refuse
+	std::vector<Operation> ops;
+} PlanStep;
+
+typedef struct {
+	Operation op;
+	std::string reason;
+} Rejection;
+
+typedef struct {
+	std::vector<PlanStep> steps;
+	std::vector<Rejection> rejected;
+} Plan;
+
+const char* operation_name(OperationType type);
+
+// PLAN_KEY_A | PLAN_KEY_B mask of the keys the access conditions in trailer allow op with.
+// Key B is left out when the trailer makes it readable, the tag then refuses it for access.
+int allowed_keys(const Operation& op, const uint8_t* trailer);
+// Why key (PLAN_KEY_A or PLAN_KEY_B) may not do op under trailer, for when allowed_keys() says so.
+std::string access_denial(const Operation& op, const uint8_t* trailer, int key);
+
+// Groups the operations by sector, keeping their order within each sector, picks the key per
+// step so that a sector is authenticated as few times as possible and rejects what the access
+// conditions or the known keys cannot do. sectors holds PLAN_MAX_SECTORS entries.
+void plan_operations(const std::vector<Operation>& ops, const std::vector<SectorKnowledge>& sectors, Plan* plan);
+void print_plan(std::ostream& out, const Plan& plan);
+
+#endif // _MICMD_PLANNER_H_
@@ -0,0 +1,228 @@
+// RtProfile.cpp : Real-time scheduling for the thread that drives the reader.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#include "stdafx.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "RtProfile.h"
+
+using namespace std;
+
+const size_t RT_PAGE = 4096;
+const size_t RT_STACK_PREFAULT = 512 * 1024;		// deeper than any call chain of the reader loop
+const size_t RT_HEAP_PREFAULT = 16 * 1024 * 1024;	// latency samples, rings and session buffers
+
+static bool applied = false;
+#ifdef __linux__
+static cpu_set_t original_cpus;
+#endif
+
+bool rt_parse(const char* spec, RtProfile* profile) {
+	string s(spec);
+	string::size_type colon = s.find(':');
+	string cpu = s.substr(0, colon);
+	char* end;
+	profile->priority = 50;
+	profile->lock_memory = true;
+	if (cpu == "any")
+		profile->cpu = -1;
+	else {
+		long n = strtol(cpu.c_str(), &end, 10);
+		if (cpu.empty() || *end || (n < 0) || (n > 1023))
+			return false;
+		profile->cpu = (int) n;
+	}
+	if (colon != string::npos) {
+		long n = strtol(s.c_str() + colon + 1, &end, 10);
+		if ((colon + 1 == s.length()) || *end || (n < 0) || (n > 99))
+			return false;
+		profile->priority = (int) n;
+	}
+	return true;
+}
+
+static void append(string* report, const char* text) {
+	if (!report->empty())
+		*report += ", ";
+	*report += text;
+}
+
+// Touches the stack the thread will grow into, the first deep call then finds it mapped.
+static void prefault_stack() {
+	uint8_t stack[RT_STACK_PREFAULT];
+	volatile uint8_t* page = stack;
+	for (size_t i = 0; i < RT_STACK_PREFAULT; i += RT_PAGE)
+		page[i] = 0;
+}
+
+// With trimming and mmap off, freed memory stays in the heap: buffers allocated later reuse
+// pages that are faulted in and, after mlockall(), locked. False if the heap could not grow.
+static bool prefault_heap() {
+#ifdef __GLIBC__
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	volatile uint8_t* heap = (volatile uint8_t*) malloc(RT_HEAP_PREFAULT);
+	if (!heap)
+		return false;
+	for (size_t i = 0; i < RT_HEAP_PREFAULT; i += RT_PAGE)
+		heap[i] = 0;
+	free((void*) heap);
+#endif
+	return true;
+}
+
+#ifndef WIN32
+// What locking everything will pin: the mappings the process has now, which mlockall() locks
+// whether they are resident or not, and what the pre-faulting adds.
+static uint64_t planned_footprint() {
+	uint64_t mapped = 0;
+#ifdef __linux__
+	FILE* f = fopen("/proc/self/statm", "r");
+	unsigned long pages;
+	if (f) {
+		if (fscanf(f, "%lu", &pages) == 1)
+			mapped = (uint64_t) pages * sysconf(_SC_PAGESIZE);
+		fclose(f);
+	}
+#endif
+	return mapped + RT_STACK_PREFAULT + RT_HEAP_PREFAULT;
+}
+
+// RLIMIT_MEMLOCK in bytes, UINT64_MAX when it does not apply (unlimited, or root).
+static uint64_t memlock_limit() {
+	rlimit limit;
+	if ((geteuid() == 0) || (getrlimit(RLIMIT_MEMLOCK, &limit) != 0) || (limit.rlim_cur == RLIM_INFINITY))
+		return UINT64_MAX;
+	return limit.rlim_cur;
+}
+#endif
+
+bool rt_apply(const RtProfile& profile, string* report) {
+	bool ok = true;
+	char text[120];
+	report->clear();
+	applied = true;
+#ifdef WIN32
+	if (profile.cpu >= 0) {
+		bool pinned = (profile.cpu < 64) && (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << profile.cpu) != 0);
+		snprintf(text, sizeof(text), pinned ? "pinned to CPU %d" : "CPU %d refused", profile.cpu);
+		append(report, text);
+		ok = ok && pinned;
+	}
+	if (profile.priority > 0) {
+		// There is no SCHED_FIFO, the nearest is a time critical thread in a high priority process.
+		bool raised = SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS)
+			&& SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+		append(report, raised ? "time critical priority" : "time critical priority refused");
+		ok = ok && raised;
+	}
+	if (profile.lock_memory) {
+		prefault_stack();
+		append(report, "stack pre-faulted, memory locking not supported");
+		ok = false;
+	}
+#else
+	if (profile.cpu >= 0) {
+#ifdef __linux__
+		pthread_getaffinity_np(pthread_self(), sizeof(original_cpus), &original_cpus);
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(profile.cpu, &cpus);
+		int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#else
+		int error = ENOSYS;
+#endif
+		if (error)
+			snprintf(text, sizeof(text), "CPU %d refused (%s)", profile.cpu, strerror(error));
+		else
+			snprintf(text, sizeof(text), "pinned to CPU %d", profile.cpu);
+		append(report, text);
+		ok = ok && !error;
+	}
+	if (profile.priority > 0) {
+		sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = profile.priority;
+		int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (error)
+			snprintf(text, sizeof(text), "SCHED_FIFO %d refused (%s)", profile.priority, strerror(error));
+		else
+			snprintf(text, sizeof(text), "SCHED_FIFO %d", profile.priority);
+		append(report, text);
+		ok = ok && !error;
+	}
+	if (profile.lock_memory) {
+		// With MCL_FUTURE every later allocation counts against RLIMIT_MEMLOCK and fails beyond
+		// it, so it is only asked for when the whole planned footprint fits.
+		uint64_t limit = memlock_limit(), footprint = planned_footprint();
+		bool future = (limit >= footprint);
+		bool locked = false;
+		if (!future) {
+			snprintf(text, sizeof(text), "RLIMIT_MEMLOCK %llu KiB below the planned %llu KiB, MCL_FUTURE dropped",
+				(unsigned long long) (limit / 1024), (unsigned long long) (footprint / 1024));
+			append(report, text);
+			ok = false;
+		}
+		// Locked first: with MCL_FUTURE the pages touched below stay resident.
+		if (mlockall(future ? (MCL_CURRENT | MCL_FUTURE) : MCL_CURRENT) == 0)
+			locked = true;
+		else {
+			snprintf(text, sizeof(text), "mlockall refused (%s)", strerror(errno));
+			append(report, text);
+			ok = false;
+		}
+		// Pre-faulting only pays off for memory that stays locked.
+		if (locked && future) {
+			prefault_stack();
+			bool heap = prefault_heap();
+			append(report, heap ? "memory locked" : "memory locked, heap pre-fault failed");
+			ok = ok && heap;
+		}
+		else if (locked)
+			append(report, "current memory locked, nothing pre-faulted");
+	}
+#endif
+	if (report->empty())
+		*report = "nothing to apply";
+	return ok;
+}
+
+void rt_leave_thread() {
+	if (!applied)
+		return;
+#ifdef WIN32
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_NORMAL);
+	DWORD_PTR process_cpus, system_cpus;
+	if (GetProcessAffinityMask(GetCurrentProcess(), &process_cpus, &system_cpus))
+		SetThreadAffinityMask(GetCurrentThread(), process_cpus);
+#else
+	sched_param param;
+	memset(&param, 0, sizeof(param));
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+#ifdef __linux__
+	if (CPU_COUNT(&original_cpus) > 0)
+		pthread_setaffinity_np(pthread_self(), sizeof(original_cpus), &original_cpus);
+#endif
+#endif
+}
@@ -0,0 +1,30 @@
+// RtProfile.h : Real-time scheduling for the thread that drives the reader.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#ifndef _MICMD_RT_PROFILE_H_
+#define _MICMD_RT_PROFILE_H_
+
+#include <string>
+
+// What the profile asks for. Each step is applied on its own, a refused one (no permission for
+// SCHED_FIFO, a too small RLIMIT_MEMLOCK) does not stop the others.
+typedef struct {
+	int cpu;		// core the calling thread is pinned to, -1 leaves the affinity alone
+	int priority;	// SCHED_FIFO priority 1..99, 0 keeps the normal scheduler
+	bool lock_memory;	// mlockall() and pre-faulting of stack and heap, only the current pages
+				// and nothing pre-faulted if RLIMIT_MEMLOCK is below the footprint
+} RtProfile;
+
+// Parses "<cpu|any>[:<priority>]", e.g. "3:80". The priority defaults to 50, memory is locked.
+bool rt_parse(const char* spec, RtProfile* profile);
+// Applies the profile to the calling thread and the process memory. The report says what was
+// granted and why anything was refused. True only if every step was granted.
+bool rt_apply(const RtProfile& profile, std::string* report);
+// Helper threads started by a real-time thread inherit its core and priority, this puts the
+// calling thread back on the normal scheduler and every core. Does nothing before rt_apply().
+void rt_leave_thread();
+
+#endif // _MICMD_RT_PROFILE_H_
@@ -0,0 +1,302 @@
+// SectorStore.cpp : Deduplicated archive of card images, each distinct sector is stored once.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#include "stdafx.h"
+
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "SectorStore.h"
+
+using namespace std;
+
+const size_t STORE_PENDING_SIZE = 1 << 16;	// manifests written, after a sync, at once
+
+static uint32_t sector_size(uint32_t sector) {
+	uint32_t first = get_first_block(sector);
+	return (get_trailer_block(first) - first + 1) * MIFARE_BLOCK_SIZE;
+}
+
+// Sectors are a multiple of 8 bytes, hashed a word at a time.
+static uint64_t sector_hash(const uint8_t* data, size_t size) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < size; i += 8) {
+		uint64_t w;
+		memcpy(&w, data + i, 8);
+		h = (h ^ w) * 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+static bool read_file(const string& filename, const char* magic, vector<uint8_t>* data) {
+	FILE* f = fopen(filename.c_str(), "rb");
+	if (!f)
+		return false;
+	char m[4];
+	bool ok = (fread(m, 1, 4, f) == 4) && (memcmp(m, magic, 4) == 0);
+	if (ok) {
+		uint8_t buffer[1 << 16];
+		size_t n;
+		while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+			data->insert(data->end(), buffer, buffer + n);
+		ok = !ferror(f);
+	}
+	fclose(f);
+	return ok;
+}
+
+static void put_manifest(vector<uint8_t>* out, const StoreManifest& m) {
+	out->push_back((uint8_t) m.name.size());
+	out->push_back((uint8_t) (m.name.size() >> 8));
+	out->insert(out->end(), m.name.begin(), m.name.end());
+	out->push_back(m.sector_count);
+	for (size_t i = 0; i < m.offsets.size(); i++)
+		for (int b = 0; b < 8; b++)
+			out->push_back((uint8_t) (m.offsets[i] >> (8 * b)));
+}
+
+typedef enum {
+	MANIFESTS_OK,
+	MANIFESTS_TORN,		// the last record is cut short, an interrupted append
+	MANIFESTS_CORRUPT	// a complete record is malformed
+} ManifestsStatus;
+
+// Parses manifests until the end of data, everything before a torn last record is kept. On
+// corruption *error_pos is the offset of the bad record in data.
+static ManifestsStatus parse_manifests(const vector<uint8_t>& data, SectorStore* store, size_t* error_pos) {
+	size_t pos = 0;
+	while (pos < data.size()) {
+		size_t start = pos;
+		if (data.size() - pos < 3)
+			return MANIFESTS_TORN;
+		size_t name_length = data[pos] | (data[pos + 1] << 8);
+		if (data.size() - pos < 3 + name_length)
+			return MANIFESTS_TORN;
+		StoreManifest m;
+		m.name.assign((const char*) &data[pos + 2], name_length);
+		m.sector_count = data[pos + 2 + name_length];
+		pos += 3 + name_length;
+		*error_pos = start;
+		if ((m.sector_count != 16) && (m.sector_count != 40))
+			return MANIFESTS_CORRUPT;
+		if (data.size() - pos < 8u * m.sector_count)
+			return MANIFESTS_TORN;
+		m.offsets.resize(m.sector_count);
+		for (uint32_t s = 0; s < m.sector_count; s++, pos += 8) {
+			uint64_t offset = 0;
+			for (int b = 7; b >= 0; b--)
+				offset = offset << 8 | data[pos + b];
+			if ((offset > store->sectors.size()) || (store->sectors.size() - offset < sector_size(s)))
+				return MANIFESTS_CORRUPT;
+			m.offsets[s] = offset;
+		}
+		unordered_map<string, size_t>::iterator known = store->names.find(m.name);
+		if (known != store->names.end())
+			store->cards[known->second] = m;
+		else {
+			store->names[m.name] = store->cards.size();
+			store->cards.push_back(m);
+		}
+	}
+	return MANIFESTS_OK;
+}
+
+bool is_store(const char* path) {
+	FILE* f = fopen((string(path) + "/" + STORE_CARDS_FILE).c_str(), "rb");
+	if (!f)
+		return false;
+	fclose(f);
+	return true;
+}
+
+static bool store_read(const char* path, SectorStore* store, bool* torn) {
+	vector<uint8_t> manifests;
+	store->path = path;
+	store->sectors.clear();
+	store->cards.clear();
+	store->names.clear();
+	store->index.clear();
+	store->sectors_file = store->cards_file = NULL;
+	store->pending.clear();
+	store->added_cards = store->unchanged_cards = store->new_sectors = store->shared_sectors = 0;
+	if (!read_file(store->path + "/" + STORE_SECTORS_FILE, STORE_SECTORS_MAGIC, &store->sectors)
+		|| !read_file(store->path + "/" + STORE_CARDS_FILE, STORE_CARDS_MAGIC, &manifests))
+		return false;
+	size_t error_pos = 0;
+	ManifestsStatus status = parse_manifests(manifests, store, &error_pos);
+	if (status == MANIFESTS_CORRUPT) {
+		// Only a cut-short tail is repaired, anything else is left for a person to look at.
+		fprintf(stderr, "%s: %s is corrupt, malformed manifest at byte %lu\n", path, STORE_CARDS_FILE,
+			(unsigned long) (error_pos + 4));
+		return false;
+	}
+	*torn = (status == MANIFESTS_TORN);
+	return true;
+}
+
+bool store_load(const char* path, SectorStore* store) {
+	bool torn;
+	if (!store_read(path, store, &torn))
+		return false;
+	if (torn)
+		fprintf(stderr, "%s: ignoring an incomplete manifest at the end of %s\n", path, STORE_CARDS_FILE);
+	return true;
+}
+
+static bool create_file(const string& filename, const char* magic) {
+	FILE* f = fopen(filename.c_str(), "wb");
+	if (!f)
+		return false;
+	bool ok = (fwrite(magic, 1, 4, f) == 4);
+	return (fclose(f) == 0) && ok;
+}
+
+bool store_open(const char* path, SectorStore* store) {
+	if (!is_store(path)) {
+#ifdef WIN32
+		CreateDirectoryA(path, NULL);
+#else
+		mkdir(path, 0777);
+#endif
+		if (!create_file(string(path) + "/" + STORE_SECTORS_FILE, STORE_SECTORS_MAGIC)
+			|| !create_file(string(path) + "/" + STORE_CARDS_FILE, STORE_CARDS_MAGIC))
+			return false;
+	}
+	bool torn;
+	if (!store_read(path, store, &torn))
+		return false;
+
+	for (size_t c = 0; c < store->cards.size(); c++) {
+		const StoreManifest& m = store->cards[c];
+		for (uint32_t s = 0; s < m.sector_count; s++) {
+			uint64_t h = sector_hash(&store->sectors[m.offsets[s]], sector_size(s));
+			pair<unordered_multimap<uint64_t, uint64_t>::iterator, unordered_multimap<uint64_t, uint64_t>::iterator> range = store->index.equal_range(h);
+			unordered_multimap<uint64_t, uint64_t>::iterator i = range.first;
+			while ((i != range.second) && (i->second != m.offsets[s]))
+				++i;
+			if (i == range.second)
+				store->index.insert(make_pair(h, m.offsets[s]));
+		}
+	}
+
+	// An interrupted append left half a manifest behind, rewrite the file from what was read.
+	if (torn) {
+		vector<uint8_t> manifests;
+		for (size_t c = 0; c < store->cards.size(); c++)
+			put_manifest(&manifests, store->cards[c]);
+		FILE* f = fopen((store->path + "/" + STORE_CARDS_FILE).c_str(), "wb");
+		if (!f)
+			return false;
+		bool ok = (fwrite(STORE_CARDS_MAGIC, 1, 4, f) == 4)
+			&& (fwrite(manifests.data(), 1, manifests.size(), f) == manifests.size());
+		if ((fclose(f) != 0) || !ok)
+			return false;
+	}
+
+	store->sectors_file = fopen((store->path + "/" + STORE_SECTORS_FILE).c_str(), "ab");
+	store->cards_file = fopen((store->path + "/" + STORE_CARDS_FILE).c_str(), "ab");
+	if (!store->sectors_file || !store->cards_file) {
+		store_close(store);
+		return false;
+	}
+	return true;
+}
+
+static bool sync_file(FILE* f) {
+	if (fflush(f) != 0)
+		return false;
+#ifdef WIN32
+	return (_commit(_fileno(f)) == 0);
+#else
+	return (fsync(fileno(f)) == 0);
+#endif
+}
+
+// The sectors a manifest refers to must reach the disk before the manifest does, or a crash
+// can leave a manifest pointing past the end of sectors.bin. Manifests wait in memory so that
+// one sync covers many cards.
+static bool write_pending(SectorStore* store) {
+	if (store->pending.empty())
+		return true;
+	bool ok = sync_file(store->sectors_file)
+		&& (fwrite(store->pending.data(), 1, store->pending.size(), store->cards_file) == store->pending.size())
+		&& (fflush(store->cards_file) == 0);
+	store->pending.clear();
+	return ok;
+}
+
+bool store_add(SectorStore* store, const string& name, const CardImage& image) {
+	if (name.size() > 0xffff)
+		return false;
+	StoreManifest m;
+	m.name = name;
+	m.sector_count = (uint8_t) get_sector_count(image.size);
+	m.offsets.resize(m.sector_count);
+	for (uint32_t s = 0; s < m.sector_count; s++) {
+		const uint8_t* data = image.data + get_first_block(s) * MIFARE_BLOCK_SIZE;
+		uint32_t size = sector_size(s);
+		uint64_t h = sector_hash(data, size);
+		pair<unordered_multimap<uint64_t, uint64_t>::iterator, unordered_multimap<uint64_t, uint64_t>::iterator> range = store->index.equal_range(h);
+		unordered_multimap<uint64_t, uint64_t>::iterator i = range.first;
+		while ((i != range.second) && ((store->sectors.size() - i->second < size) || (memcmp(&store->sectors[i->second], data, size) != 0)))
+			++i;
+		if (i != range.second) {
+			m.offsets[s] = i->second;
+			store->shared_sectors++;
+			continue;
+		}
+		m.offsets[s] = store->sectors.size();
+		store->sectors.insert(store->sectors.end(), data, data + size);
+		store->index.insert(make_pair(h, m.offsets[s]));
+		store->new_sectors++;
+		if (fwrite(data, 1, size, store->sectors_file) != size)
+			return false;
+	}
+
+	unordered_map<string, size_t>::iterator known = store->names.find(name);
+	if ((known != store->names.end()) && (store->cards[known->second].offsets == m.offsets)) {
+		store->unchanged_cards++;
+		return true;
+	}
+	put_manifest(&store->pending, m);
+	if ((store->pending.size() >= STORE_PENDING_SIZE) && !write_pending(store))
+		return false;
+	if (known != store->names.end())
+		store->cards[known->second] = m;
+	else {
+		store->names[name] = store->cards.size();
+		store->cards.push_back(m);
+	}
+	store->added_cards++;
+	return true;
+}
+
+bool store_close(SectorStore* store) {
+	bool ok = true;
+	if (store->sectors_file && store->cards_file)
+		ok = write_pending(store);
+	if (store->sectors_file)
+		ok = (fclose(store->sectors_file) == 0) && ok;
+	if (store->cards_file)
+		ok = (fclose(store->cards_file) == 0) && ok;
+	store->sectors_file = store->cards_file = NULL;
+	return ok;
+}
+
+void store_get_image(const SectorStore& store, size_t card, CardImage* image) {
+	const StoreManifest& m = store.cards[card];
+	image->size = (m.sector_count == 16) ? MIFARE_1K_SIZE : MIFARE_4K_SIZE;
+	for (uint32_t s = 0; s < m.sector_count; s++)
+		memcpy(image->data + get_first_block(s) * MIFARE_BLOCK_SIZE, &store.sectors[m.offsets[s]], sector_size(s));
+}
@@ -0,0 +1,59 @@
+// SectorStore.h : Deduplicated archive of card images, each distinct sector is stored once.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#ifndef _MICMD_SECTOR_STORE_H_
+#define _MICMD_SECTOR_STORE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "CardImage.h"
+
+// Archive layout (a directory), all numbers little endian:
+//   sectors.bin : "MCS1", then the distinct sectors back to back, 64 or 256 bytes each
+//   cards.bin   : "MCM1", then one manifest per card: uint16 name length, name,
+//                 uint8 sector count (16 or 40), uint64 offset into sectors.bin per sector
+// Both files are only appended to, a later manifest with the same name replaces the earlier one.
+// Offsets count from the end of the magic.
+
+#define STORE_SECTORS_MAGIC "MCS1"
+#define STORE_CARDS_MAGIC "MCM1"
+#define STORE_SECTORS_FILE "sectors.bin"
+#define STORE_CARDS_FILE "cards.bin"
+
+typedef struct {
+	std::string name;
+	uint8_t sector_count;
+	std::vector<uint64_t> offsets;
+} StoreManifest;
+
+typedef struct {
+	std::string path;
+	std::vector<uint8_t> sectors;				// sectors.bin without the magic
+	std::vector<StoreManifest> cards;			// latest manifest per name
+	std::unordered_map<std::string, size_t> names;		// name -> index in cards
+	std::unordered_multimap<uint64_t, uint64_t> index;	// sector hash -> offset, built by store_open
+	FILE* sectors_file;
+	FILE* cards_file;
+	std::vector<uint8_t> pending;				// manifests not written yet, see store_close
+	uint64_t added_cards, unchanged_cards, new_sectors, shared_sectors;
+} SectorStore;
+
+bool is_store(const char* path);
+// Reads an archive for scanning.
+bool store_load(const char* path, SectorStore* store);
+// Reads an archive (creating an empty one if path does not exist) and opens it for adding cards.
+bool store_open(const char* path, SectorStore* store);
+// Adds or replaces the card called name. Nothing is written if the card is unchanged.
+bool store_add(SectorStore* store, const std::string& name, const CardImage& image);
+// Writes the manifests still held back, after the sectors reached the disk, and closes the files.
+bool store_close(SectorStore* store);
+void store_get_image(const SectorStore& store, size_t card, CardImage* image);
+
+#endif // _MICMD_SECTOR_STORE_H_
@@ -0,0 +1,250 @@
+// SimReader.cpp : Stand-in reader with one simulated MIFARE Classic tag and fault injection.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#include "stdafx.h"
+
+#include <string.h>
+
+#include "SimReader.h"
+
+// Virtual time a command takes on a PN53x at 115200 baud, in ms. A command the tag does not
+// answer costs the reader's timeout.
+const double SIM_CONFIGURE_MS = 0.5;
+const double SIM_SELECT_MS = 3.5;
+const double SIM_HALT_MS = 1.0;
+const double SIM_AUTH_MS = 2.5;
+const double SIM_READ_MS = 2.5;
+const double SIM_WRITE_MS = 6.0;
+const double SIM_VALUE_MS = 3.0;
+const double SIM_TRANSFER_MS = 5.0;
+const double SIM_TIMEOUT_MS = 30.0;
+
+typedef enum {
+	SIM_ANSWER,
+	SIM_SILENT,
+	SIM_TEAR
+} SimOutcome;
+
+void sim_init(SimReader* r, const CardImage& image, const SimFaults& faults) {
+	r->image = image;
+	r->faults = faults;
+	r->rng.seed(faults.seed);
+	r->now_ms = 0;
+	r->away_until_ms = 0;
+	r->field = false;
+	r->selected = false;
+	r->halted = false;
+	r->sector = -1;
+	r->has_buffer = false;
+	r->buffer = 0;
+	r->buffer_address = 0;
+	memset(&r->counters, 0, sizeof(r->counters));
+}
+
+double sim_now(const SimReader* r) {
+	return r->now_ms;
+}
+
+void sim_wait(SimReader* r, double ms) {
+	r->now_ms += ms;
+}
+
+static bool chance(SimReader* r, double rate) {
+	return (rate > 0) && (std::uniform_real_distribution<double>(0, 1)(r->rng) < rate);
+}
+
+static bool present(const SimReader* r) {
+	return r->field && (r->now_ms >= r->away_until_ms);
+}
+
+// What a tag does after any failed command: it falls back to IDLE and forgets the crypto state.
+static void drop_state(SimReader* r) {
+	r->selected = false;
+	r->sector = -1;
+	r->has_buffer = false;
+}
+
+static void remove_tag(SimReader* r) {
+	double mean = (r->faults.away_ms > 0) ? r->faults.away_ms : 1;
+	r->away_until_ms = r->now_ms + std::exponential_distribution<double>(1 / mean)(r->rng);
+	r->halted = false;
+	drop_state(r);
+}
+
+// Rolls the faults for one command. A silent command has already cost the timeout.
+static SimOutcome roll(SimReader* r, bool writes, double cost_ms) {
+	r->counters.commands++;
+	SimOutcome outcome = SIM_ANSWER;
+	if (!present(r))
+		outcome = SIM_SILENT;
+	else if (chance(r, r->faults.removal_rate)) {
+		r->counters.removals++;
+		remove_tag(r);
+		outcome = SIM_SILENT;
+	}
+	else if (writes && chance(r, r->faults.tear_rate)) {
+		r->counters.tears++;
+		outcome = SIM_TEAR;
+	}
+	else if (chance(r, r->faults.error_rate)) {
+		r->counters.errors++;
+		drop_state(r);
+		outcome = SIM_SILENT;
+	}
+	r->now_ms += (outcome == SIM_ANSWER) ? cost_ms : SIM_TIMEOUT_MS;
+	return outcome;
+}
+
+// The EEPROM holds the first bytes of the new block when the tag loses power while writing.
+static void tear(SimReader* r, uint8_t* block, const uint8_t* data) {
+	size_t written = std::uniform_int_distribution<size_t>(1, MIFARE_BLOCK_SIZE - 1)(r->rng);
+	memcpy(block, data, written);
+	remove_tag(r);
+}
+
+bool sim_configure(SimReader* r, nfc_device_option_t option, bool enable) {
+	r->now_ms += SIM_CONFIGURE_MS;
+	if (option == NDO_ACTIVATE_FIELD) {
+		// Without power the tag forgets everything, a halted tag answers again afterwards.
+		r->field = enable;
+		r->halted = false;
+		drop_state(r);
+	}
+	return true;
+}
+
+bool sim_select(SimReader* r, const uint8_t* uid, size_t uid_length, nfc_target_info_t* target) {
+	drop_state(r);
+	if (r->halted) {
+		r->counters.commands++;
+		r->now_ms += SIM_TIMEOUT_MS;
+		return false;
+	}
+	if (roll(r, false, SIM_SELECT_MS) != SIM_ANSWER)
+		return false;
+	const uint8_t* block0 = r->image.data;
+	if (uid && ((uid_length != 4) || (memcmp(uid, block0, 4) != 0)))
+		return false;
+	memset(target, 0, sizeof(*target));
+	target->nai.abtAtqa[0] = 0x00;
+	target->nai.abtAtqa[1] = (r->image.size == MIFARE_4K_SIZE) ? 0x02 : 0x04;
+	target->nai.btSak = (r->image.size == MIFARE_4K_SIZE) ? 0x18 : 0x08;
+	target->nai.szUidLen = 4;
+	memcpy(target->nai.abtUid, block0, 4);
+	r->selected = true;
+	return true;
+}
+
+void sim_deselect(SimReader* r) {
+	r->now_ms += SIM_HALT_MS;
+	drop_state(r);
+}
+
+void sim_halt(SimReader* r) {
+	r->now_ms += SIM_HALT_MS;
+	if (r->selected)
+		r->halted = true;
+	drop_state(r);
+}
+
+bool sim_mifare_cmd(SimReader* r, mifare_cmd cmd, uint8_t block, mifare_param* param) {
+	bool writes = (cmd == MC_WRITE) || (cmd == MC_TRANSFER);
+	double cost = SIM_READ_MS;
+	switch (cmd) {
+	case MC_AUTH_A: case MC_AUTH_B: cost = SIM_AUTH_MS; break;
+	case MC_WRITE: cost = SIM_WRITE_MS; break;
+	case MC_TRANSFER: cost = SIM_TRANSFER_MS; break;
+	case MC_INCREMENT: case MC_DECREMENT: case MC_STORE: cost = SIM_VALUE_MS; break;
+	default: break;
+	}
+	if (!r->selected || (block * MIFARE_BLOCK_SIZE >= r->image.size)) {
+		r->counters.commands++;
+		r->now_ms += SIM_TIMEOUT_MS;
+		drop_state(r);
+		return false;
+	}
+	SimOutcome outcome = roll(r, writes, cost);
+	if (outcome == SIM_SILENT)
+		return false;
+
+	int sector = (int) get_sector(block);
+	uint8_t* data = r->image.data + block * MIFARE_BLOCK_SIZE;
+	const uint8_t* trailer = r->image.data + get_trailer_block(get_first_block(sector)) * MIFARE_BLOCK_SIZE;
+	// Anything but authentication needs the sector authenticated, the tag does not answer otherwise.
+	if ((cmd != MC_AUTH_A) && (cmd != MC_AUTH_B) && (sector != r->sector)) {
+		drop_state(r);
+		return false;
+	}
+
+	switch (cmd) {
+	case MC_AUTH_A:
+	case MC_AUTH_B:
+		if (memcmp(param->mpa.abtKey, trailer + ((cmd == MC_AUTH_A) ? 0 : 10), 6) != 0) {
+			drop_state(r);
+			return false;
+		}
+		r->sector = sector;
+		r->has_buffer = false;
+		return true;
+	case MC_READ:
+		memcpy(param->mpd.abtData, data, MIFARE_BLOCK_SIZE);
+		// Key A never reads back.
+		if (is_trailer_block(block))
+			memset(param->mpd.abtData, 0, 6);
+		return true;
+	case MC_WRITE:
+		if (outcome == SIM_TEAR) {
+			tear(r, data, param->mpd.abtData);
+			return false;
+		}
+		memcpy(data, param->mpd.abtData, MIFARE_BLOCK_SIZE);
+		return true;
+	case MC_INCREMENT:
+	case MC_DECREMENT:
+	case MC_STORE: {
+		int32_t value, operand;
+		uint8_t address;
+		// A block not in value format is refused with a NAK.
+		if (!decode_value_block(data, &value, &address)) {
+			drop_state(r);
+			return false;
+		}
+		operand = (int32_t) (param->mpv.abtValue[0] | (param->mpv.abtValue[1] << 8)
+			| (param->mpv.abtValue[2] << 16) | ((uint32_t) param->mpv.abtValue[3] << 24));
+		if (cmd == MC_INCREMENT)
+			value += operand;
+		else if (cmd == MC_DECREMENT)
+			value -= operand;
+		r->buffer = value;
+		r->buffer_address = address;
+		r->has_buffer = true;
+		return true;
+	}
+	case MC_TRANSFER: {
+		if (!r->has_buffer) {
+			drop_state(r);
+			return false;
+		}
+		// The address byte travels with the value, a restored copy keeps the source's address.
+		uint8_t formatted[MIFARE_BLOCK_SIZE];
+		uint32_t value = (uint32_t) r->buffer;
+		for (int i = 0; i < 4; i++) {
+			formatted[i] = formatted[8 + i] = (uint8_t) (value >> (8 * i));
+			formatted[4 + i] = (uint8_t) ~formatted[i];
+		}
+		formatted[12] = formatted[14] = r->buffer_address;
+		formatted[13] = formatted[15] = (uint8_t) ~r->buffer_address;
+		r->has_buffer = false;
+		if (outcome == SIM_TEAR) {
+			tear(r, data, formatted);
+			return false;
+		}
+		memcpy(data, formatted, MIFARE_BLOCK_SIZE);
+		return true;
+	}
+	}
+	return false;
+}
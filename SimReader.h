@@ -0,0 +1,69 @@
+// SimReader.h : Stand-in reader with one simulated MIFARE Classic tag and fault injection.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#ifndef _MICMD_SIM_READER_H_
+#define _MICMD_SIM_READER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <random>
+
+#include "CardImage.h"
+
+extern "C" {
+#include <nfc/nfc.h>
+}
+
+// Fault rates are probabilities per command (tear: per write or transfer).
+typedef struct {
+	double removal_rate;	// the tag leaves the field before it answers
+	double error_rate;	// a transmission error, the tag stays but drops its state
+	double tear_rate;	// the tag leaves while a block is written, part of it is written
+	double away_ms;		// mean time a removed tag stays away
+	uint32_t seed;
+} SimFaults;
+
+typedef struct {
+	uint64_t commands;
+	uint64_t removals;
+	uint64_t errors;
+	uint64_t tears;
+} SimCounters;
+
+// The tag keeps its memory, keys and authentication like a real one; access conditions are not
+// enforced, key A reads back as zeros. Time is virtual: every command advances the
+// clock by what it takes on a PN53x, so long workloads run fast and the same seed replays the
+// same faults.
+typedef struct SimReader {
+	CardImage image;
+	SimFaults faults;
+	std::mt19937 rng;
+	double now_ms;
+	double away_until_ms;	// the tag is out of the field until then
+	bool field;
+	bool selected;
+	bool halted;
+	int sector;		// authenticated sector, -1 if none
+	bool has_buffer;	// value loaded by inc/dec/restore, waiting for transfer
+	int32_t buffer;
+	uint8_t buffer_address;
+	SimCounters counters;
+} SimReader;
+
+// image must be 1K or 4K, its block 0 gives the UID (4 bytes), SAK and ATQA.
+void sim_init(SimReader* r, const CardImage& image, const SimFaults& faults);
+double sim_now(const SimReader* r);
+// Lets virtual time pass, e.g. a retry backoff.
+void sim_wait(SimReader* r, double ms);
+
+// The libnfc calls a session makes, with the same results.
+bool sim_configure(SimReader* r, nfc_device_option_t option, bool enable);
+bool sim_select(SimReader* r, const uint8_t* uid, size_t uid_length, nfc_target_info_t* target);
+void sim_deselect(SimReader* r);
+void sim_halt(SimReader* r);
+bool sim_mifare_cmd(SimReader* r, mifare_cmd cmd, uint8_t block, mifare_param* param);
+
+#endif // _MICMD_SIM_READER_H_
@@ -0,0 +1,107 @@
+// Trace.cpp : MiCmd binary trace file format for raw reader <-> tag traffic.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#include "stdafx.h"
+
+#include <string.h>
+
+#include "Trace.h"
+
+const size_t TRACE_BUFFER_SIZE = 1 << 20;
+
+bool trace_open(TraceReader* r, const char* filename) {
+	char magic[4];
+	r->file = fopen(filename, "rb");
+	if (!r->file)
+		return false;
+	if ((fread(magic, 1, 4, r->file) != 4) || (memcmp(magic, TRACE_MAGIC, 4) != 0)) {
+		fclose(r->file);
+		r->file = NULL;
+		return false;
+	}
+	r->buffer.resize(TRACE_BUFFER_SIZE);
+	r->pos = r->length = 0;
+	r->offset = 4;
+	r->eof = false;
+	return true;
+}
+
+// Makes at least "needed" bytes available at buffer[pos], keeping the unread tail.
+static bool trace_fill(TraceReader* r, size_t needed) {
+	if (r->length - r->pos >= needed)
+		return true;
+	memmove(&r->buffer[0], &r->buffer[r->pos], r->length - r->pos);
+	r->offset += r->pos;
+	r->length -= r->pos;
+	r->pos = 0;
+	r->length += fread(&r->buffer[r->length], 1, r->buffer.size() - r->length, r->file);
+	return (r->length >= needed);
+}
+
+bool trace_read(TraceReader* r, TraceFrame* f) {
+	if (!trace_fill(r, TRACE_FRAME_HEADER_SIZE)) {
+		r->eof = (r->length == r->pos);
+		return false;
+	}
+	const uint8_t* h = &r->buffer[r->pos];
+	f->timestamp = 0;
+	for (int i = 7; i >= 0; i--)
+		f->timestamp = f->timestamp << 8 | h[i];
+	f->bits = h[8] | (h[9] << 8);
+	f->direction = h[10];
+	f->flags = h[11];
+	size_t bytes = trace_frame_bytes(*f);
+	if ((bytes > MAX_TRACE_FRAME) || (f->direction > TRACE_TAG_TO_READER)) {
+		r->eof = false;
+		return false;
+	}
+	if (!trace_fill(r, TRACE_FRAME_HEADER_SIZE + bytes)) {
+		r->eof = false;		// truncated record
+		return false;
+	}
+	memcpy(f->data, &r->buffer[r->pos + TRACE_FRAME_HEADER_SIZE], bytes);
+	r->pos += TRACE_FRAME_HEADER_SIZE + bytes;
+	return true;
+}
+
+uint64_t trace_position(const TraceReader* r) {
+	return r->offset + r->pos;
+}
+
+void trace_close(TraceReader* r) {
+	if (r->file)
+		fclose(r->file);
+	r->file = NULL;
+}
+
+bool trace_create(TraceWriter* w, const char* filename) {
+	w->frames = 0;
+	w->file = fopen(filename, "wb");
+	if (!w->file)
+		return false;
+	setvbuf(w->file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+	return (fwrite(TRACE_MAGIC, 1, 4, w->file) == 4);
+}
+
+bool trace_write(TraceWriter* w, const TraceFrame& f) {
+	uint8_t h[TRACE_FRAME_HEADER_SIZE];
+	for (int i = 0; i < 8; i++)
+		h[i] = (uint8_t) (f.timestamp >> (8 * i));
+	h[8] = (uint8_t) f.bits;
+	h[9] = (uint8_t) (f.bits >> 8);
+	h[10] = f.direction;
+	h[11] = f.flags;
+	size_t bytes = trace_frame_bytes(f);
+	w->frames++;
+	return (fwrite(h, 1, sizeof(h), w->file) == sizeof(h)) && (fwrite(f.data, 1, bytes, w->file) == bytes);
+}
+
+bool trace_finish(TraceWriter* w) {
+	bool ok = (fflush(w->file) == 0);
+	ok = (fclose(w->file) == 0) && ok;
+	w->file = NULL;
+	return ok;
+}
@@ -0,0 +1,71 @@
+// Trace.h : MiCmd binary trace file format for raw reader <-> tag traffic.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#ifndef _MICMD_TRACE_H_
+#define _MICMD_TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+// File layout, all numbers little endian:
+//   header : "MCT1"
+//   frame  : uint64 timestamp [us since capture start], uint16 length [bits],
+//            uint8 direction, uint8 flags, (length+7)/8 data bytes, no CRC stripping.
+// Parity bits are not stored, the decoder does not need them.
+
+#define TRACE_MAGIC "MCT1"
+#define TRACE_FRAME_HEADER_SIZE 12
+#define MAX_TRACE_FRAME 64	// PN53x FIFO size, no valid frame is longer
+
+enum {
+	TRACE_READER_TO_TAG = 0,
+	TRACE_TAG_TO_READER = 1
+};
+
+enum {
+	TRACE_FLAG_INVALID = 0x01	// frame was captured with NDO_ACCEPT_INVALID_FRAMES
+};
+
+typedef struct {
+	uint64_t timestamp;
+	uint16_t bits;
+	uint8_t direction;
+	uint8_t flags;
+	uint8_t data[MAX_TRACE_FRAME];
+} TraceFrame;
+
+inline size_t trace_frame_bytes(const TraceFrame& f) {
+	return (f.bits + 7) / 8;
+}
+
+// Streams frames from a file through a fixed size buffer, memory use does not depend on
+// the size of the capture.
+typedef struct {
+	FILE* file;
+	std::vector<uint8_t> buffer;
+	size_t pos;
+	size_t length;
+	uint64_t offset;	// file offset of buffer[0]
+	bool eof;
+} TraceReader;
+
+bool trace_open(TraceReader* r, const char* filename);
+// Returns false at the end of the file or on a malformed record (r->eof tells which).
+bool trace_read(TraceReader* r, TraceFrame* f);
+uint64_t trace_position(const TraceReader* r);
+void trace_close(TraceReader* r);
+
+typedef struct {
+	FILE* file;
+	uint64_t frames;
+} TraceWriter;
+
+bool trace_create(TraceWriter* w, const char* filename);
+bool trace_write(TraceWriter* w, const TraceFrame& f);
+bool trace_finish(TraceWriter* w);
+
+#endif // _MICMD_TRACE_H_
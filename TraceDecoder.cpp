@@ -0,0 +1,399 @@
+// TraceDecoder.cpp : Offline decoder for captured ISO14443A / MIFARE Classic traffic.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#include "stdafx.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <sstream>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "Crypto1.h"
+#include "Trace.h"
+#include "TraceDecoder.h"
+
+using namespace std;
+
+// Work is handed out in chunks of whole sessions. A chunk is closed at the first session
+// start after CHUNK_FRAMES frames, or cut hard at MAX_CHUNK_FRAMES inside a long session.
+const size_t CHUNK_FRAMES = 4096;
+const size_t MAX_CHUNK_FRAMES = 16384;
+
+typedef struct {
+	uint64_t index;
+	bool continued;		// starts in the middle of a session cut at MAX_CHUNK_FRAMES
+	vector<TraceFrame> frames;
+} TraceChunk;
+
+typedef struct {
+	string text;
+	TraceDecodeStats stats;
+} DecodedChunk;
+
+typedef enum {
+	DS_PLAIN,
+	DS_AUTH_NT,
+	DS_AUTH_NRAR,
+	DS_AUTH_AT,
+	DS_ENCRYPTED,
+	DS_WRITE_DATA,
+	DS_VALUE_DATA,
+	DS_LOST		// encrypted traffic we cannot follow, wait for the next REQA/WUPA
+} DecoderState;
+
+typedef struct {
+	DecoderState state;
+	Crypto1State cs;
+	bool nested;
+	bool have_uid;
+	uint8_t uid[10];
+	size_t uid_length;
+	uint32_t cuid;
+	uint32_t nt;
+	uint32_t nt_enc;
+	uint8_t pending_cmd;
+	uint8_t pending_block;
+} Decoder;
+
+static bool is_session_start(const TraceFrame& f) {
+	return (f.direction == TRACE_READER_TO_TAG) && (f.bits == 7) && ((f.data[0] == 0x26) || (f.data[0] == 0x52));
+}
+
+static void decoder_reset(Decoder* d) {
+	d->state = DS_PLAIN;
+	d->nested = false;
+	d->have_uid = false;
+	d->uid_length = 0;
+	d->pending_cmd = 0;
+}
+
+static bool check_crc(const uint8_t* data, size_t length) {
+	if (length < 3)
+		return false;
+	uint16_t crc = 0x6363;
+	for (size_t i = 0; i < length - 2; i++) {
+		uint8_t b = data[i] ^ (uint8_t) crc;
+		b ^= b << 4;
+		crc = (crc >> 8) ^ (b << 8) ^ (b << 3) ^ (b >> 4);
+	}
+	return (data[length-2] == (uint8_t) crc) && (data[length-1] == (uint8_t) (crc >> 8));
+}
+
+static string hex(const uint8_t* data, size_t length) {
+	static const char table[] = "0123456789ABCDEF";
+	string s;
+	for (size_t i = 0; i < length; i++) {
+		if (i)
+			s += ' ';
+		s += table[data[i] >> 4];
+		s += table[data[i] & 15];
+	}
+	return s;
+}
+
+static const char* command_name(uint8_t cmd) {
+	switch (cmd) {
+	case 0x30: return "READ";
+	case 0xA0: return "WRITE";
+	case 0xB0: return "TRANSFER";
+	case 0xC0: return "DECREMENT";
+	case 0xC1: return "INCREMENT";
+	case 0xC2: return "RESTORE";
+	}
+	return NULL;
+}
+
+static void decrypt_frame(Decoder* d, uint8_t* data, uint16_t bits) {
+	if (bits < 8) {
+		uint8_t plain = 0;
+		for (int i = 0; i < bits; i++)
+			plain |= ((data[0] >> i & 1) ^ crypto1_bit(&d->cs, 0, false)) << i;
+		data[0] = plain;
+		return;
+	}
+	for (size_t i = 0; i < (size_t) bits / 8; i++)
+		data[i] ^= crypto1_byte(&d->cs, 0, false);
+}
+
+// Tries every candidate key on the reader's {nr}{ar}, a key fits when ar decrypts to suc64(nt).
+static bool find_key(Decoder* d, const vector<uint64_t>& keys, const uint8_t* nrar, uint64_t* key) {
+	uint32_t nr_enc = word_from_bytes(nrar);
+	uint32_t ar_enc = word_from_bytes(nrar + 4);
+	for (size_t i = 0; i < keys.size(); i++) {
+		Crypto1State s;
+		uint32_t nt = d->nt;
+		crypto1_init(&s, keys[i]);
+		if (d->nested)
+			nt = crypto1_word(&s, d->nt_enc ^ d->cuid, true) ^ d->nt_enc;
+		else
+			crypto1_word(&s, d->cuid ^ nt, false);
+		crypto1_word(&s, nr_enc, true);
+		if ((ar_enc ^ crypto1_word(&s, 0, false)) == prng_successor(nt, 64)) {
+			d->cs = s;
+			d->nt = nt;
+			*key = keys[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+static void decode_frame(Decoder* d, const TraceFrame& f, const vector<uint64_t>& keys, ostream& out, TraceDecodeStats* stats) {
+	uint8_t data[MAX_TRACE_FRAME];
+	size_t length = trace_frame_bytes(f);
+	bool reader = (f.direction == TRACE_READER_TO_TAG);
+	memcpy(data, f.data, length);
+
+	if (is_session_start(f))
+		decoder_reset(d);
+
+	bool encrypted = (d->state == DS_ENCRYPTED) || (d->state == DS_WRITE_DATA) || (d->state == DS_VALUE_DATA);
+	if (encrypted)
+		decrypt_frame(d, data, f.bits);
+
+	char prefix[32];
+	snprintf(prefix, sizeof(prefix), "%14.6f  %s  ", f.timestamp / 1e6, reader ? "R" : "T");
+	out << prefix;
+	ostringstream desc;
+
+	if (is_session_start(f))
+		desc << (data[0] == 0x26 ? "REQA" : "WUPA");
+	else if (d->state == DS_LOST)
+		desc << "? (encrypted)";
+	else if (d->state == DS_AUTH_NT && !reader && (f.bits == 32)) {
+		if (d->nested) {
+			d->nt_enc = word_from_bytes(data);
+			desc << "NONCE (encrypted)";
+		} else {
+			d->nt = word_from_bytes(data);
+			desc << "NONCE";
+		}
+		d->state = DS_AUTH_NRAR;
+	} else if (d->state == DS_AUTH_NRAR && reader && (f.bits == 64)) {
+		uint64_t key;
+		if (d->have_uid && find_key(d, keys, data, &key)) {
+			char k[16];
+			snprintf(k, sizeof(k), "%012llX", (unsigned long long) key);
+			desc << "READER NONCE + ANSWER (key " << k << ")";
+			d->state = DS_AUTH_AT;
+		} else {
+			desc << "READER NONCE + ANSWER (" << (d->have_uid ? "no known key matches" : "UID unknown") << ")";
+			stats->failed_authentications++;
+			d->state = DS_LOST;
+		}
+	} else if (d->state == DS_AUTH_AT && !reader && (f.bits == 32)) {
+		uint32_t at = word_from_bytes(data) ^ crypto1_word(&d->cs, 0, false);
+		if (at == prng_successor(d->nt, 96)) {
+			desc << "TAG ANSWER, authenticated";
+			stats->authentications++;
+		} else
+			desc << "TAG ANSWER, does not match (desynchronized?)";
+		d->state = DS_ENCRYPTED;
+	} else if (encrypted && !reader && (f.bits == 4)) {
+		bool ack = (data[0] == 0x0A);
+		desc << (ack ? "ACK" : "NAK");
+		if (!ack)
+			d->state = DS_LOST;
+		else if (d->pending_cmd == 0xA0)
+			d->state = DS_WRITE_DATA;
+		else if ((d->pending_cmd >= 0xC0) && (d->pending_cmd <= 0xC2))
+			d->state = DS_VALUE_DATA;
+	} else if ((d->state == DS_WRITE_DATA) && reader && (length == 18)) {
+		desc << "DATA " << hex(data, 16) << " for block " << (unsigned) d->pending_block << (check_crc(data, 18) ? "" : " (CRC error)");
+		d->pending_cmd = 0;
+		d->state = DS_ENCRYPTED;
+	} else if ((d->state == DS_VALUE_DATA) && reader && (length == 6)) {
+		int32_t value = (int32_t) (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24);
+		desc << "OPERAND " << value << (check_crc(data, 6) ? "" : " (CRC error)");
+		d->pending_cmd = 0;
+		d->state = DS_ENCRYPTED;
+	} else if (encrypted && !reader && (length == 18)) {
+		desc << "DATA " << hex(data, 16) << (check_crc(data, 18) ? "" : " (CRC error)");
+	} else if (reader && (length == 4) && ((data[0] == 0x60) || (data[0] == 0x61))) {
+		desc << (encrypted ? "NESTED " : "") << "AUTH-" << (data[0] == 0x60 ? "A" : "B") << " block " << (unsigned) data[1];
+		d->nested = encrypted;
+		d->state = DS_AUTH_NT;
+	} else if (reader && (length == 4) && (data[0] == 0x50) && (data[1] == 0x00)) {
+		desc << "HALT";
+		d->state = DS_PLAIN;
+	} else if (reader && (length == 4) && command_name(data[0])) {
+		desc << command_name(data[0]) << " block " << (unsigned) data[1] << (check_crc(data, 4) ? "" : " (CRC error)");
+		d->pending_cmd = data[0];
+		d->pending_block = data[1];
+	} else if (!encrypted && reader && (length == 2) && ((data[0] | 0x06) == 0x97) && (data[1] == 0x20)) {
+		desc << "ANTICOLLISION CL" << ((data[0] - 0x93) / 2 + 1);
+	} else if (!encrypted && reader && (length == 9) && ((data[0] | 0x06) == 0x97) && (data[1] == 0x70)) {
+		// Cascade level 1 restarts the UID, a leading cascade tag 0x88 means more levels follow.
+		if (data[0] == 0x93)
+			d->uid_length = 0;
+		bool cascade = (data[2] == 0x88) && (data[0] != 0x97);
+		for (int i = cascade ? 3 : 2; (i < 6) && (d->uid_length < 10); i++)
+			d->uid[d->uid_length++] = data[i];
+		d->cuid = word_from_bytes(data + 2);
+		d->have_uid = !cascade;
+		desc << "SELECT CL" << ((data[0] - 0x93) / 2 + 1);
+		if (d->have_uid)
+			desc << ", UID " << hex(d->uid, d->uid_length);
+	} else if (!encrypted && !reader && (length == 2))
+		desc << "ATQA";
+	else if (!encrypted && !reader && (length == 5))
+		desc << "UID + BCC";
+	else if (!encrypted && !reader && (length == 3))
+		desc << "SAK";
+	else
+		desc << "?";
+
+	out << desc.str() << "  [" << hex(data, length) << (f.bits % 8 ? " / " : "");
+	if (f.bits % 8)
+		out << (f.bits) << " bits";
+	out << "]" << endl;
+}
+
+static void decode_chunk(const TraceChunk& chunk, const vector<uint64_t>& keys, DecodedChunk* result) {
+	memset(&result->stats, 0, sizeof(result->stats));
+	ostringstream out;
+	Decoder d;
+	decoder_reset(&d);
+	if (chunk.continued) {
+		d.state = DS_LOST;
+		out << "-- trace cut inside a long session, decoding resumes at the next REQA/WUPA" << endl;
+	}
+	// Sessions in which the tag never answered are reader polling, not worth printing.
+	size_t begin = 0;
+	while (begin < chunk.frames.size()) {
+		size_t end = begin + 1;
+		while ((end < chunk.frames.size()) && !is_session_start(chunk.frames[end]))
+			end++;
+		bool answered = false;
+		for (size_t i = begin; i < end; i++)
+			answered = answered || (chunk.frames[i].direction == TRACE_TAG_TO_READER);
+		if (answered) {
+			if (is_session_start(chunk.frames[begin])) {
+				char header[48];
+				snprintf(header, sizeof(header), "-- session at %.6f s", chunk.frames[begin].timestamp / 1e6);
+				result->stats.sessions++;
+				out << header << endl;
+			}
+			for (size_t i = begin; i < end; i++)
+				decode_frame(&d, chunk.frames[i], keys, out, &result->stats);
+		}
+		begin = end;
+	}
+	result->text = out.str();
+}
+
+bool decode_trace(const char* filename, const TraceDecodeOptions& options, ostream& out, TraceDecodeStats* stats) {
+	TraceReader reader;
+	if (!trace_open(&reader, filename))
+		return false;
+	memset(stats, 0, sizeof(*stats));
+
+	unsigned threads = options.threads ? options.threads : thread::hardware_concurrency();
+	if (threads == 0)
+		threads = 1;
+	const uint64_t max_in_flight = threads * 2 + 2;	// bounds memory use to a few chunks
+
+	mutex lock;
+	condition_variable work_ready, result_ready, space_ready;
+	deque<TraceChunk*> work;
+	map<uint64_t, DecodedChunk*> results;
+	uint64_t produced = 0, printed = 0;
+	bool done_reading = false;
+
+	vector<thread> workers;
+	for (unsigned t = 0; t < threads; t++)
+		workers.push_back(thread([&]() {
+			while (true) {
+				TraceChunk* chunk;
+				{
+					unique_lock<mutex> guard(lock);
+					work_ready.wait(guard, [&]() { return !work.empty() || done_reading; });
+					if (work.empty())
+						return;
+					chunk = work.front();
+					work.pop_front();
+				}
+				DecodedChunk* result = new DecodedChunk;
+				decode_chunk(*chunk, options.keys, result);
+				unique_lock<mutex> guard(lock);
+				results[chunk->index] = result;
+				delete chunk;
+				result_ready.notify_one();
+			}
+		}));
+
+	thread writer([&]() {
+		unique_lock<mutex> guard(lock);
+		while (true) {
+			result_ready.wait(guard, [&]() { return results.count(printed) || (done_reading && (printed == produced)); });
+			if (!results.count(printed))
+				return;
+			DecodedChunk* result = results[printed];
+			results.erase(printed);
+			guard.unlock();
+			out << result->text;
+			guard.lock();
+			stats->sessions += result->stats.sessions;
+			stats->authentications += result->stats.authentications;
+			stats->failed_authentications += result->stats.failed_authentications;
+			delete result;
+			printed++;
+			space_ready.notify_one();
+		}
+	});
+
+	TraceChunk* chunk = NULL;
+	TraceFrame frame;
+	bool continued = false;
+	while (true) {
+		bool have_frame = trace_read(&reader, &frame);
+		if (have_frame)
+			stats->frames++;
+		bool full = chunk && ((chunk->frames.size() >= MAX_CHUNK_FRAMES) || ((chunk->frames.size() >= CHUNK_FRAMES) && is_session_start(frame)));
+		if (chunk && (!have_frame || full)) {
+			if (have_frame)
+				continued = !is_session_start(frame);
+			unique_lock<mutex> guard(lock);
+			space_ready.wait(guard, [&]() { return produced - printed < max_in_flight; });
+			chunk->index = produced++;
+			work.push_back(chunk);
+			work_ready.notify_one();
+			chunk = NULL;
+		}
+		if (!have_frame)
+			break;
+		if (!chunk) {
+			chunk = new TraceChunk;
+			chunk->continued = (stats->frames == 1) ? !is_session_start(frame) : continued;
+			chunk->frames.reserve(CHUNK_FRAMES);
+		}
+		chunk->frames.push_back(frame);
+	}
+	stats->truncated = !reader.eof;
+	stats->bytes = trace_position(&reader);
+	trace_close(&reader);
+
+	{
+		unique_lock<mutex> guard(lock);
+		done_reading = true;
+		work_ready.notify_all();
+		result_ready.notify_all();
+	}
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+	{
+		unique_lock<mutex> guard(lock);
+		result_ready.notify_all();
+	}
+	writer.join();
+	return true;
+}
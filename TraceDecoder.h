@@ -0,0 +1,33 @@
+// TraceDecoder.h : Offline decoder for captured ISO14443A / MIFARE Classic traffic.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#ifndef _MICMD_TRACE_DECODER_H_
+#define _MICMD_TRACE_DECODER_H_
+
+#include <stdint.h>
+#include <ostream>
+#include <vector>
+
+typedef struct {
+	std::vector<uint64_t> keys;	// candidate keys, tried on every authentication
+	unsigned threads;		// decoding threads, 0 = one per core
+} TraceDecodeOptions;
+
+typedef struct {
+	uint64_t frames;
+	uint64_t sessions;
+	uint64_t authentications;
+	uint64_t failed_authentications;	// no candidate key matched
+	uint64_t bytes;
+	bool truncated;			// the file ended with a malformed record
+} TraceDecodeStats;
+
+// Streams the trace through a bounded pipeline: the calling thread reads and cuts the
+// file on session boundaries (REQA/WUPA), worker threads decode the pieces and a writer
+// thread prints them in the original order.
+bool decode_trace(const char* filename, const TraceDecodeOptions& options, std::ostream& out, TraceDecodeStats* stats);
+
+#endif // _MICMD_TRACE_DECODER_H_
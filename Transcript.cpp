@@ -0,0 +1,297 @@
+// Transcript.cpp : Recording of the libnfc calls of a session, and their replay without a reader.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#include "stdafx.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <random>
+#include <thread>
+
+#include "Transcript.h"
+
+using namespace std;
+
+const size_t TRANSCRIPT_BUFFER_SIZE = 1 << 16;
+
+const char* transcript_call_name(uint8_t call) {
+	switch (call) {
+	case CALL_CONNECT: return "connect";
+	case CALL_INIT: return "init";
+	case CALL_CONFIGURE: return "configure";
+	case CALL_SELECT: return "select";
+	case CALL_DESELECT: return "deselect";
+	case CALL_HALT: return "halt";
+	case CALL_MIFARE: return "mifare";
+	}
+	return "?";
+}
+
+// Bytes of the parameter a command sends and answers. The rest is not recorded or compared,
+// e.g. a read sends an uninitialized parameter.
+static size_t sent_length(uint8_t cmd) {
+	switch (cmd) {
+	case MC_AUTH_A: case MC_AUTH_B: return 10;	// key and UID
+	case MC_WRITE: return 16;
+	case MC_INCREMENT: case MC_DECREMENT: case MC_STORE: return 4;
+	}
+	return 0;
+}
+
+static size_t answer_length(uint8_t cmd) {
+	return (cmd == MC_READ) ? 16 : 0;
+}
+
+// The sent parameter as it is recorded and compared, an authentication key only as its hash.
+static void recorded_parameter(const AesCmac* key_hash, uint8_t cmd, const mifare_param* sent, uint8_t out[16]) {
+	memset(out, 0, 16);
+	if ((cmd == MC_AUTH_A) || (cmd == MC_AUTH_B)) {
+		uint8_t mac[16];
+		aes_cmac(key_hash, sent->mpa.abtKey, sizeof(sent->mpa.abtKey), mac);
+		memcpy(out, mac, 8);
+		memcpy(out + 8, sent->mpa.abtUid, 4);
+	}
+	else
+		memcpy(out, sent, sent_length(cmd));
+}
+
+bool transcript_create(TranscriptWriter* w, const char* filename) {
+	w->records = 0;
+	w->failed = false;
+	w->origin = chrono::steady_clock::now();
+	w->file = fopen(filename, "wb");
+	if (!w->file)
+		return false;
+	setvbuf(w->file, NULL, _IOFBF, TRANSCRIPT_BUFFER_SIZE);
+	uint8_t header[TRANSCRIPT_HEADER_SIZE];
+	memcpy(header, TRANSCRIPT_MAGIC, 4);
+	random_device random;
+	for (int i = 4; i < TRANSCRIPT_HEADER_SIZE; i++)
+		header[i] = (uint8_t) random();
+	aes_cmac_init(&w->key_hash, header + 4);
+	if (fwrite(header, 1, sizeof(header), w->file) != sizeof(header)) {
+		fclose(w->file);
+		w->file = NULL;
+		return false;
+	}
+	return true;
+}
+
+uint64_t transcript_now(const TranscriptWriter* w) {
+	return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - w->origin).count();
+}
+
+static void begin_record(TranscriptRecord* r, TranscriptCall call, bool ok) {
+	memset(r, 0, sizeof(*r));
+	r->call = (uint8_t) call;
+	r->ok = ok ? 1 : 0;
+}
+
+// Written right after the call returned, so the call took until now.
+static void write_record(TranscriptWriter* w, TranscriptRecord* r, uint64_t start_us) {
+	r->start_us = start_us;
+	r->duration_us = (uint32_t) min(transcript_now(w) - start_us, (uint64_t) 0xFFFFFFFF);
+	uint8_t b[TRANSCRIPT_RECORD_SIZE];
+	b[0] = r->call;
+	b[1] = r->ok;
+	b[2] = r->arg;
+	b[3] = r->block;
+	for (int i = 0; i < 4; i++)
+		b[4 + i] = (uint8_t) (r->duration_us >> (8 * i));
+	for (int i = 0; i < 8; i++)
+		b[8 + i] = (uint8_t) (r->start_us >> (8 * i));
+	memcpy(b + 16, r->data, 32);
+	w->records++;
+	if (fwrite(b, 1, sizeof(b), w->file) != sizeof(b))
+		w->failed = true;
+}
+
+void transcript_connect(TranscriptWriter* w, uint64_t start_us, const char* device_name, bool ok) {
+	TranscriptRecord r;
+	begin_record(&r, CALL_CONNECT, ok);
+	if (device_name)
+		snprintf((char*) r.data, sizeof(r.data), "%s", device_name);
+	write_record(w, &r, start_us);
+}
+
+void transcript_call(TranscriptWriter* w, uint64_t start_us, TranscriptCall call, bool ok) {
+	TranscriptRecord r;
+	begin_record(&r, call, ok);
+	write_record(w, &r, start_us);
+}
+
+void transcript_configure(TranscriptWriter* w, uint64_t start_us, nfc_device_option_t option, bool enable, bool ok) {
+	TranscriptRecord r;
+	begin_record(&r, CALL_CONFIGURE, ok);
+	r.arg = (uint8_t) option;
+	r.block = enable ? 1 : 0;
+	write_record(w, &r, start_us);
+}
+
+void transcript_select(TranscriptWriter* w, uint64_t start_us, const uint8_t* uid, size_t uid_length,
+	const nfc_target_info_t* target, bool ok) {
+	TranscriptRecord r;
+	begin_record(&r, CALL_SELECT, ok);
+	r.arg = (uint8_t) min(uid_length, (size_t) 10);
+	if (uid)
+		memcpy(r.data, uid, r.arg);
+	if (ok) {
+		const nfc_iso14443a_info_t& nai = target->nai;
+		memcpy(r.data + 10, nai.abtAtqa, 2);
+		r.data[12] = nai.btSak;
+		r.data[13] = (uint8_t) min(nai.szUidLen, (size_t) 10);
+		memcpy(r.data + 14, nai.abtUid, r.data[13]);
+	}
+	write_record(w, &r, start_us);
+}
+
+void transcript_mifare(TranscriptWriter* w, uint64_t start_us, mifare_cmd cmd, uint8_t block,
+	const mifare_param* sent, const mifare_param* param, bool ok) {
+	TranscriptRecord r;
+	begin_record(&r, CALL_MIFARE, ok);
+	r.arg = (uint8_t) cmd;
+	r.block = block;
+	recorded_parameter(&w->key_hash, cmd, sent, r.data);
+	if (ok)
+		memcpy(r.data + 16, param, answer_length(cmd));
+	write_record(w, &r, start_us);
+}
+
+bool transcript_finish(TranscriptWriter* w) {
+	if (!w->file)
+		return !w->failed;
+	bool ok = (fflush(w->file) == 0) && !w->failed;
+	ok = (fclose(w->file) == 0) && ok;
+	w->file = NULL;
+	return ok;
+}
+
+bool transcript_load(TranscriptReplay* r, const char* filename, double speed) {
+	r->records.clear();
+	r->next = 0;
+	r->speed = speed;
+	r->mismatches = 0;
+	r->past_end = 0;
+	r->first_mismatch[0] = 0;
+	r->device_name[0] = 0;
+	FILE* f = fopen(filename, "rb");
+	if (!f)
+		return false;
+	uint8_t header[TRANSCRIPT_HEADER_SIZE];
+	bool ok = (fread(header, 1, sizeof(header), f) == sizeof(header)) && (memcmp(header, TRANSCRIPT_MAGIC, 4) == 0);
+	if (ok)
+		aes_cmac_init(&r->key_hash, header + 4);
+	uint8_t b[TRANSCRIPT_RECORD_SIZE];
+	size_t n = 0;
+	while (ok && ((n = fread(b, 1, sizeof(b), f)) == sizeof(b))) {
+		TranscriptRecord rec;
+		rec.call = b[0];
+		rec.ok = b[1];
+		rec.arg = b[2];
+		rec.block = b[3];
+		rec.duration_us = 0;
+		for (int i = 3; i >= 0; i--)
+			rec.duration_us = rec.duration_us << 8 | b[4 + i];
+		rec.start_us = 0;
+		for (int i = 7; i >= 0; i--)
+			rec.start_us = rec.start_us << 8 | b[8 + i];
+		memcpy(rec.data, b + 16, 32);
+		ok = (rec.call <= CALL_MIFARE);
+		r->records.push_back(rec);
+	}
+	// A truncated last record is malformed, a clean end of file reads nothing.
+	ok = ok && (n == 0);
+	fclose(f);
+	return ok;
+}
+
+// Reader calls take a few ms: sleeping alone would add the scheduler's wake-up delay to every
+// one of them, so the last stretch is spun.
+static void wait_for(const TranscriptReplay* r, const TranscriptRecord& rec) {
+	if (r->speed <= 0)
+		return;
+	chrono::steady_clock::time_point until = chrono::steady_clock::now()
+		+ chrono::nanoseconds((int64_t) (rec.duration_us * 1000.0 / r->speed));
+	chrono::steady_clock::duration left = until - chrono::steady_clock::now();
+	if (left > chrono::milliseconds(2))
+		this_thread::sleep_for(left - chrono::milliseconds(1));
+	while (chrono::steady_clock::now() < until)
+		;
+}
+
+// The next record if it is the call being made, NULL (the call fails) otherwise. The first
+// length bytes of data must match.
+static const TranscriptRecord* next_record(TranscriptReplay* r, TranscriptCall call, uint8_t arg, uint8_t block,
+	const uint8_t* data, size_t length) {
+	if (r->next >= r->records.size()) {
+		r->past_end++;
+		return NULL;
+	}
+	const TranscriptRecord* rec = &r->records[r->next++];
+	wait_for(r, *rec);
+	if ((rec->call != call) || (rec->arg != arg) || (rec->block != block) || (length && (memcmp(rec->data, data, length) != 0))) {
+		if (r->mismatches++ == 0)
+			snprintf(r->first_mismatch, sizeof(r->first_mismatch), "call %u: %s %02X/%u recorded, %s %02X/%u made",
+				(unsigned) r->next, transcript_call_name(rec->call), rec->arg, rec->block, transcript_call_name(call), arg, block);
+		return NULL;
+	}
+	return rec;
+}
+
+bool replay_connect(TranscriptReplay* r) {
+	const TranscriptRecord* rec = next_record(r, CALL_CONNECT, 0, 0, NULL, 0);
+	if (!rec || !rec->ok)
+		return false;
+	memcpy(r->device_name, rec->data, sizeof(r->device_name));
+	r->device_name[sizeof(r->device_name) - 1] = 0;
+	return true;
+}
+
+bool replay_init(TranscriptReplay* r) {
+	const TranscriptRecord* rec = next_record(r, CALL_INIT, 0, 0, NULL, 0);
+	return rec && rec->ok;
+}
+
+bool replay_configure(TranscriptReplay* r, nfc_device_option_t option, bool enable) {
+	const TranscriptRecord* rec = next_record(r, CALL_CONFIGURE, (uint8_t) option, enable ? 1 : 0, NULL, 0);
+	return rec && rec->ok;
+}
+
+bool replay_select(TranscriptReplay* r, const uint8_t* uid, size_t uid_length, nfc_target_info_t* target) {
+	uint8_t asked[10];
+	memset(asked, 0, sizeof(asked));
+	uid_length = min(uid_length, sizeof(asked));
+	if (uid)
+		memcpy(asked, uid, uid_length);
+	const TranscriptRecord* rec = next_record(r, CALL_SELECT, (uint8_t) uid_length, 0, asked, sizeof(asked));
+	if (!rec || !rec->ok)
+		return false;
+	memset(target, 0, sizeof(*target));
+	memcpy(target->nai.abtAtqa, rec->data + 10, 2);
+	target->nai.btSak = rec->data[12];
+	target->nai.szUidLen = min(rec->data[13], (uint8_t) 10);
+	memcpy(target->nai.abtUid, rec->data + 14, target->nai.szUidLen);
+	return true;
+}
+
+void replay_deselect(TranscriptReplay* r) {
+	next_record(r, CALL_DESELECT, 0, 0, NULL, 0);
+}
+
+void replay_halt(TranscriptReplay* r) {
+	next_record(r, CALL_HALT, 0, 0, NULL, 0);
+}
+
+bool replay_mifare_cmd(TranscriptReplay* r, mifare_cmd cmd, uint8_t block, mifare_param* param) {
+	uint8_t sent[16];
+	recorded_parameter(&r->key_hash, cmd, param, sent);
+	const TranscriptRecord* rec = next_record(r, CALL_MIFARE, (uint8_t) cmd, block, sent, sizeof(sent));
+	if (!rec || !rec->ok)
+		return false;
+	memcpy(param, rec->data + 16, answer_length(cmd));
+	return true;
+}
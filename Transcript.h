@@ -0,0 +1,115 @@
+// Transcript.h : Recording of the libnfc calls of a session, and their replay without a reader.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+#ifndef _MICMD_TRANSCRIPT_H_
+#define _MICMD_TRANSCRIPT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <chrono>
+#include <vector>
+
+#include "Aes.h"
+
+extern "C" {
+#include <nfc/nfc.h>
+}
+
+// File layout, all numbers little endian:
+//   header : "MCR2", 16 random bytes, the key of the key hash
+//   record : uint8 call, uint8 ok, uint8 arg, uint8 block, uint32 duration [us],
+//            uint64 start [us since the recording started], 32 data bytes.
+// arg and data by call:
+//   connect   : data is the device name, NUL padded
+//   configure : arg the option, block 1 to enable and 0 to disable
+//   select    : arg the length of the UID asked for (0 for any tag), data[0..9] that UID,
+//               data[10..11] ATQA, data[12] SAK, data[13] UID length, data[14..23] UID answered
+//   mifare    : arg the command, block the block, data[0..15] the parameter sent,
+//               data[16..31] the parameter answered. An authentication stores the key hash
+//               in data[0..7] and the UID in data[8..11], never the key itself.
+//   init, deselect, halt : nothing
+// The key hash is the AES-CMAC of the key under the file's own random key, truncated to 8
+// bytes. A replay compares hashes. MIFARE keys are 48 bits, so whoever has the transcript can
+// still search the key from its hash: transcripts of real cards remain sensitive.
+
+#define TRANSCRIPT_MAGIC "MCR2"
+#define TRANSCRIPT_HEADER_SIZE 20
+#define TRANSCRIPT_RECORD_SIZE 48
+
+typedef enum {
+	CALL_CONNECT,
+	CALL_INIT,
+	CALL_CONFIGURE,
+	CALL_SELECT,
+	CALL_DESELECT,
+	CALL_HALT,
+	CALL_MIFARE
+} TranscriptCall;
+
+typedef struct {
+	uint8_t call;		// TranscriptCall
+	uint8_t ok;
+	uint8_t arg;
+	uint8_t block;
+	uint32_t duration_us;
+	uint64_t start_us;
+	uint8_t data[32];
+} TranscriptRecord;
+
+const char* transcript_call_name(uint8_t call);
+
+typedef struct TranscriptWriter {
+	FILE* file;
+	AesCmac key_hash;
+	std::chrono::steady_clock::time_point origin;
+	uint64_t records;
+	bool failed;
+} TranscriptWriter;
+
+bool transcript_create(TranscriptWriter* w, const char* filename);
+// Microseconds since the recording started, the start of a call.
+uint64_t transcript_now(const TranscriptWriter* w);
+// Each records one finished call that started at start_us, with its arguments and result.
+void transcript_connect(TranscriptWriter* w, uint64_t start_us, const char* device_name, bool ok);
+void transcript_call(TranscriptWriter* w, uint64_t start_us, TranscriptCall call, bool ok);
+void transcript_configure(TranscriptWriter* w, uint64_t start_us, nfc_device_option_t option, bool enable, bool ok);
+void transcript_select(TranscriptWriter* w, uint64_t start_us, const uint8_t* uid, size_t uid_length,
+	const nfc_target_info_t* target, bool ok);
+// sent is the parameter as it was before the call, param as it came back.
+void transcript_mifare(TranscriptWriter* w, uint64_t start_us, mifare_cmd cmd, uint8_t block,
+	const mifare_param* sent, const mifare_param* param, bool ok);
+// Returns false if any record could not be written.
+bool transcript_finish(TranscriptWriter* w);
+
+// A replay answers every call with the next record, after as long as the recorded call took
+// divided by speed. Time between calls is the host's own and is not reproduced. A call that
+// differs from the recorded one (another call, option, block, key or data) fails, as does any
+// call past the end; the replay goes on with the next record.
+typedef struct TranscriptReplay {
+	std::vector<TranscriptRecord> records;
+	AesCmac key_hash;
+	size_t next;
+	double speed;		// 1 the recorded timing, 10 ten times faster, 0 no waiting at all
+	uint64_t mismatches;	// calls that differed from the recording
+	uint64_t past_end;	// calls made after the last record
+	char first_mismatch[96];
+	char device_name[32];
+} TranscriptReplay;
+
+// Reads the whole transcript, false if it cannot be read or is malformed.
+bool transcript_load(TranscriptReplay* r, const char* filename, double speed);
+
+// The libnfc calls a session makes, answered from the transcript.
+bool replay_connect(TranscriptReplay* r);
+bool replay_init(TranscriptReplay* r);
+bool replay_configure(TranscriptReplay* r, nfc_device_option_t option, bool enable);
+bool replay_select(TranscriptReplay* r, const uint8_t* uid, size_t uid_length, nfc_target_info_t* target);
+void replay_deselect(TranscriptReplay* r);
+void replay_halt(TranscriptReplay* r);
+bool replay_mifare_cmd(TranscriptReplay* r, mifare_cmd cmd, uint8_t block, mifare_param* param);
+
+#endif // _MICMD_TRANSCRIPT_H_
@@ -0,0 +1,121 @@
+// AllocTest.cpp : Checks that reads, writes and value operations of a session allocate nothing.
+//
+/*
+* This program is released under GPLv3 license ( http://www.gnu.org/licenses/gpl-3.0.txt )
+*/
+
+// Drives a session against the simulated reader, with the global operator new and delete
+// replaced by counting ones. Build it next to the sources it tests, e.g.
+//   g++ -I.. AllocTest.cpp ../MiSession.cpp ../SimReader.cpp ../CardImage.cpp
+//       ../Planner.cpp ../Transcript.cpp ../Aes.cpp -lnfc -o AllocTest
+// and run it: it prints every operation that allocated and exits with 1 if any did.
+
+#include "stdafx.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+#include "CardImage.h"
+#include "MiSession.h"
+#include "SimReader.h"
+
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+	allocations++;
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+	free(p);
+}
+
+void operator delete[](void* p) noexcept {
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+	free(p);
+}
+
+static const uint8_t KEY[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+static const uint8_t VALUE_BLOCK = 5;
+
+static int failures = 0;
+
+// Runs one operation and reports it if it allocated or did not succeed.
+#define EXPECT_NO_ALLOCATION(name, call) do { \
+	size_t before = allocations; \
+	mi_status status = (call); \
+	size_t count = allocations - before; \
+	if ((status != MI_OK) || count) { \
+		printf("FAIL %-12s %s, %u allocation(s)\n", name, mi_status_text(status), (unsigned) count); \
+		failures++; \
+	} else \
+		printf("ok   %-12s\n", name); \
+} while (0)
+
+// A blank 1K card with transport keys and a value block of 100 in block 5.
+static void blank_card(CardImage* image) {
+	static const uint8_t trailer[16] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x07, 0x80, 0x69,
+		0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+	static const uint8_t manufacturer[16] = { 0x01, 0x02, 0x03, 0x04, 0x04, 0x08, 0x04, 0x00 };
+	static const uint8_t value[16] = { 0x64, 0x00, 0x00, 0x00, 0x9B, 0xFF, 0xFF, 0xFF, 0x64, 0x00, 0x00, 0x00,
+		VALUE_BLOCK, (uint8_t) ~VALUE_BLOCK, VALUE_BLOCK, (uint8_t) ~VALUE_BLOCK };
+	memset(image, 0, sizeof(*image));
+	image->size = MIFARE_1K_SIZE;
+	memcpy(image->data, manufacturer, sizeof(manufacturer));
+	for (uint32_t block = 3; block < 64; block += 4)
+		memcpy(image->data + block * MIFARE_BLOCK_SIZE, trailer, sizeof(trailer));
+	memcpy(image->data + VALUE_BLOCK * MIFARE_BLOCK_SIZE, value, sizeof(value));
+}
+
+int main() {
+	CardImage image;
+	blank_card(&image);
+	SimFaults faults;
+	memset(&faults, 0, sizeof(faults));
+	SimReader* reader = new SimReader;
+	sim_init(reader, image, faults);
+	mi_session* session = mi_session_new();
+	mi_tag tag;
+	if ((mi_connect_simulator(session, reader) != MI_OK) || (mi_select(session, &tag) != MI_OK)) {
+		printf("FAIL no simulated tag\n");
+		return 1;
+	}
+
+	uint8_t data[16];
+	uint8_t amount[4] = { 1, 0, 0, 0 };
+	memset(data, 0x5A, sizeof(data));
+	// Each operation twice: the first may authenticate, the second finds the sector cached.
+	for (int round = 0; round < 2; round++) {
+		EXPECT_NO_ALLOCATION("authenticate", mi_authenticate(session, 1, MI_KEY_A, KEY));
+		EXPECT_NO_ALLOCATION("read", mi_read_block(session, 4, data));
+		EXPECT_NO_ALLOCATION("write", mi_write_block(session, 6, data));
+		EXPECT_NO_ALLOCATION("decrement", mi_value(session, MI_DECREMENT, VALUE_BLOCK, amount));
+		EXPECT_NO_ALLOCATION("transfer", mi_value(session, MI_TRANSFER, VALUE_BLOCK, amount));
+		EXPECT_NO_ALLOCATION("increment", mi_value(session, MI_INCREMENT, VALUE_BLOCK, amount));
+		EXPECT_NO_ALLOCATION("restore", mi_value(session, MI_RESTORE, VALUE_BLOCK, amount));
+		EXPECT_NO_ALLOCATION("transfer", mi_value(session, MI_TRANSFER, VALUE_BLOCK, amount));
+		EXPECT_NO_ALLOCATION("trailer read", mi_read_block(session, 7, data));
+	}
+
+	mi_session_free(session);
+	delete reader;
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+	return failures ? 1 : 0;
+}